@@ -0,0 +1,130 @@
+// Throughput of the chunked body decoder on a large body. The body is
+// encoded once for each chunk size, with an extension on every size line and
+// a trailer, then decoded in place from reads of a fixed size as an origin
+// stream would feed it.
+//
+//   make chunked-decode
+//   ./chunked-decode [body size] [read size]
+//
+// Sizes take the K, M and G suffixes, a 64M body in 64K reads by default.
+// Every chunk size is decoded three times and the no of decoded bytes is checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/http-framing.h"
+#include "../include/utils.h"
+
+#define BENCH_RUNS 3
+
+// room for the size lines and the trailer on top of the body
+#define ENCODING_SLACK (64 * 1024)
+
+static double elapsed_sec(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// chunked encoding of the body in out, returns its length
+static size_t encode_chunked(const char *body, size_t body_len, size_t chunk_size, char *out)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < body_len; i += chunk_size)
+    {
+        size_t n = body_len - i < chunk_size ? body_len - i : chunk_size;
+        len += sprintf(out + len, "%zx;ext=1\r\n", n);
+        memcpy(out + len, body + i, n);
+        len += n;
+        out[len++] = '\r';
+        out[len++] = '\n';
+    }
+
+    len += sprintf(out + len, "0\r\nX-Trailer: 1\r\n\r\n");
+    return len;
+}
+
+// decodes the encoding in place, returns the body bytes or -1 on error
+static long long decode_all(char *buf, size_t len, size_t read_size)
+{
+    ChunkDecoder decoder;
+    init_chunk_decoder(&decoder);
+
+    long long decoded = 0;
+    size_t pos = 0;
+    while (pos < len && !chunk_decoder_done(&decoder))
+    {
+        size_t n = len - pos < read_size ? len - pos : read_size;
+        size_t consumed;
+        ssize_t data = decode_chunked(&decoder, buf + pos, n, &consumed);
+        if (data < 0)
+            return -1;
+
+        decoded += data;
+        pos += consumed;
+    }
+
+    return chunk_decoder_done(&decoder) ? decoded : -1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t body_len = parse_size(argc > 1 ? argv[1] : NULL, 64 * 1024 * 1024);
+    size_t read_size = parse_size(argc > 2 ? argv[2] : NULL, 64 * 1024);
+    if (!body_len || !read_size)
+    {
+        fprintf(stderr, "usage: %s [body size] [read size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // 16 byte chunks nearly double the body with their size lines
+    size_t encoding_size = body_len * 2 + ENCODING_SLACK;
+    char *body = malloc(body_len);
+    char *encoded = malloc(encoding_size);
+    char *work = malloc(encoding_size);
+    if (!body || !encoded || !work)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < body_len; i++)
+        body[i] = (char)rand();
+
+    size_t chunk_sizes[] = {16, 1024, 16 * 1024, 1024 * 1024};
+    printf("%10s %12s %10s\n", "chunk", "encoded", "MB/s");
+    for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++)
+    {
+        size_t encoded_len = encode_chunked(body, body_len, chunk_sizes[c], encoded);
+
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; run++)
+        {
+            // decoding moves the data over the framing, every run starts from a fresh copy
+            memcpy(work, encoded, encoded_len);
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            long long decoded = decode_all(work, encoded_len, read_size);
+            double sec = elapsed_sec(&start);
+
+            if (decoded != (long long)body_len)
+            {
+                fprintf(stderr, "decoded %lld of %zu bytes with %zu byte chunks\n", decoded, body_len,
+                        chunk_sizes[c]);
+                return EXIT_FAILURE;
+            }
+            if (!run || sec < best)
+                best = sec;
+        }
+
+        printf("%10zu %12zu %10.0f\n", chunk_sizes[c], encoded_len, body_len / 1e6 / best);
+    }
+
+    free(body);
+    free(encoded);
+    free(work);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+// Load generator holding many clients open on the proxy at once from a single
+// epoll thread. All clients connect first, optionally stay idle for a while,
+// then each sends one GET and reads the response to the end.
+//
+//   make client-load
+//   ./client-load clients port path [idle ms] [first index]
+//
+// A %d in the path is replaced by the client's index counted from first
+// index, which gives every client a URL of its own. It prints how many
+// connected, how many got a 200 and how fast they were answered.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define LOAD_EVENTS 1024
+#define LOAD_READ_SIZE (64 * 1024)
+
+// a stalled proxy gives up the run after this
+#define LOAD_STALL_MS 20000
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// every client needs an fd of its own
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s clients port path [idle ms] [first index]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int n_clients = atoi(argv[1]);
+    int port = atoi(argv[2]);
+    const char *path = argv[3];
+    long idle_ms = argc > 4 ? atol(argv[4]) : 0;
+    int first_index = argc > 5 ? atoi(argv[5]) : 0;
+
+    raise_fd_limit();
+
+    int epfd = epoll_create1(0);
+    int *fds = calloc(n_clients, sizeof(int));
+    int *answered = calloc(n_clients, sizeof(int));
+    if (epfd < 0 || !fds || !answered)
+    {
+        perror("epoll_create1");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    long start = now_ms();
+    int opened = 0;
+    for (; opened < n_clients; opened++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+        {
+            perror("socket");
+            break;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+        {
+            perror("connect");
+            close(fd);
+            break;
+        }
+
+        fds[opened] = fd;
+        struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = opened};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    // writable once connected, from then on only the response matters
+    struct epoll_event events[LOAD_EVENTS];
+    int connected = 0;
+    while (connected < opened)
+    {
+        int n = epoll_wait(epfd, events, LOAD_EVENTS, LOAD_STALL_MS);
+        if (n <= 0)
+            break;
+
+        for (int i = 0; i < n; i++)
+        {
+            struct epoll_event ev = {.events = EPOLLIN, .data.u32 = events[i].data.u32};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fds[events[i].data.u32], &ev);
+            connected++;
+        }
+    }
+    printf("connected %d/%d in %ld ms\n", connected, n_clients, now_ms() - start);
+    fflush(stdout);
+
+    if (idle_ms)
+        usleep(idle_ms * 1000);
+
+    start = now_ms();
+    for (int i = 0; i < opened; i++)
+    {
+        char url[512], request[640];
+        snprintf(url, sizeof(url), path, first_index + i);
+        int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", url);
+        send(fds[i], request, len, MSG_NOSIGNAL);
+    }
+
+    // the proxy closes each client once its response is out
+    static char buf[LOAD_READ_SIZE];
+    int done = 0, ok = 0;
+    while (done < opened)
+    {
+        int n = epoll_wait(epfd, events, LOAD_EVENTS, LOAD_STALL_MS);
+        if (n <= 0)
+        {
+            printf("stalled with %d clients unanswered\n", opened - done);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            int c = events[i].data.u32;
+            while (1)
+            {
+                ssize_t got = recv(fds[c], buf, sizeof(buf), 0);
+                if (got > 0)
+                {
+                    if (!answered[c] && got >= 12 && memcmp(buf, "HTTP/1.1 200", 12) == 0)
+                        ok++;
+                    answered[c] = 1;
+                    continue;
+                }
+                if (got < 0 && errno == EAGAIN)
+                    break;
+
+                close(fds[c]);
+                done++;
+                break;
+            }
+        }
+    }
+
+    long elapsed = now_ms() - start;
+    printf("answered %d/%d with 200 in %ld ms, %.0f req/s\n", ok, opened, elapsed,
+           elapsed ? done * 1000.0 / elapsed : 0.0);
+
+    free(fds);
+    free(answered);
+    close(epfd);
+    return ok == opened ? EXIT_SUCCESS : EXIT_FAILURE;
+}
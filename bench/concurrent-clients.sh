@@ -0,0 +1,81 @@
+#!/bin/sh
+# Many clients held open on the proxy at once, all for one cached URL. First
+# they sit idle while the proxy's memory is read and a single hit is timed
+# through them, then they all send their request together. Further rounds of
+# the same number of clients follow without the idle wait.
+#
+#   make && make client-load && bench/concurrent-clients.sh [clients] [rounds] [idle ms]
+
+set -e
+
+CLIENTS=${1:-10000}
+ROUNDS=${2:-3}
+IDLE_MS=${3:-3000}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PROXY_PORT=${PROXY_PORT:-4141}
+ORIGIN_PORT=${ORIGIN_PORT:-4142}
+WORK_DIR=$(mktemp -d)
+
+cleanup()
+{
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+rss()
+{
+    awk '/VmRSS/ { printf "%.1fMB", $2 / 1024 }' "/proc/$PROXY_PID/status"
+}
+
+python3 - "$ORIGIN_PORT" <<'EOF' &
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+body = b"x" * 2048
+
+class Origin(BaseHTTPRequestHandler):
+    def do_GET(self):
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Cache-Control", "max-age=3600")
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Origin).serve_forever()
+EOF
+ORIGIN_PID=$!
+
+cp "$ROOT/blocked-sites.json" "$WORK_DIR/"
+cd "$WORK_DIR"
+PORT=$PROXY_PORT "$ROOT/server" > /dev/null 2>&1 &
+PROXY_PID=$!
+sleep 0.5
+
+URL="/?url=http://127.0.0.1:$ORIGIN_PORT/hit"
+curl -s -o /dev/null "http://127.0.0.1:$PROXY_PORT$URL"
+curl -s -o /dev/null "http://127.0.0.1:$PROXY_PORT$URL"
+echo "proxy RSS at start: $(rss)"
+
+# the clients idle once they are all connected, measured half way into that
+"$ROOT/client-load" "$CLIENTS" "$PROXY_PORT" "$URL" "$IDLE_MS" > "$WORK_DIR/load" &
+LOAD_PID=$!
+until grep -q connected "$WORK_DIR/load"; do sleep 0.1; done
+sleep $(echo "$IDLE_MS" | awk '{ print $1 / 2000 }')
+echo "proxy RSS with $CLIENTS idle clients: $(rss)"
+curl -s -o /dev/null -w "one hit with $CLIENTS idle clients: %{time_total}s\n" "http://127.0.0.1:$PROXY_PORT$URL"
+wait "$LOAD_PID"
+cat "$WORK_DIR/load"
+
+for r in $(seq 2 "$ROUNDS"); do
+    "$ROOT/client-load" "$CLIENTS" "$PROXY_PORT" "$URL"
+done
+
+sleep 1
+echo "proxy RSS after: $(rss)"
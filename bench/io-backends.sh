@@ -0,0 +1,128 @@
+#!/bin/sh
+# Proxy CPU time per request on each event loop backend, epoll and io_uring.
+# Hit heavy rounds send many concurrent clients for one cached URL, miss heavy
+# rounds send fewer for new URLs each, fetched from a keep-alive local origin.
+# One proxy of each backend runs side by side and their rounds alternate, so
+# drift in the machine's speed hits both alike. The proxies' RSS with the hit
+# clients held idle is shown as well.
+#
+#   make && make client-load && bench/io-backends.sh [hit clients] [miss clients] [rounds]
+
+set -e
+
+HIT_CLIENTS=${1:-10000}
+MISS_CLIENTS=${2:-2000}
+ROUNDS=${3:-3}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PROXY_PORT=${PROXY_PORT:-4141} # epoll, io_uring gets the next one
+ORIGIN_PORT=${ORIGIN_PORT:-4143}
+WORK_DIR=$(mktemp -d)
+TICK_US=$((1000000 / $(getconf CLK_TCK)))
+
+cleanup()
+{
+    kill $EPOLL_PID $URING_PID $ORIGIN_PID 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+# user and system clock ticks the proxy of pid $1 used so far
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+rss()
+{
+    awk '/VmRSS/ { printf "%.1fMB", $2 / 1024 }' "/proc/$1/status"
+}
+
+# starts a proxy of backend $1 on port $2 in a directory of its own
+start_proxy()
+{
+    mkdir -p "$WORK_DIR/$1"
+    cp "$ROOT/blocked-sites.json" "$WORK_DIR/$1/"
+    (cd "$WORK_DIR/$1" && PORT=$2 IO_BACKEND=$1 EVENT_LOOPS=1 exec "$ROOT/server" > /dev/null 2>&1) &
+}
+
+# one round of client-load with args $2.. against the proxy of pid $1, prints
+# the clock ticks it took
+round_ticks()
+{
+    pid=$1
+    shift
+    before=$(cpu_ticks "$pid")
+    "$ROOT/client-load" "$@" > /dev/null
+    echo $(($(cpu_ticks "$pid") - before))
+}
+
+# keep-alive origin so misses reuse upstream connections
+python3 - "$ORIGIN_PORT" <<'EOF' &
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+body = b"x" * 2048
+
+class Origin(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Cache-Control", "max-age=3600")
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+ThreadingHTTPServer.daemon_threads = True
+ThreadingHTTPServer.request_queue_size = 1024
+ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Origin).serve_forever()
+EOF
+ORIGIN_PID=$!
+
+start_proxy epoll "$PROXY_PORT"
+EPOLL_PID=$!
+start_proxy io_uring $((PROXY_PORT + 1))
+URING_PID=$!
+sleep 0.5
+
+HIT_URL="/?url=http://127.0.0.1:$ORIGIN_PORT/hit"
+for port in "$PROXY_PORT" $((PROXY_PORT + 1)); do
+    curl -s -o /dev/null "http://127.0.0.1:$port$HIT_URL"
+    curl -s -o /dev/null "http://127.0.0.1:$port$HIT_URL"
+done
+
+EPOLL_HIT=0 URING_HIT=0 EPOLL_MISS=0 URING_MISS=0
+for r in $(seq 1 "$ROUNDS"); do
+    EPOLL_HIT=$((EPOLL_HIT + $(round_ticks $EPOLL_PID "$HIT_CLIENTS" "$PROXY_PORT" "$HIT_URL")))
+    URING_HIT=$((URING_HIT + $(round_ticks $URING_PID "$HIT_CLIENTS" $((PROXY_PORT + 1)) "$HIT_URL")))
+
+    miss_url="/?url=http://127.0.0.1:$ORIGIN_PORT/$r/%d"
+    EPOLL_MISS=$((EPOLL_MISS + $(round_ticks $EPOLL_PID "$MISS_CLIENTS" "$PROXY_PORT" "$miss_url/e")))
+    URING_MISS=$((URING_MISS + $(round_ticks $URING_PID "$MISS_CLIENTS" $((PROXY_PORT + 1)) "$miss_url/u")))
+done
+
+# idle rss, each proxy holding the hit clients in turn
+"$ROOT/client-load" "$HIT_CLIENTS" "$PROXY_PORT" "$HIT_URL" 2000 > "$WORK_DIR/load" &
+LOAD_PID=$!
+until grep -q connected "$WORK_DIR/load"; do sleep 0.1; done
+sleep 1
+EPOLL_RSS=$(rss $EPOLL_PID)
+wait "$LOAD_PID"
+
+"$ROOT/client-load" "$HIT_CLIENTS" $((PROXY_PORT + 1)) "$HIT_URL" 2000 > "$WORK_DIR/load" &
+LOAD_PID=$!
+until grep -q connected "$WORK_DIR/load"; do sleep 0.1; done
+sleep 1
+URING_RSS=$(rss $URING_PID)
+wait "$LOAD_PID"
+
+printf '%10s %14s %15s %14s\n' backend "hit us/req" "miss us/req" "idle RSS"
+printf '%10s %14s %15s %14s\n' epoll $((EPOLL_HIT * TICK_US / (HIT_CLIENTS * ROUNDS))) \
+    $((EPOLL_MISS * TICK_US / (MISS_CLIENTS * ROUNDS))) "$EPOLL_RSS"
+printf '%10s %14s %15s %14s\n' io_uring $((URING_HIT * TICK_US / (HIT_CLIENTS * ROUNDS))) \
+    $((URING_MISS * TICK_US / (MISS_CLIENTS * ROUNDS))) "$URING_RSS"
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Miss throughput of the proxy against a local origin answering after a fixed
+# delay, for each worker count. Every request is for a new URL so all of them
+# are misses, with one worker they are fetched one after another and with n
+# workers up to n at a time.
+#
+#   make && bench/miss-scaling.sh [requests] [concurrency] [origin delay ms] [worker counts...]
+
+set -e
+
+REQUESTS=${1:-400}
+CONCURRENCY=${2:-64}
+DELAY_MS=${3:-50}
+shift 3 2>/dev/null || shift $#
+WORKERS=${*:-1 2 4 8 16}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PROXY_PORT=${PROXY_PORT:-4141}
+ORIGIN_PORT=${ORIGIN_PORT:-4142}
+WORK_DIR=$(mktemp -d)
+
+cleanup()
+{
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+# origin taking DELAY_MS per response, one thread per connection
+python3 - "$ORIGIN_PORT" "$DELAY_MS" <<'EOF' &
+import sys, time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+delay = int(sys.argv[2]) / 1000.0
+body = b"x" * 2048
+
+class Origin(BaseHTTPRequestHandler):
+    def do_GET(self):
+        time.sleep(delay)
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Cache-Control", "max-age=3600")
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+ThreadingHTTPServer.request_queue_size = 1024
+ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Origin).serve_forever()
+EOF
+ORIGIN_PID=$!
+sleep 0.5
+
+# the proxy keeps its cache under the working directory, each run gets a fresh one
+cp "$ROOT/blocked-sites.json" "$WORK_DIR/"
+
+printf '%8s %10s %10s\n' workers seconds req/s
+for n in $WORKERS; do
+    rm -rf "$WORK_DIR/cached"
+    (cd "$WORK_DIR" && PORT=$PROXY_PORT WORKER_THREADS=$n EVENT_LOOPS=1 exec "$ROOT/server" > /dev/null 2>&1) &
+    PROXY_PID=$!
+    sleep 0.5
+
+    start=$(date +%s.%N)
+    seq "$REQUESTS" | xargs -P "$CONCURRENCY" -I{} \
+        curl -s -o /dev/null "http://127.0.0.1:$PROXY_PORT/?url=http://127.0.0.1:$ORIGIN_PORT/$n/{}"
+    end=$(date +%s.%N)
+
+    kill "$PROXY_PID"
+    wait "$PROXY_PID" 2>/dev/null || true
+    PROXY_PID=
+
+    echo "$n $start $end $REQUESTS" | awk '{ s = $3 - $2; printf "%8d %10.2f %10.1f\n", $1, s, $4 / s }'
+done
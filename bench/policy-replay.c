@@ -0,0 +1,245 @@
+// Replays a recorded URL stream through each disk tier eviction policy and
+// prints their hit ratios. The trace is read from stdin, one request per line
+// as "url" or "url size", objects without a size count as 1 byte so the
+// budget is then a no of objects.
+//
+//   make policy-replay
+//   awk '{ print $7, $10 }' access.log | ./policy-replay 64M
+//
+// Every policy sees one shard holding the whole budget, the same hooks the
+// cache calls under the shard lock are called here in the same order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/cache.h"
+#include "../include/cache-policy.h"
+#include "../include/utils.h"
+
+#define REPLAY_LINE_SIZE 8192
+
+typedef struct
+{
+    char *url;
+    size_t size;
+} TraceRequest;
+
+typedef struct
+{
+    TraceRequest *requests;
+    size_t count;
+    size_t capacity;
+} Trace;
+
+static int read_trace(FILE *in, Trace *trace)
+{
+    char line[REPLAY_LINE_SIZE];
+    while (fgets(line, sizeof(line), in))
+    {
+        char *url = strtok(line, " \t\r\n");
+        if (!url)
+            continue;
+
+        char *size_field = strtok(NULL, " \t\r\n");
+        long long size = size_field ? atoll(size_field) : 1;
+
+        if (trace->count == trace->capacity)
+        {
+            size_t capacity = trace->capacity ? trace->capacity * 2 : 4096;
+            TraceRequest *requests = realloc(trace->requests, capacity * sizeof(TraceRequest));
+            if (!requests)
+                return 0;
+            trace->requests = requests;
+            trace->capacity = capacity;
+        }
+
+        TraceRequest *req = &trace->requests[trace->count];
+        if (!(req->url = strdup(url)))
+            return 0;
+        req->size = size > 0 ? (size_t)size : 1;
+        trace->count++;
+    }
+
+    return 1;
+}
+
+// linear probing slot of the key, entries are told apart by their 64 bit hash
+static size_t replay_probe(CacheShard *shard, uint64_t hash)
+{
+    size_t i = hash & (shard->capacity - 1);
+    while (shard->slots[i].entry && shard->slots[i].hash != hash)
+        i = (i + 1) & (shard->capacity - 1);
+
+    return i;
+}
+
+// doubles the index at 3/4 load like the cache's own, ghosts follow its size
+static void replay_grow(CacheShard *shard)
+{
+    size_t new_capacity = shard->capacity * 2;
+    CacheSlot *new_slots = calloc(new_capacity, sizeof(CacheSlot));
+    if (!new_slots)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++)
+    {
+        if (!shard->slots[i].entry)
+            continue;
+
+        size_t j = shard->slots[i].hash & (new_capacity - 1);
+        while (new_slots[j].entry)
+            j = (j + 1) & (new_capacity - 1);
+        new_slots[j] = shard->slots[i];
+    }
+
+    free(shard->slots);
+    shard->slots = new_slots;
+    shard->capacity = new_capacity;
+}
+
+static void replay_remove(CacheShard *shard, CacheEntry *entry)
+{
+    size_t i = replay_probe(shard, entry->hash);
+    shard->slots[i].entry = NULL;
+
+    // backward shift so later probes never stop at the hole
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & (shard->capacity - 1);
+        if (!shard->slots[j].entry)
+            break;
+
+        size_t home = shard->slots[j].hash & (shard->capacity - 1);
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            shard->slots[i] = shard->slots[j];
+            shard->slots[j].entry = NULL;
+            i = j;
+        }
+    }
+}
+
+static void replay_policy(const CachePolicy *policy, const Trace *trace, size_t budget)
+{
+    CacheShard shard = {0};
+    shard.capacity = CACHE_INDEX_INITIAL_CAPACITY;
+    shard.slots = calloc(shard.capacity, sizeof(CacheSlot));
+    if (!shard.slots)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t hits = 0, hit_bytes = 0, total_bytes = 0;
+    for (size_t r = 0; r < trace->count; r++)
+    {
+        const TraceRequest *req = &trace->requests[r];
+        uint64_t hash = hash_string(req->url);
+        total_bytes += req->size;
+
+        size_t i = replay_probe(&shard, hash);
+        if (shard.slots[i].entry)
+        {
+            hits++;
+            hit_bytes += req->size;
+            policy->on_hit(&shard, shard.slots[i].entry);
+            continue;
+        }
+
+        // objects larger than the whole budget are never kept, as in index_object
+        if (req->size > budget)
+            continue;
+
+        CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+        if (!entry)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        if ((size_t)(shard.current_size + 1) * 4 > shard.capacity * 3)
+        {
+            replay_grow(&shard);
+            i = replay_probe(&shard, hash);
+        }
+
+        entry->hash = hash;
+        entry->size = req->size;
+        shard.slots[i].hash = hash;
+        shard.slots[i].entry = entry;
+        shard.current_size++;
+        shard.disk_bytes += entry->size;
+        policy->on_insert(&shard, entry);
+
+        while (shard.disk_bytes > budget)
+        {
+            CacheEntry *victim = policy->victim(&shard);
+            if (!victim)
+                break;
+
+            policy->on_remove(&shard, victim);
+            replay_remove(&shard, victim);
+            shard.disk_bytes -= victim->size;
+            shard.current_size--;
+            free(victim);
+        }
+    }
+
+    printf("%-8s %10zu %10zu %9.2f%% %9.2f%%\n", policy->name, trace->count, hits,
+           trace->count ? 100.0 * hits / trace->count : 0.0, total_bytes ? 100.0 * hit_bytes / total_bytes : 0.0);
+
+    for (size_t i = 0; i < shard.capacity; i++)
+        free(shard.slots[i].entry);
+    free(shard.slots);
+    free(shard.ghosts);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s budget [policy...] < trace\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t budget = parse_size(argv[1], 0);
+    if (!budget)
+    {
+        fprintf(stderr, "invalid budget: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Trace trace = {0};
+    if (!read_trace(stdin, &trace))
+    {
+        perror("read_trace");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %10s %10s %10s %10s\n", "policy", "requests", "hits", "hit ratio", "byte ratio");
+    if (argc == 2)
+    {
+        replay_policy(&lru_policy, &trace, budget);
+        replay_policy(&s3fifo_policy, &trace, budget);
+    }
+
+    for (int i = 2; i < argc; i++)
+    {
+        const CachePolicy *policy = get_cache_policy(argv[i]);
+        if (!policy)
+        {
+            fprintf(stderr, "unknown cache policy: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        replay_policy(policy, &trace, budget);
+    }
+
+    for (size_t r = 0; r < trace.count; r++)
+        free(trace.requests[r].url);
+    free(trace.requests);
+    return EXIT_SUCCESS;
+}
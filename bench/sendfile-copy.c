@@ -0,0 +1,264 @@
+// Time and peak memory of sending a cached body from its file to a client
+// socket, read into a buffer the size of the object and sent from it as
+// large hits used to be, against sendfile as they are now. Each size gets a
+// file of its own in the working directory, kept in the page cache, and is
+// sent over loopback TCP to a thread draining it.
+//
+//   make sendfile-copy
+//   ./sendfile-copy [size...]
+//
+// Sizes take the K, M and G suffixes, 1M 16M 128M 1G by default. Every run
+// is a fresh process so its peak RSS is its own, the best of three is shown.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../include/utils.h"
+
+#define BENCH_RUNS 3
+#define DRAIN_BUFFER_SIZE (64 * 1024)
+
+typedef enum
+{
+    SEND_COPY,
+    SEND_FILE,
+} SendMode;
+
+// what a run reports back to the parent
+typedef struct
+{
+    double ms;
+    long max_rss_kb;
+} RunResult;
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[DRAIN_BUFFER_SIZE];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+
+    return NULL;
+}
+
+// connected loopback pair, the sender gets *out and the drainer *in
+static int open_loopback(int *out, int *in)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &addr_len) < 0)
+    {
+        perror("listen");
+        return -1;
+    }
+
+    *out = socket(AF_INET, SOCK_STREAM, 0);
+    if (*out < 0 || connect(*out, (struct sockaddr *)&addr, sizeof(addr)) < 0 || (*in = accept(lfd, NULL, NULL)) < 0)
+    {
+        perror("connect");
+        close(lfd);
+        return -1;
+    }
+
+    close(lfd);
+    return 0;
+}
+
+static int send_copy(int sockfd, int fd, size_t size)
+{
+    // the whole body in the heap, as read_cache_object did for every hit
+    char *body = malloc(size);
+    if (!body)
+        return -1;
+
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = pread(fd, body + got, size - got, got);
+        if (n <= 0)
+        {
+            free(body);
+            return -1;
+        }
+        got += n;
+    }
+
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t n = send(sockfd, body + sent, size - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            free(body);
+            return -1;
+        }
+        sent += n;
+    }
+
+    free(body);
+    return 0;
+}
+
+static int send_file(int sockfd, int fd, size_t size)
+{
+    off_t offset = 0;
+    while ((size_t)offset < size)
+    {
+        ssize_t n = sendfile(sockfd, fd, &offset, size - offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// one send in a process of its own, exits non zero on failure
+static void run_child(const char *path, size_t size, SendMode mode, int result_fd)
+{
+    int fd = open(path, O_RDONLY);
+    int out, in;
+    if (fd < 0 || open_loopback(&out, &in) < 0)
+        exit(EXIT_FAILURE);
+
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain_thread, &in);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = mode == SEND_COPY ? send_copy(out, fd, size) : send_file(out, fd, size);
+    shutdown(out, SHUT_WR);
+    pthread_join(drainer, NULL);
+
+    RunResult result = {.ms = elapsed_ms(&start)};
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.max_rss_kb = usage.ru_maxrss;
+
+    if (rc < 0 || write(result_fd, &result, sizeof(result)) != sizeof(result))
+        exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
+}
+
+static int run_once(const char *path, size_t size, SendMode mode, RunResult *result)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+
+    // the child would print the parent's buffered lines again on exit
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        run_child(path, size, mode, fds[1]);
+    }
+    close(fds[1]);
+
+    int status = 0;
+    ssize_t n = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return pid > 0 && n == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int write_body_file(const char *path, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+
+    char buf[DRAIN_BUFFER_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t written = 0; written < size;)
+    {
+        size_t len = size - written < sizeof(buf) ? size - written : sizeof(buf);
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *default_sizes[] = {"1M", "16M", "128M", "1G"};
+    const char **sizes = argc > 1 ? (const char **)argv + 1 : default_sizes;
+    int n_sizes = argc > 1 ? argc - 1 : 4;
+
+    printf("%8s %8s %10s %10s %10s\n", "size", "mode", "ms", "MB/s", "peak RSS");
+    for (int i = 0; i < n_sizes; i++)
+    {
+        size_t size = parse_size(sizes[i], 0);
+        if (!size)
+        {
+            fprintf(stderr, "invalid size: %s\n", sizes[i]);
+            return EXIT_FAILURE;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "sendfile-copy.%d.tmp", (int)getpid());
+        if (write_body_file(path, size) < 0)
+        {
+            perror("write_body_file");
+            unlink(path);
+            return EXIT_FAILURE;
+        }
+
+        for (SendMode mode = SEND_COPY; mode <= SEND_FILE; mode++)
+        {
+            RunResult best = {0};
+            for (int run = 0; run < BENCH_RUNS; run++)
+            {
+                RunResult result;
+                if (run_once(path, size, mode, &result) < 0)
+                {
+                    fprintf(stderr, "run failed: %s\n", sizes[i]);
+                    unlink(path);
+                    return EXIT_FAILURE;
+                }
+                if (!run || result.ms < best.ms)
+                    best = result;
+            }
+
+            printf("%8s %8s %10.1f %10.0f %8.1fMB\n", sizes[i], mode == SEND_COPY ? "copy" : "sendfile", best.ms,
+                   size / 1e6 / (best.ms / 1000), best.max_rss_kb / 1024.0);
+        }
+
+        unlink(path);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#ifndef CACHE_CODEC_H
+#define CACHE_CODEC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "stats.h"
+
+// encoding of a stored body, recorded in the object header
+#define CACHE_CODEC_NONE 0
+#define CACHE_CODEC_ZSTD 1
+
+// smaller bodies gain too little to pay for the frame and the decode
+#define CACHE_COMPRESS_MIN_SIZE 512
+
+// larger bodies stay raw so their hits are sent from the file with sendfile
+#define CACHE_COMPRESS_MAX_SIZE (8 * 1024 * 1024)
+
+// kinds of content worth compressing, everything else is stored as received
+typedef enum
+{
+    CONTENT_HTML,
+    CONTENT_CSS,
+    CONTENT_JS,
+    CONTENT_JSON,
+    CONTENT_XML,
+    CONTENT_TEXT,
+    CONTENT_OTHER, // media, fonts, archives, already compressed
+} ContentClass;
+
+_Static_assert(CONTENT_OTHER == STATS_CONTENT_CLASSES, "compression stats per content class");
+
+ContentClass get_content_class(const char *content_type);
+
+const char *content_class_name(ContentClass content_class);
+
+// zstd level of new objects, 0 stores every body raw
+void set_cache_compress_level(int level);
+
+// compresses the body when its type is compressible and it shrinks enough,
+// returns the codec, encoded is heap allocated unless CACHE_CODEC_NONE
+int encode_cache_body(const char *content_type, const char *data, size_t data_len,
+                      char **encoded, size_t *encoded_len);
+
+// decodes src into exactly dst_len bytes, 0 when corrupt or the codec is unsupported
+int decode_cache_body(int codec, const char *content_type, const char *src, size_t src_len,
+                      char *dst, size_t dst_len);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef CACHE_MANIFEST_H
+#define CACHE_MANIFEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache-store.h"
+#include "segment-store.h"
+#include "freshness.h"
+#include "utils.h"
+
+// snapshot of every entry in eviction order, and the changes made since it
+#define CACHE_MANIFEST_SNAPSHOT CACHE_DIR "/manifest.snap"
+#define CACHE_MANIFEST_JOURNAL CACHE_DIR "/manifest.log"
+
+// journal is folded into a new snapshot after this many records
+#define CACHE_MANIFEST_MAX_JOURNAL 65536
+
+// seconds between snapshots while entries keep changing, keeps recency recent
+#define CACHE_MANIFEST_SNAPSHOT_INTERVAL 300
+
+#define MANIFEST_PUT 1
+#define MANIFEST_DEL 2
+
+// one entry as recorded in the manifest
+typedef struct
+{
+    unsigned char op;    // MANIFEST_PUT / MANIFEST_DEL, only key is set for a delete
+    unsigned char queue; // CACHE_QUEUE_* the entry was in
+    unsigned char freq;
+    char key[CACHE_KEY_LEN + 1];
+    size_t size;
+    SegmentLoc location; // segment 0 when the object has its own cache file
+    time_t last_access;
+    CacheMeta meta;
+} ManifestEntry;
+
+typedef struct
+{
+    int journal_fd;         // append only, -1 when the manifest couldn't be opened
+    size_t journal_records; // appended since the last snapshot
+    atomic_int loading;     // entries of the previous run are still being restored
+    pthread_mutex_t lock;   // guards the journal fd and wakes the snapshot thread
+    pthread_cond_t wake;
+} CacheManifest;
+
+// snapshot being written, entries go in the order they are restored
+typedef struct ManifestWriter ManifestWriter;
+
+// opens the journal for appending, existing records are kept for the restore
+int open_cache_manifest(CacheManifest *manifest);
+
+void close_cache_manifest(CacheManifest *manifest);
+
+// appends the entry to the journal, wakes the snapshot thread when it grew too long
+void manifest_append(CacheManifest *manifest, const ManifestEntry *entry);
+
+// replays snapshot and journals in order, returns 0 when no manifest exists
+int load_cache_manifest(void (*fn)(const ManifestEntry *entry, void *arg), void *arg);
+
+// starts a new snapshot, later changes go to a fresh journal
+ManifestWriter *begin_manifest_snapshot(CacheManifest *manifest);
+
+void manifest_snapshot_add(ManifestWriter *writer, const ManifestEntry *entry);
+
+// atomically replaces the old snapshot and drops the journal it folded in
+int commit_manifest_snapshot(ManifestWriter *writer);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CACHE_OBJECT_H
+#define CACHE_OBJECT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+// immutable cached body shared between the memory tier and in-flight responses
+typedef struct CacheObject
+{
+    atomic_int refs;
+    size_t length;
+    int fd;       // file holding the body at offset when >= 0, body[] is empty then
+    off_t offset;
+    char content_type[128];
+    char body[]; // length bytes + '\0'
+} CacheObject;
+
+// allocates an object with room for length bytes of body, refs starts at 1
+CacheObject *alloc_cache_object(const char *content_type, size_t length);
+
+// allocates an object holding a copy of the data
+CacheObject *new_cache_object(const char *content_type, const char *data, size_t length);
+
+// resizes the body of an object nobody else references yet, keeping its
+// leading bytes, returns NULL and leaves the object intact on failure
+CacheObject *resize_cache_object(CacheObject *object, size_t length);
+
+// object whose body stays in the file and is sent from it, takes ownership of fd
+CacheObject *new_file_cache_object(const char *content_type, int fd, off_t offset, size_t length);
+
+// takes one more reference
+CacheObject *retain_cache_object(CacheObject *object);
+
+// drops one reference, frees the object on last one
+void release_cache_object(CacheObject *object);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct CacheShard;
+struct CacheEntry;
+
+// queue an entry currently lives in
+#define CACHE_QUEUE_MAIN 0
+#define CACHE_QUEUE_SMALL 1
+
+// S3-FIFO keeps about this percent of a shard's bytes in the small queue
+#define S3FIFO_SMALL_PERCENT 10
+
+// highest access count S3-FIFO tracks per entry
+#define S3FIFO_MAX_FREQ 3
+
+// eviction policy of the disk tier, every hook runs with the shard lock held
+typedef struct CachePolicy
+{
+    const char *name;
+
+    // links a newly indexed entry into the shard's queues
+    void (*on_insert)(struct CacheShard *shard, struct CacheEntry *entry);
+
+    // links an entry restored from the manifest at the head of its recorded queue
+    void (*on_restore)(struct CacheShard *shard, struct CacheEntry *entry);
+
+    // records a hit of the entry
+    void (*on_hit)(struct CacheShard *shard, struct CacheEntry *entry);
+
+    // unlinks an entry which is about to be freed
+    void (*on_remove)(struct CacheShard *shard, struct CacheEntry *entry);
+
+    // picks the entry to evict next, may reorder the queues while deciding
+    struct CacheEntry *(*victim)(struct CacheShard *shard);
+} CachePolicy;
+
+// plain least recently used
+extern const CachePolicy lru_policy;
+
+// small probationary FIFO + main FIFO with lazy promotion + ghost history
+extern const CachePolicy s3fifo_policy;
+
+// policy by its name, NULL when unknown
+const CachePolicy *get_cache_policy(const char *name);
+
+#endif
@@ -3,12 +3,134 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <time.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include "cache-object.h"
+#include "freshness.h"
+#include "crc32c.h"
+#include "cache-codec.h"
 #define CACHE_DIR "cached"
 
+#define CACHE_OBJECT_MAGIC 0x4f435850 // "PXCO"
+#define CACHE_OBJECT_VERSION 1
+
+// bounds of the metadata strings, longer fields are cut, longer urls never
+// cached as a hit has to match the stored url in full
+#define CACHE_OBJECT_MAX_URL 4096
+#define CACHE_OBJECT_MAX_FIELD 255
+#define CACHE_OBJECT_MAX_METADATA (CACHE_OBJECT_MAX_URL + 3 * CACHE_OBJECT_MAX_FIELD + 8)
+
+#define MIN_LEN(a, b) ((a) < (b) ? (a) : (b))
+
+// objects are written to a temp file with this prefix and renamed into place
+#define CACHE_TEMP_PREFIX ".tmp-"
+
+// how far a written object is synced before it is renamed into place
+typedef enum
+{
+    CACHE_FSYNC_NONE, // left to the kernel, a crash may lose recent objects
+    CACHE_FSYNC_DATA, // fdatasync before the rename
+    CACHE_FSYNC_FULL, // fsync before the rename, and of the directory after it
+} CacheFsyncPolicy;
+
+// fixed layout start of every cache file, followed by the url, content type,
+// etag and last modified bytes (lengths below), then the body at body_offset,
+// stored as encoded by codec
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t status_code;
+    uint32_t body_offset; // 8 byte aligned
+    uint32_t header_crc;  // crc32c of this header with the field zeroed, plus the metadata
+    int64_t stored_at;
+    int64_t expires_at;
+    uint64_t body_len; // as stored
+    uint32_t body_crc; // crc32c of the body as stored
+    uint16_t url_len;
+    uint16_t content_type_len;
+    uint16_t etag_len;
+    uint16_t last_modified_len;
+    uint8_t must_revalidate;
+    uint8_t codec; // CACHE_CODEC_*, none in objects written before compression
+    uint8_t reserved[2];
+    uint32_t raw_len; // body length once decoded, only set when encoded
+    uint8_t reserved_tail[4];
+} CacheObjectHeader;
+
+_Static_assert(sizeof(CacheObjectHeader) == 64, "cache object header layout changed");
+
+// bytes of the url digest naming a cache file, hex encoded in the filename
+#define CACHE_KEY_BYTES 16
+#define CACHE_KEY_LEN (CACHE_KEY_BYTES * 2)
+
 void ensure_cache_dir();
-char *get_cache_filename(const char *url);
-int write_cache_file(const char *filename, const char *content_type, const char *data, size_t data_len);
-char *read_cache_file(const char *filename, char *content_type_out, size_t *data_len_out);
 
-#endif
\ No newline at end of file
+void set_cache_fsync_policy(CacheFsyncPolicy policy);
+CacheFsyncPolicy get_cache_fsync_policy();
+
+// parses none, data or full, 0 when unknown
+int parse_cache_fsync_policy(const char *name, CacheFsyncPolicy *policy);
+
+// fixed width hex digest of the canonical url, files live at
+// cached/<key[0..1]>/<key[2..3]>/<key> so no directory grows too large
+char *get_cache_key(const char *url);
+
+// whether the url fits the object metadata, objects of longer ones are not stored
+int is_cache_url_storable(const char *url);
+
+// gets bytes the cache file really occupies on disk and its mtime, 0 if it doesn't exist
+int stat_cache_file(const char *key, size_t *footprint, time_t *mtime);
+void remove_cache_file(const char *key);
+// writes the response with its metadata through a temp file renamed over the
+// old object, readers see either of them complete, meta may be NULL
+int write_cache_file(const char *key, const char *url, int status_code, const char *content_type,
+                     const CacheMeta *meta, const char *data, size_t data_len);
+
+// fills the header of an object stored for the canonical url and its metadata,
+// which must hold CACHE_OBJECT_MAX_METADATA bytes, compressing the data when
+// worth it, body is set to the header->body_len bytes to store after the
+// metadata, either data or *encoded which the caller frees, returns the
+// metadata length, 0 on failure or when the url is too long
+size_t encode_cache_object_header(CacheObjectHeader *header, char *metadata, const char *url,
+                                  int status_code, const char *content_type, const CacheMeta *meta,
+                                  const char *data, size_t data_len, const char **body, char **encoded);
+
+// length of the body once decoded
+size_t cache_object_raw_len(const CacheObjectHeader *header);
+
+// checks magic, version and field bounds of a header, name is only for logging
+int check_cache_object_header(const CacheObjectHeader *header, const char *name);
+
+// verifies the header checksum over the header and the metadata following it
+int check_cache_object_metadata(CacheObjectHeader *header, const char *metadata, const char *name);
+
+// whether the object was stored for the url, another url with the same key is a collision
+int cache_object_url_matches(const CacheObjectHeader *header, const char *metadata, const char *url);
+
+// reads the object, NULL when missing, corrupt, truncated or stored for another url
+CacheObject *read_cache_object(const char *key, const char *url);
+
+// like read_cache_object but the body stays in the file to be sent with sendfile,
+// its checksum is not verified as that would mean reading it
+CacheObject *open_cache_object(const char *key, const char *url);
+
+// reads the freshness info and validators stored with the object, 0 when unreadable
+int read_cache_meta(const char *key, CacheMeta *meta);
+
+// calls fn with the key of every cache file in the fan-out directories
+void for_each_cache_file(void (*fn)(const char *key, void *arg), void *arg);
+
+// removes temp files of writes a crash interrupted, those modified since
+// older_than may belong to running writes and are kept, returns how many
+size_t remove_orphan_temp_files(time_t older_than);
+
+#endif
@@ -3,38 +3,144 @@
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include "utils.h"
 #include "cache-store.h"
+#include "single-flight.h"
+#include "stats.h"
+#include "cache-policy.h"
+#include "freshness.h"
+#include "cache-manifest.h"
+#include "segment-store.h"
+
+// no of independent partitions of the cache, each with its own lock
+#define CACHE_SHARD_COUNT 16
+
+// only objects up to this size get promoted to the memory tier, larger ones
+// are sent from their cache file with sendfile
+#define CACHE_MEM_MAX_OBJECT_SIZE (256 * 1024)
+
+// initial no of slots of a shard's hash index, always a power of 2
+#define CACHE_INDEX_INITIAL_CAPACITY 64
 
 typedef struct CacheEntry
 {
-    char *url; // original URL
+    char *key;     // digest of the URL naming its cache file
+    uint64_t hash; // hash of key, computed once on insert
+    CacheObject *object; // memory tier copy of the body, NULL when only on disk
+    size_t size;         // bytes the object occupies on disk
+    SegmentLoc location; // record in the segment store, segment 0 for its own cache file
+    uint64_t version;    // changes whenever the object is rewritten, unique within the shard
+    time_t last_access;
+    time_t stored_at;    // when the origin response was received
+    time_t expires_at;   // fresh till this time
+    int must_revalidate; // never served stale
+    char *etag;          // validators for revalidation, NULL when absent
+    char *last_modified;
+    unsigned char queue; // CACHE_QUEUE_* the entry is linked in
+    unsigned char freq;  // hits seen by the policy, capped by it
+    unsigned char restored; // loaded from the manifest and not changed since
     struct CacheEntry *prev;
     struct CacheEntry *next;
+    struct CacheEntry *mem_prev; // recency list of the memory tier
+    struct CacheEntry *mem_next;
 } CacheEntry;
 
+// open addressing slot, hash is kept inline so probing never touches the entry
 typedef struct
 {
-    CacheEntry *head;
+    uint64_t hash;
+    CacheEntry *entry; // NULL when slot is empty
+} CacheSlot;
+
+// one hash partition of the cache, lock guards the queues and the index
+typedef struct CacheShard
+{
+    CacheEntry *head;     // main queue, the only one used by lru
     CacheEntry *tail;
-    int max_size;
-    int current_size;
+    CacheEntry *small_head; // probationary queue of s3fifo
+    CacheEntry *small_tail;
+    size_t small_bytes;
+    uint64_t *ghosts;     // hashes recently evicted from the small queue
+    size_t ghost_capacity;
+    size_t disk_bytes;    // bytes of this shard's cache files
+    int current_size;     // no of entries
+    CacheSlot *slots;     // linear probing index over the list entries
+    size_t capacity;      // no of slots
+    CacheEntry *mem_head; // entries holding an object in memory
+    CacheEntry *mem_tail;
+    size_t mem_bytes;     // bytes of the objects held in memory
+    size_t mem_max_bytes;
+    uint64_t last_version; // of the entry added or rewritten last
+    pthread_mutex_t lock;
+} CacheShard;
+
+struct Refresher;
+struct WriteBehind;
+
+// tunables of the cache, filled from env vars at startup
+typedef struct
+{
+    size_t mem_max_bytes;          // memory tier budget, split evenly between shards
+    size_t disk_max_bytes;         // disk tier budget
+    const CachePolicy *policy;     // disk tier eviction policy, lru when NULL
+    time_t stale_while_revalidate; // seconds an expired entry is served while refreshed in background
+    time_t stale_if_error;         // seconds an expired entry is served when the origin fails
+    CacheFsyncPolicy fsync_policy; // durability of object writes
+    size_t segment_max_object;     // objects up to this size are appended to segments, 0 gives each its own file
+    int compress_level;            // zstd level of compressible objects on disk, 0 stores them raw
+    size_t max_object_bytes;       // larger responses are relayed without being cached
+} CacheConfig;
+
+typedef struct CacheLRU
+{
+    CacheShard shards[CACHE_SHARD_COUNT];
+    InflightTable inflight; // origin fetches currently running, by cache filename
+    const CachePolicy *policy; // decides eviction order of the disk tier
+    atomic_size_t disk_bytes; // bytes of all cache files on disk
+    size_t disk_max_bytes;
+    size_t mem_max_bytes;
+    size_t max_object_bytes;
+    time_t stale_while_revalidate;
+    time_t stale_if_error;
+    struct Refresher *refresher; // background refresh of stale entries, may be NULL
+    struct WriteBehind *write_behind; // queue of pending disk writes, NULL when writes are synchronous
+    time_t started_at;
+    CacheManifest manifest; // on disk record of the entries, restored on startup
+    SegmentStore *segments; // log structured store of small objects
 } CacheLRU;
 
-CacheLRU *init_cache_lru(int max_size);
+// entries of the previous run are restored from the manifest in background,
+// lookups racing with the restore are misses
+CacheLRU *init_cache_lru(const CacheConfig *config);
 
 void free_cache_lru(CacheLRU *cache);
 
-int lru_contains(CacheLRU *cache, const char *url);
+// returns a retained object for a cached url or NULL on miss, served from
+// memory when present else read from disk and promoted, or from a write still
+// pending, meta tells whether the object is still fresh or has to be revalidated,
+// without read_disk an object only on disk is a miss and never blocks on a file
+CacheObject *lru_get(CacheLRU *cache, const char *url, CacheMeta *meta, int read_disk);
 
-void lru_touch(CacheLRU *cache, const char *url);
+// writes the data to disk and indexes it, small objects are appended to a
+// segment when enabled, meta NULL gives the default ttl, returns the version
+// of the entry written, 0 when it wasn't kept
+uint64_t lru_insert(CacheLRU *cache, const char *url, const char *data, size_t data_len, const char *content_type, const CacheMeta *meta);
 
-void lru_insert(CacheLRU *cache, const char *url, const char *data, size_t data_len, const char *content_type);
+// updates freshness and validators of a revalidated entry
+void lru_refresh(CacheLRU *cache, const char *url, const CacheMeta *meta);
 
-void lru_evict(CacheLRU *cache);
+// evicts the policy's victim of the shard, caller must hold shard lock
+void lru_evict(CacheLRU *cache, CacheShard *shard);
 
 void lru_delete(CacheLRU *cache, const char *url);
 
+// removes the entry written by lru_insert at version unless it was rewritten
+// since, pending writes of the url are left alone
+void lru_undo_insert(CacheLRU *cache, const char *url, uint64_t version);
+
 void print_cache_list(CacheLRU *cache);
-#endif
\ No newline at end of file
+#endif
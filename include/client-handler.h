@@ -5,19 +5,100 @@
 #include "http-request-response.h"
 #include "http-parser.h"
 #include "blocked-sites.h"
+#include "client-queue.h"
 #include "cache.h"
+#include "fetch.h"
 #include "utils.h"
 #include <unistd.h>
+#include <fcntl.h>
 
+// request heads past this are answered 400
+#define CLIENT_MAX_REQUEST_SIZE (64 * 1024)
+
+struct EventLoop;
+
+// where a client connection is, only a worker touches it while fetching,
+// only its event loop otherwise
+typedef enum
+{
+    CLIENT_READING_REQUEST,  // head arriving on the loop
+    CLIENT_LOOKING_UP,       // head parsed, served from memory or the proxy's own pages
+    CLIENT_FETCHING,         // missed memory, a worker reads it from disk or fetches it from the origin
+    CLIENT_WRITING_RESPONSE, // head and body going out on the loop
+    CLIENT_CLOSING,          // done, or already answered by the worker's relay
+} ClientState;
+
+typedef struct ClientConn
+{
+    int fd;
+    ClientState state;
+    struct EventLoop *loop;
+    Deadline deadline;
+    long io_deadline; // monotonic ms the read or write has to progress by, 0 for no limit
+
+    char *request; // head received so far when it took more than one read
+    size_t request_len;
+
+    char *url;           // of a memory miss, read or fetched by the worker
+    CacheObject *stale;  // expired copy a miss revalidates
+    CacheMeta meta;
+
+    HttpResponse *res; // being written, body borrowed from it
+    char *data;        // owned body of the proxy's own pages
+    char head[512];    // status line and headers, or a whole error response
+    size_t head_len;
+    size_t head_sent;
+    const char *body;
+    int file_fd; // body sent from this file at file_offset instead when >= 0
+    off_t file_offset;
+    size_t body_len;
+    size_t body_sent;
+
+    struct ClientConn *prev, *next; // loop's connections, or its done list
+
+    // io_uring loops only
+    int pending;      // ops in flight on it, it's only freed once they all completed
+    int recv_armed;   // a multishot recv is delivering its bytes
+    int cancelling;   // its ops on the socket were asked to stop
+    int file_slot;    // registered file the body is read through, -1 for none
+    char *chunk;      // part of the file body read here before it's sent
+    size_t chunk_len; // body bytes of the sends in flight
+} ClientConn;
+
+// shared by the event loops and the workers
 typedef struct
 {
-    int client_fd;
+    ClientQueue *client_queue;
     CacheLRU *cache;
     char **blocked_sites;
     int n_of_b_sites;
-    pthread_mutex_t* cache_lock;
-} ClientHandlerArgs;
+} SharedContext;
+
+// connection of an accepted client, NULL on allocation failure
+ClientConn *create_client_conn(int fd, struct EventLoop *loop);
+
+// closes the client and frees whatever its response held
+void free_client_conn(ClientConn *conn);
+
+// routes a complete request head: answers it from the proxy's own pages or the
+// memory tier leaving the connection writing, or leaves it fetching for a worker
+void handle_request(ClientConn *conn, const char *raw_request, size_t raw_len, SharedContext *ctx);
+
+// feeds bytes read from the client, 0 when it closed, routing the request
+// through handle_request once its head is complete
+void client_received(ClientConn *conn, const char *data, size_t len, SharedContext *ctx);
+
+// whether the client stopped making progress in time
+int is_client_late(const ClientConn *conn, long now);
+
+// answers 408 to a client still sending its request, else gives up on it
+void client_timed_out(ClientConn *conn);
+
+// serves a memory miss on a worker from disk or the origin, leaves the connection
+// writing the response or an error, or closing when the response was relayed while received
+void handle_client_miss(ClientConn *conn, SharedContext *ctx);
 
-void* handle_client(void *args);
+// queues one of the custom error codes as the response
+void respond_error(ClientConn *conn, int error_code);
 
-#endif
\ No newline at end of file
+#endif
@@ -4,8 +4,10 @@
 #include <pthread.h>
 #include <stdlib.h>
 
+struct ClientConn;
+
 typedef struct ClientQueueNode {
-    int client_sock;
+    struct ClientConn *conn;
     struct ClientQueueNode *next;
 } ClientQueueNode;
 
@@ -17,8 +19,8 @@ typedef struct {
 } ClientQueue;
 
 void init_client_queue(ClientQueue *q);
-void enqueue_client(ClientQueue *q, int client_sock);
-int dequeue_client(ClientQueue *q);
+void enqueue_client(ClientQueue *q, struct ClientConn *conn);
+struct ClientConn *dequeue_client(ClientQueue *q);
 int is_queue_empty(ClientQueue *q);
 
 #endif
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// CRC-32C (Castagnoli) of len bytes continuing from crc, 0 to start, uses the
+// SSE4.2 crc32 instruction when the cpu has it
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
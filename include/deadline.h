@@ -0,0 +1,57 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+// budgets of the phases of a request in ms, 0 for no limit
+typedef struct
+{
+    long connect_ms; // resolving the origin and connecting to it, all its addresses together
+    long tls_ms;     // tls handshake with the origin
+    long header_ms;  // receiving the request head from the client or the response head from the origin
+    long body_ms;    // longest pause of a body being received or sent
+    long write_ms;   // waiting for room in a full cache write queue
+    long total_ms;   // everything from taking the client to its last byte sent
+} TimeoutConfig;
+
+typedef enum
+{
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_HEADER,
+    PHASE_BODY,
+    PHASE_WRITE,
+} RequestPhase;
+
+// time left to a request, carried from the client handler down to each socket wait
+typedef struct
+{
+    long end_ms; // monotonic ms the request has to be done by, 0 for no limit
+    int expired; // some wait ran out of time
+} Deadline;
+
+// sets the budgets, till then nothing times out
+void set_timeouts(const TimeoutConfig *config);
+
+long monotonic_ms(void);
+
+// starts the total budget of a request
+void start_deadline(Deadline *deadline);
+
+// monotonic ms a phase starting now has to end by, the earlier of its budget
+// and the total, 0 for no limit, deadline may be NULL for the phase budget only
+long phase_deadline(const Deadline *deadline, RequestPhase phase);
+
+// waits for events on fd till until (0 waits forever), returns 1 when ready,
+// 0 when it timed out, marking the deadline expired and setting errno to ETIMEDOUT, -1 on error
+int wait_fd(Deadline *deadline, int fd, short events, long until);
+
+// pthread_cond_wait till until (0 waits forever), returns 0 when it timed out,
+// marking the deadline expired, the condition is realtime clocked
+int wait_cond(Deadline *deadline, pthread_cond_t *cond, pthread_mutex_t *lock, long until);
+
+#endif
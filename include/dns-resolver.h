@@ -0,0 +1,77 @@
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "stats.h"
+#include "deadline.h"
+
+// power of 2, names are spread over the shards by hash
+#define DNS_CACHE_SHARDS 16
+#define DNS_SHARD_BUCKETS 64
+
+// names kept per shard, expired ones go first when it's full
+#define DNS_SHARD_MAX_ENTRIES 512
+
+// addresses kept per name, A and AAAA together
+#define DNS_MAX_ADDRS 16
+
+// each attempt resends the queries not yet answered, and waits for the answers
+// till the timeout or the end of the connect budget, whichever comes first
+#define DNS_QUERY_ATTEMPTS 2
+#define DNS_QUERY_TIMEOUT_MS 1000
+
+// getaddrinfo doesn't tell the ttl, its answers are kept this long within the floor and cap
+#define DNS_FALLBACK_TTL 60
+
+// a resolved address, the port is filled in by resolve_host
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+} DnsAddress;
+
+// a name and its addresses, no addresses when it doesn't exist
+typedef struct DnsEntry
+{
+    char *name;
+    DnsAddress addrs[DNS_MAX_ADDRS];
+    int n_addrs;
+    time_t expires_at;
+    int resolving; // a thread is querying it, others wait on the shard instead of querying too
+    struct DnsEntry *next;
+} DnsEntry;
+
+typedef struct
+{
+    DnsEntry *buckets[DNS_SHARD_BUCKETS];
+    int n_entries;
+    pthread_mutex_t lock;
+    pthread_cond_t resolved; // some entry of the shard stopped resolving
+} DnsShard;
+
+// sets the server queried, "ip" or "ip:port" or NULL for the first nameserver of
+// /etc/resolv.conf, and the bounds of the time answers are kept, also applied to
+// the soa ttl of names that don't exist. till then getaddrinfo is used
+void init_dns_resolver(const char *server, time_t ttl_min, time_t ttl_max, time_t negative_ttl);
+
+// fills out with up to max addresses of the host with the port set,
+// ipv4 first, returns how many, 0 when the host doesn't resolve, queries and
+// waits for other threads' queries end by until (0 for no limit), after which
+// the deadline is marked expired
+int resolve_host(const char *host, const char *port, DnsAddress *out, int max, Deadline *deadline, long until);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "client-handler.h"
+#include "deadline.h"
+#include "stats.h"
+
+// events taken per epoll_wait
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// each read of a client goes here first, heads arriving in one read are never copied
+#define EVENT_LOOP_READ_SIZE (16 * 1024)
+
+// how often connections are checked for running out of time
+#define EVENT_LOOP_SWEEP_MS 250
+
+typedef enum
+{
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING,
+} IoBackend;
+
+struct UringLoop;
+
+// a reactor owning the clients it accepted, on epoll with every socket edge
+// triggered and non-blocking or on an io_uring, misses are handed to the
+// workers and come back through the done list once their response is ready to write
+typedef struct EventLoop
+{
+    IoBackend backend;
+    int epfd;
+    int wake_fd; // eventfd written by workers after adding to done
+    int listen_fd;
+    SharedContext *ctx;
+    ClientConn *conns; // polled by this loop, checked by the sweep
+    ClientConn *done;  // back from the workers
+    pthread_mutex_t done_lock;
+    char read_buf[EVENT_LOOP_READ_SIZE];
+    pthread_t thread;
+    struct UringLoop *uring; // ring of an io_uring loop, set up by its own thread
+} EventLoop;
+
+// parses epoll or io_uring, 0 when unknown
+int parse_io_backend(const char *name, IoBackend *backend);
+
+// runs n loops accepting from the listening socket, 0 for one per online core,
+// io_uring falls back to epoll when the kernel or build lacks it, the calling
+// thread runs the first, never returns
+void run_event_loops(int listen_fd, int n, IoBackend backend, SharedContext *ctx);
+
+// adds conn to the connections the loop sweeps, and takes it out
+void link_client(EventLoop *loop, ClientConn *conn);
+void unlink_client(EventLoop *loop, ClientConn *conn);
+
+// hands a connection back to its loop once a worker is done with it
+void client_fetched(ClientConn *conn);
+
+#endif
@@ -13,9 +13,15 @@
 #include "socket-utils.h"
 #include "html-rewriter.h"
 #include "http-request-response.h"
+#include "refresher.h"
+#include "write-behind.h"
 
 #define URL_MAX_LEN 2048
 
+// read size of a relay whose body isn't kept, and first allocation of a kept
+// body of unknown length
+#define RELAY_CHUNK_SIZE (64 * 1024)
+
 typedef struct ParsedURL
 {
     char scheme[8];  // "http" or "https"
@@ -27,12 +33,26 @@ typedef struct ParsedURL
 // Parses a URL into components (http/https, host, port, path)
 int parse_url(const char *url, ParsedURL *out);
 
-// Main fetch function: performs HTTP/HTTPS GET request
-// - `url` is the target URL
-// - `max_redirects` defines how many redirects it should follow
-// Returns a heap-allocated HttpResponse*, or NULL on error
-struct HttpResponse *fetch_url(const char *url, int max_redirects);
+// connects, sends the request and receives the headers, following redirects,
+// the body is then read from the stream as it arrives within the same deadline
+HttpStream *open_http_stream(const char *url, int max_redirects, const char *etag, const char *last_modified,
+                             Deadline *deadline);
+
+// cache side of serving a url, never waits on the origin: returns fresh
+// copies and those within the stale-while-revalidate window, else NULL with
+// stale set to the expired copy or NULL and meta filled for fetch_cache_miss,
+// without read_disk only the memory tier is looked at, see lru_get
+struct HttpResponse *lookup_cache(CacheLRU *cache, const char *url, CacheObject **stale, CacheMeta *meta,
+                                  int read_disk);
+
+// origin side of serving a url, revalidates or refetches as the leader of the
+// url or waits for the leader, consumes stale, a miss is relayed to client_fd
+// while it is received and comes back with relayed set, NULL with the deadline
+// expired when the origin was too slow
+struct HttpResponse *fetch_cache_miss(CacheLRU *cache, const char *url, int max_redirects, CacheObject *stale,
+                                      CacheMeta *meta, int client_fd, Deadline *deadline);
 
-struct HttpResponse *fetch_cache_or_url(CacheLRU *cache, const char *url, int max_redirects);
+// revalidates or refetches a stale entry, used by the background refresher
+void refresh_cache_entry(CacheLRU *cache, const char *url, int max_redirects);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef FRESHNESS_H
+#define FRESHNESS_H
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+
+// lifetime of a response which carries no freshness information at all
+#define CACHE_DEFAULT_TTL (2 * 60 * 60)
+
+// heuristic lifetime is this percent of the time since Last-Modified
+#define CACHE_HEURISTIC_PERCENT 10
+
+// upper bound of the heuristic lifetime
+#define CACHE_HEURISTIC_MAX_TTL (24 * 60 * 60)
+
+// lifetime given to immutable responses lacking an explicit one
+#define CACHE_IMMUTABLE_TTL (365 * 24 * 60 * 60)
+
+struct HttpResponse;
+
+// freshness and validators stored along with a cached response
+typedef struct CacheMeta
+{
+    time_t stored_at;  // when the response was received
+    time_t expires_at; // fresh till this time, revalidated or refetched after
+    int must_revalidate; // origin forbids serving it once stale
+    char etag[128];
+    char last_modified[64];
+} CacheMeta;
+
+// whether a shared cache may store the response at all
+int is_response_storable(const struct HttpResponse *res);
+
+// computes the meta of a response requested at request_time and received at response_time
+void compute_cache_meta(const struct HttpResponse *res, time_t request_time, time_t response_time, CacheMeta *meta);
+
+// refreshes the meta from a 304 response, validators present in it replace the stored ones
+void refresh_cache_meta(CacheMeta *meta, const struct HttpResponse *not_modified, time_t request_time, time_t response_time);
+
+// whether the stored response can be served without contacting the origin
+int is_cache_meta_fresh(const CacheMeta *meta, time_t now);
+
+// whether a stale response can still be served within the given window after expiry
+int is_cache_meta_usable_stale(const CacheMeta *meta, time_t now, time_t window);
+
+// whether the origin can answer a conditional request for the stored response
+int has_cache_validators(const CacheMeta *meta);
+
+#endif
@@ -8,10 +8,11 @@
 #include <ctype.h>
 
 void normalize_domain(const char* input,char* new_input);
-char *inject_base_tag(const char *html, size_t html_len, const char *host);
+// out_len receives the length of the returned html
+char *inject_base_tag(const char *html, size_t html_len, const char *host, size_t *out_len);
 char *rewrite_attr(const char *attr, const char *value, const char *domain);
 char *rewrite_links_inplace(const char *html, const char *host);
 char *rewrite_srcset(const char *srcset, const char *host);
 char *rewrite_css_urls(const char *html, const char *host);
-char *rewrite_all_html(const char *html, size_t html_len, const char *host);
+char *rewrite_all_html(const char *html, size_t html_len, const char *host, size_t *out_len);
 #endif
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef HTTP_FRAMING_H
+#define HTTP_FRAMING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// trailer section larger than this is refused
+#define MAX_CHUNK_TRAILER_SIZE (64 * 1024)
+
+typedef enum
+{
+    CHUNK_SIZE,     // hex digits of the chunk size
+    CHUNK_EXT,      // chunk extensions, ignored
+    CHUNK_SIZE_LF,  // end of the size line
+    CHUNK_DATA,     // size bytes of data
+    CHUNK_DATA_CR,  // line break after the data
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_LINE_START, // a trailer field or the final blank line
+    CHUNK_TRAILER,  // trailer field, skipped
+    CHUNK_FINAL_LF, // end of the final blank line
+    CHUNK_DONE,
+} ChunkState;
+
+// incremental decoder of a chunked body, input may be split anywhere
+typedef struct
+{
+    ChunkState state;
+    uint64_t size;        // bytes left of the current chunk, or size being parsed
+    int digits;           // hex digits seen of the size
+    size_t trailer_bytes; // bytes of the trailer section so far
+} ChunkDecoder;
+
+void init_chunk_decoder(ChunkDecoder *decoder);
+
+// decodes len bytes of buf in place, data ends up at the start of buf,
+// returns the no of data bytes or -1 on malformed input, consumed receives
+// the input bytes used, less than len only once the body is done
+ssize_t decode_chunked(ChunkDecoder *decoder, char *buf, size_t len, size_t *consumed);
+
+// whether the last chunk and the trailers have been decoded
+int chunk_decoder_done(const ChunkDecoder *decoder);
+
+#endif
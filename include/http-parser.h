@@ -6,22 +6,46 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include "fetch.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+struct CacheObject;
+
+// Cache-Control directives which are flags
+enum CACHE_CONTROL_FLAG
+{
+    CC_NO_STORE = 1,
+    CC_NO_CACHE = 2,
+    CC_PRIVATE = 4,
+    CC_IMMUTABLE = 8,
+    CC_MUST_REVALIDATE = 16,
+};
+
 typedef struct HttpResponse
 {
     int statusCode;
     char httpVersion[16];   // "HTTP/1.1"
     char statusMessage[64]; // "OK"
     char contentType[128];  // "text/html; charset=UTF-8"
-    int contentLength;      // -1 if not present
+    long contentLength;     // -1 if not present
     int isChunked;          // 1 if Transfer-Encoding: chunked
     char *body;             // heap-allocated
     size_t bodyLength;      // actual number of bytes in body
     int isRedirect;         // boolean for redirection checking
     char location[512];     // redirection location
+    int cacheControl;       // CACHE_CONTROL_FLAG bits
+    long maxAge;            // Cache-Control max-age, -1 if not present
+    long sMaxAge;           // Cache-Control s-maxage, -1 if not present
+    time_t expires;         // Expires, 0 if not present or invalid
+    time_t date;            // Date, 0 if not present or invalid
+    long age;               // Age, 0 if not present
+    char etag[128];         // ETag validator
+    char lastModified[64];  // Last-Modified validator, kept verbatim
+    struct CacheObject *object; // when set body is borrowed from this cached object
+    int relayed;            // already sent to the client while it was received
+    int keepAlive;          // origin keeps the connection open for another request
 } HttpResponse;
 
 typedef struct HttpRequest
@@ -32,8 +56,11 @@ typedef struct HttpRequest
     char http_version[16];
 } HttpRequest;
 
-// parses the raw http response into the http response object
-HttpResponse *parse_http_response(const char *raw, size_t raw_len);
+// parses the status line and headers only, body is left NULL
+HttpResponse *parse_http_response_head(const char *raw, size_t header_len);
+
+// length of the status line and headers including the blank line, 0 if incomplete
+size_t find_http_header_end(const char *raw, size_t raw_len);
 
 HttpRequest* parse_http_request(const char* raw,size_t raw_len);
 
@@ -41,7 +68,10 @@ void init_http_response(HttpResponse *res);
 
 void init_http_request(HttpRequest *res);
 
-// Frees the memory allocated by fetch_url
+// deep copies the response including its body
+HttpResponse *copy_http_response(const HttpResponse *res);
+
+// Frees the memory held by a response
 void free_http_response(HttpResponse *res);
 
 void free_http_request(HttpRequest *req);
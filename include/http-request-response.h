@@ -2,12 +2,41 @@
 #define HTTP_REQUEST_RESPONSE_H
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include "http-framing.h"
+#include "upstream-pool.h"
 #define INITIAL_BUFFER_SIZE 8192
 
+// origin headers larger than this are refused
+#define MAX_RESPONSE_HEAD_SIZE (64 * 1024)
+
+struct HttpResponse;
+
+// origin response being received, headers are parsed up front and the body
+// is read on demand so it can be relayed while it arrives
+typedef struct HttpStream
+{
+    UpstreamConn *conn;        // goes back to the pool when the stream is closed
+    struct HttpResponse *head; // status and headers, body is NULL
+    char *buffer;              // body bytes received together with the headers
+    size_t buffered;
+    size_t consumed;
+    long remaining;            // body bytes still expected, -1 till the origin closes
+    int chunked;               // body is decoded from chunked transfer coding
+    ChunkDecoder decoder;
+    int body_done;             // body ended exactly at its framing, nothing left over
+    int keep_alive;            // origin keeps the connection open after the response
+    Deadline *deadline;        // of the request the stream is read for
+} HttpStream;
+
 enum CUSTOM_ERROR_CODE
 {
     SERVCONNFAIL = 2,   
@@ -20,20 +49,44 @@ enum CUSTOM_ERROR_CODE
     MISQRYPRM = 256,
     INTRSERVERR = 512,
     BLCKDSITEERR = 1024,
+    CLNTTIMEOUT = 2048,
+    SERVTIMEOUT = 4096,
 };
 
-int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path);
+// extra_headers are complete "Name: value\r\n" lines, may be NULL
+int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path, const char *extra_headers,
+                      int keep_alive, Deadline *deadline);
+
+// reads from the origin till the end of the headers, returns the buffer holding
+// them and any body bytes that came along, header_len is the length of the headers,
+// NULL also when they don't arrive within the header budget
+char *recv_response_head(int sockfd, SSL *ssl, size_t *out_len, size_t *header_len, Deadline *deadline);
+
+// reads up to size body bytes, returns 0 at the end of the body and -1 on error,
+// also when the origin pauses for longer than the body budget
+ssize_t read_http_stream(HttpStream *stream, char *buf, size_t size);
+
+// reads the rest of the body into stream->head->body
+int read_http_stream_body(HttpStream *stream);
+
+// returns the connection to the pool, reusable if the body was read to its end
+// or a small rest of it could be skipped, frees the head unless the caller took it
+void close_http_stream(HttpStream *stream);
 
-char *recv_response(int sockfd, SSL *ssl, size_t *out_len);
+// sends the status line and headers of a 200 response, a negative body_length
+// means the body ends when the connection is closed
+int send_http_response_head(int sockfd, long body_length, const char *content_type, Deadline *deadline);
 
-int send_http_response(int sockfd, char *data, size_t data_length, char *content_type);
+// sends all of data, retrying partial sends, returns -1 on failure
+int send_all(int sockfd, const char *data, size_t length, Deadline *deadline);
 
-char *recv_request(int sockfd, size_t *out_len);
+// writes the status line and headers of a 200 response into response, returns their length
+int format_response_headers(char *response, size_t size, size_t body_length, const char *content_type);
 
-// sends error message, returns size of the message
-int send_error_message(int fd, int statusCode, const char *statusMessage, const char *body);
+// writes a whole error response into buf, returns its length, -1 if it doesn't fit
+int format_error_message(char *buf, size_t size, int status_code, const char *status_message, const char *body);
 
-// handle sending specific errors to clients
-void handle_sending_error(int cfd, int error_code);
+// format_error_message for one of the custom error codes
+int format_error_response(char *buf, size_t size, int error_code);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef REFRESHER_H
+#define REFRESHER_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+// max no of urls waiting for a background refresh, further ones are dropped
+#define REFRESH_QUEUE_SIZE 256
+
+// no of threads refreshing stale entries off the request path
+#define REFRESHER_THREADS 2
+
+// ring of urls whose cached copy expired but was served stale
+typedef struct Refresher
+{
+    char *urls[REFRESH_QUEUE_SIZE];
+    int head;  // index of the oldest url
+    int count; // no of queued urls
+    CacheLRU *cache;
+    int max_redirects;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} Refresher;
+
+// starts the refresher threads and attaches the queue to the cache
+Refresher *start_refresher(CacheLRU *cache, int n_threads, int max_redirects);
+
+// queues a refresh of the url, returns 0 when queued or already queued, -1 when full
+int enqueue_refresh(Refresher *refresher, const char *url);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "cache-store.h"
+#include "cache-object.h"
+#include "stats.h"
+
+// small objects are appended to large segment files instead of getting a file
+// each, cached/segments/seg-<id in hex>
+#define SEGMENT_DIR CACHE_DIR "/segments"
+
+// space preallocated for a segment, objects never span two of them
+#define SEGMENT_SIZE (64 * 1024 * 1024)
+
+// largest object the store accepts, bigger ones keep their own cache file
+#define SEGMENT_MAX_OBJECT (1024 * 1024)
+
+// full segments with less of their bytes still indexed are compacted
+#define SEGMENT_COMPACT_LIVE_PERCENT 50
+
+// where a record lives, segment 0 means the object has its own cache file
+typedef struct
+{
+    uint32_t segment;
+    uint32_t offset; // 8 byte aligned
+} SegmentLoc;
+
+typedef struct Segment
+{
+    uint32_t id;
+    int fd;
+    atomic_int refs;    // the table's, plus one per running read
+    atomic_int writers; // appends not yet indexed, the compactor waits for them
+    size_t used;        // bytes appended, final once sealed
+    atomic_int sealed;  // full, no longer appended to
+    atomic_size_t live; // bytes of the records the cache index points at
+} Segment;
+
+typedef struct SegmentStore
+{
+    Segment **segments; // by id, NULL for removed ones
+    size_t capacity;
+    pthread_rwlock_t table_lock;
+    Segment *active;           // segment appends go to
+    uint32_t next_id;
+    pthread_mutex_t append_lock; // guards active, next_id and the used bytes
+    size_t max_object;           // objects up to this size are appended, 0 disables appends
+    pthread_mutex_t compact_lock;
+    pthread_cond_t compact_wake;
+    int compact_pending;
+    // asked by the compactor whether the key's entry still points at the record
+    int (*is_live)(void *arg, const char *key, SegmentLoc loc);
+    // moves the key's entry to the copied record, 0 when it no longer pointed at from
+    int (*relocate)(void *arg, const char *key, SegmentLoc from, SegmentLoc to);
+    void *arg;
+} SegmentStore;
+
+// opens the segments left by the previous run, all of them sealed, max_object
+// 0 only serves those and appends nothing
+SegmentStore *open_segment_store(size_t max_object);
+
+// whether an object of this size goes to the store
+int segment_accepts(SegmentStore *store, size_t data_len);
+
+// appends the object as one record, the same layout as a cache file, and fills
+// its location and length, the segment stays pinned against compaction till
+// segment_unpin once the location is indexed, 0 on failure
+int segment_append(SegmentStore *store, const char *url, int status_code, const char *content_type,
+                   const CacheMeta *meta, const char *data, size_t data_len, SegmentLoc *loc, size_t *length);
+
+void segment_unpin(SegmentStore *store, SegmentLoc loc);
+
+// reads the record and verifies both checksums, NULL when missing, corrupt or
+// stored for another url
+CacheObject *segment_read(SegmentStore *store, SegmentLoc loc, size_t length, const char *url);
+
+// whether the segment of the location still exists
+int segment_exists(SegmentStore *store, SegmentLoc loc);
+
+// counts the record as indexed
+void segment_mark_live(SegmentStore *store, SegmentLoc loc, size_t length);
+
+// counts the record as garbage, wakes the compactor when its segment got mostly dead
+void segment_release(SegmentStore *store, SegmentLoc loc, size_t length);
+
+// starts the thread compacting mostly dead segments, called once the index is
+// complete so live byte counts can be trusted
+int start_segment_compactor(SegmentStore *store,
+                            int (*is_live)(void *arg, const char *key, SegmentLoc loc),
+                            int (*relocate)(void *arg, const char *key, SegmentLoc from, SegmentLoc to),
+                            void *arg);
+
+#endif
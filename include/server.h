@@ -4,15 +4,91 @@
 #include "blocked-sites.h"
 #include "client-queue.h"
 #include "thread-pool.h"
+#include "event-loop.h"
+#include "refresher.h"
+#include "write-behind.h"
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <sys/resource.h>
 
 #define BACKLOG_SIZE 1024
-#define MAX_CLIENTS 10
 #define MAX_BLOCKED_SITES 100
-#define MAX_CACHE_SIZE 100
+
+// cache budgets, overridable by CACHE_MEM_BYTES / CACHE_DISK_BYTES env vars
+#define DEFAULT_CACHE_MEM_BYTES (64UL * 1024 * 1024)
+#define DEFAULT_CACHE_DISK_BYTES (1024UL * 1024 * 1024)
+
+// disk tier eviction policy, overridable by CACHE_POLICY env var (lru | s3fifo)
+#define DEFAULT_CACHE_POLICY "s3fifo"
+
+// seconds past expiry an entry is still served, overridable by CACHE_STALE_GRACE /
+// CACHE_STALE_IF_ERROR env vars, the first while it is refreshed in background,
+// the second only when the origin is unreachable or answers 5xx
+#define DEFAULT_CACHE_STALE_GRACE 60
+#define DEFAULT_CACHE_STALE_IF_ERROR 86400
+
+// durability of cache writes, overridable by CACHE_FSYNC env var (none | data | full)
+#define DEFAULT_CACHE_FSYNC CACHE_FSYNC_NONE
+
+// write-behind of cache files, overridable by CACHE_WRITE_THREADS (0 writes on the
+// request thread), CACHE_WRITE_QUEUE and CACHE_WRITE_FULL (block | drop | sync)
+#define DEFAULT_CACHE_WRITE_THREADS 2
+#define DEFAULT_CACHE_WRITE_QUEUE 1024
+#define DEFAULT_CACHE_WRITE_FULL WRITE_FULL_BLOCK
+
+// objects up to this size are appended to segment files instead of getting a
+// file each, overridable by CACHE_SEGMENT_OBJECT_MAX env var, 0 disables it
+#define DEFAULT_CACHE_SEGMENT_OBJECT_MAX 0
+
+// zstd level of html, css, js, json and other text on disk, overridable by
+// CACHE_COMPRESS_LEVEL env var, 0 stores them raw, needs a build with zstd
+#define DEFAULT_CACHE_COMPRESS_LEVEL 3
+
+// larger responses are relayed to the client without being cached,
+// overridable by CACHE_OBJECT_MAX env var
+#define DEFAULT_CACHE_OBJECT_MAX (128UL * 1024 * 1024)
+
+// idle keep-alive connections kept per origin, overridable by UPSTREAM_MAX_IDLE
+// env var, 0 closes each connection after its response
+#define DEFAULT_UPSTREAM_MAX_IDLE 8
+
+// connections in use per origin, further misses wait for one, overridable by
+// UPSTREAM_MAX_PER_HOST env var, 0 for no limit
+#define DEFAULT_UPSTREAM_MAX_PER_HOST 32
+
+// seconds an idle connection is kept, overridable by UPSTREAM_IDLE_TIMEOUT env var
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT 30
+
+// ms budgets of the phases of a request, overridable by CONNECT_TIMEOUT_MS,
+// TLS_TIMEOUT_MS, HEADER_TIMEOUT_MS, BODY_TIMEOUT_MS, CACHE_WRITE_TIMEOUT_MS and
+// REQUEST_TIMEOUT_MS env vars, 0 for no limit, the body budget is per pause
+// rather than the whole body
+#define DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define DEFAULT_TLS_TIMEOUT_MS 5000
+#define DEFAULT_HEADER_TIMEOUT_MS 15000
+#define DEFAULT_BODY_TIMEOUT_MS 30000
+#define DEFAULT_CACHE_WRITE_TIMEOUT_MS 100
+#define DEFAULT_REQUEST_TIMEOUT_MS 300000
+
+// bounds of the seconds a dns answer is cached whatever its ttl, overridable
+// by DNS_TTL_MIN and DNS_TTL_MAX env vars
+#define DEFAULT_DNS_TTL_MIN 5
+#define DEFAULT_DNS_TTL_MAX 300
+
+// seconds a name that doesn't exist is remembered at most, overridable by
+// DNS_NEGATIVE_TTL env var
+#define DEFAULT_DNS_NEGATIVE_TTL 30
+
+// workers fetching misses, overridable by WORKER_THREADS env var
+#define DEFAULT_WORKER_THREADS THREAD_POOL_SIZE
+
+// epoll loops taking clients, overridable by EVENT_LOOPS env var, 0 for one per online core
+#define DEFAULT_EVENT_LOOPS 0
+
+// what the loops wait on, overridable by IO_BACKEND env var (epoll | io_uring)
+#define DEFAULT_IO_BACKEND IO_BACKEND_EPOLL
 
 void server_shutdown_handler(int sig);
 
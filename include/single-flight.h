@@ -0,0 +1,53 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "deadline.h"
+
+#define INFLIGHT_BUCKETS 64
+
+struct HttpResponse;
+
+// one origin fetch in progress, shared by the leader and its followers
+typedef struct InflightCall
+{
+    char *key;
+    int done;
+    int abandoned;             // leader kept no body to share, followers fetch their own
+    int refs;                  // leader + waiting followers
+    struct HttpResponse *res;  // leader's result, copied by followers
+    pthread_cond_t finished;
+    struct InflightCall *next;
+} InflightCall;
+
+typedef struct
+{
+    InflightCall *buckets[INFLIGHT_BUCKETS];
+    pthread_mutex_t lock;
+} InflightTable;
+
+void init_inflight_table(InflightTable *table);
+
+void free_inflight_table(InflightTable *table);
+
+// joins the fetch of the key, first caller becomes the leader and must call inflight_complete
+InflightCall *inflight_join(InflightTable *table, const char *key, int *is_leader);
+
+// leader publishes its response (NULL on failure) and wakes up the followers
+void inflight_complete(InflightTable *table, InflightCall *call, const struct HttpResponse *res);
+
+// leader relayed a body it couldn't keep, followers are woken up to fetch it themselves
+void inflight_abandon(InflightTable *table, InflightCall *call);
+
+// follower gives up on the call without waiting for its result
+void inflight_leave(InflightTable *table, InflightCall *call);
+
+// follower blocks till the leader finishes, returns its own copy of the response,
+// abandoned is set when the leader had nothing to share, NULL when the total
+// of the deadline runs out first
+struct HttpResponse *inflight_wait(InflightTable *table, InflightCall *call, int *abandoned, Deadline *deadline);
+
+#endif
@@ -9,13 +9,45 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <pthread.h>
+#include <time.h>
+#include "utils.h"
+#include "stats.h"
+#include "dns-resolver.h"
+#include "deadline.h"
 
-int open_connection(const char *host, const char *port);
-SSL* ssl_wrap(int sockfd, const char *hostname, SSL_CTX **out_ctx);// SSL handshake + verification
+// last tls session kept per origin for resumption, power of 2
+#define TLS_SESSION_CACHE_SLOTS 1024
+
+// origins whose fastest address is remembered, direct mapped
+#define CONNECT_MEMORY_SLOTS 1024
+
+// head start of a connect attempt before the next address is tried too
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+// a connect attempt not done by then is given up on
+#define CONNECT_ATTEMPT_TIMEOUT_MS 10000
+
+// races connects to the addresses of the host with staggered starts, the
+// first to connect wins and the others are closed, -1 when none does within
+// the connect budget, the socket is left non-blocking
+int open_connection(const char *host, const char *port, Deadline *deadline);
+
+// creates the client context shared by every upstream connection, safe to call more than once
+int init_ssl_client(void);
+
+// SSL handshake within the tls budget, resuming the last session of the origin when there is one
+SSL *ssl_wrap(int sockfd, const char *hostname, const char *port, Deadline *deadline);
+
+// after an ssl call on a non-blocking socket returned ret, waits till until for
+// what it wants, returns 1 to retry the call, 0 when it timed out, -1 when it failed
+int wait_ssl(Deadline *deadline, SSL *ssl, int ret, long until);
 
 #endif
\ No newline at end of file
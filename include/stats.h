@@ -0,0 +1,73 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// no of compressible content classes, see ContentClass
+#define STATS_CONTENT_CLASSES 6
+
+// compression of one content class, ratio is raw_bytes / stored_bytes
+typedef struct
+{
+    atomic_ulong objects;      // bodies considered for compression
+    atomic_ulong raw_bytes;    // as received from the origin
+    atomic_ulong stored_bytes; // as written to disk
+    atomic_ulong decodes;      // compressed bodies read back
+    atomic_ulong decode_ns;    // time spent decompressing them
+} CompressionStats;
+
+// process wide counters, updated lock free from every worker
+typedef struct
+{
+    atomic_ulong clients_accepted; // connections taken by the event loops
+    atomic_ulong clients_open;     // of them not yet closed
+    atomic_ulong requests;    // proxied url lookups
+    atomic_ulong mem_hits;    // served from the memory tier
+    atomic_ulong disk_hits;   // served from the cached/ directory
+    atomic_ulong misses;      // fetched from the origin
+    atomic_ulong coalesced;   // misses served by another thread's fetch
+    atomic_ulong revalidated; // stale entries the origin confirmed with a 304
+    atomic_ulong stale_served; // expired entries served while refreshed in background
+    atomic_ulong stale_if_error; // expired entries served because the origin failed
+    atomic_ulong background_refreshes; // origin fetches made by the refresher
+    atomic_ulong writes_queued;  // responses handed to the write-behind threads
+    atomic_ulong writes_dropped; // responses not cached as the write queue was full
+    atomic_ulong writes_sync;    // responses written on the request thread as the queue was full
+    atomic_ulong mem_bytes;   // bytes currently held by the memory tier
+    atomic_ulong mem_objects; // objects currently held by the memory tier
+    atomic_ulong disk_bytes;  // bytes currently held by the disk tier
+    atomic_ulong disk_objects; // objects currently held by the disk tier
+    atomic_ulong evictions;   // entries evicted to fit the disk budget
+    atomic_ulong segments;    // segment files holding small objects
+    atomic_ulong segment_compactions; // segments rewritten to reclaim their dead records
+    atomic_ulong segment_bytes_moved; // live bytes copied out of compacted segments
+    atomic_ulong upstream_connects; // new connections opened to origins
+    atomic_ulong upstream_reused;   // requests sent on a pooled connection
+    atomic_ulong upstream_retries;  // requests resent as a pooled connection had been closed
+    atomic_ulong upstream_connect_attempts;  // connects started, several per new connection when racing
+    atomic_ulong upstream_connect_fallbacks; // new connections won by an address other than the first tried
+    atomic_ulong upstream_connect_us;        // time from the first attempt to the winning connect
+    atomic_ulong tls_handshakes;    // completed with an origin
+    atomic_ulong tls_resumed;       // of them abbreviated by resuming a session
+    atomic_ulong tls_handshake_us;  // time spent in them
+    atomic_ulong dns_lookups;     // host names resolved for a connection
+    atomic_ulong dns_cache_hits;  // answered by the resolver cache
+    atomic_ulong dns_coalesced;   // answered by another thread's query for the same name
+    atomic_ulong dns_queries;     // udp queries sent to the dns server
+    atomic_ulong dns_fallbacks;   // names handed to getaddrinfo
+    atomic_ulong dns_failures;    // names that got no answer at all
+    CompressionStats compression[STATS_CONTENT_CLASSES];
+} ProxyStats;
+
+extern ProxyStats proxy_stats;
+
+#define STATS_ADD(field, n) atomic_fetch_add_explicit(&proxy_stats.field, (n), memory_order_relaxed)
+#define STATS_SUB(field, n) atomic_fetch_sub_explicit(&proxy_stats.field, (n), memory_order_relaxed)
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+// renders the counters as "name value" lines, returns heap allocated text
+char *render_stats(size_t *out_len);
+
+#endif
@@ -3,22 +3,15 @@
 
 #include "client-queue.h"
 #include "client-handler.h"
+#include "event-loop.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #define THREAD_POOL_SIZE 10
 
-typedef struct
-{
-    ClientQueue *client_queue;
-    CacheLRU *cache;
-    pthread_mutex_t *cache_lock;
-    char **blocked_sites;
-    int n_of_b_sites;
-} SharedContext;
-
-void init_thread_pool(SharedContext *shared_ctx);
+// starts n workers fetching misses, THREAD_POOL_SIZE when n <= 0
+void init_thread_pool(SharedContext *shared_ctx, int n);
 void *worker_thread_func(void *arg);
 
 #endif
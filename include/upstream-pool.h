@@ -0,0 +1,70 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include "utils.h"
+#include "stats.h"
+#include "socket-utils.h"
+
+#define UPSTREAM_POOL_BUCKETS 64
+
+// a body left unread on a returned connection is skipped if it's this small,
+// else the connection is closed
+#define UPSTREAM_DRAIN_MAX (64 * 1024)
+
+struct UpstreamHost;
+
+// connection to an origin, owned by one stream while checked out
+typedef struct UpstreamConn
+{
+    int sockfd;
+    SSL *ssl;           // NULL for plain http
+    int reused;         // taken from the idle list, the origin may have closed it meanwhile
+    time_t idle_since;
+    struct UpstreamHost *host;
+    struct UpstreamConn *next;
+} UpstreamConn;
+
+// connections to one scheme, host and port
+typedef struct UpstreamHost
+{
+    char *key;          // "scheme://host:port"
+    UpstreamConn *idle; // most recently returned first
+    int n_idle;
+    int active;         // checked out
+    int waiting;        // checkouts waiting for a slot
+    struct UpstreamHost *next;
+} UpstreamHost;
+
+typedef struct
+{
+    UpstreamHost *buckets[UPSTREAM_POOL_BUCKETS];
+    int max_idle;        // idle connections kept per host, 0 closes each after its response
+    int max_per_host;    // checked out connections per host, further checkouts wait, 0 for no limit
+    time_t idle_timeout; // idle connections older than this are closed
+    pthread_mutex_t lock;
+    pthread_cond_t released; // some host got a connection back
+} UpstreamPool;
+
+// sets the limits and starts the thread closing connections idle for too long,
+// till then every connection is closed after its response
+void start_upstream_pool(int max_idle, int max_per_host, time_t idle_timeout);
+
+// whether connections are kept open for further requests
+int upstream_keep_alive(void);
+
+// hands out an idle connection that still looks alive or opens a new one,
+// NULL when connecting fails or no slot frees up within the connect budget
+UpstreamConn *checkout_upstream(const char *scheme, const char *host, const char *port, Deadline *deadline);
+
+// gives the connection back, it is kept idle if reusable and there's room, else closed
+void checkin_upstream(UpstreamConn *conn, int reusable);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include "event-loop.h"
+#include "client-handler.h"
+#include "deadline.h"
+#include "stats.h"
+
+// submission queue of each ring, the completion queue gets twice as many
+#define URING_ENTRIES 4096
+
+// receive buffers each ring provides to the kernel, a client's bytes land in
+// whichever is free and it goes back to the ring once they are parsed
+#define URING_RECV_BUFFERS 512
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+// registered file table of each ring, cached bodies are read through a slot of it
+#define URING_FILE_SLOTS 1024
+
+// bodies go out in sends of at most this, file bodies are read in chunks of it
+#define URING_SEND_CHUNK (64 * 1024)
+
+// whether this kernel and build can run the io_uring loops
+int uring_supported(void);
+
+// runs the loop on a ring of its own, never returns
+void run_uring_loop(EventLoop *loop);
+
+#endif
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <time.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,4 +16,19 @@ void write_file(const char *file_path, const char *data, size_t data_size);
 long time_passed_in_hours_for_file(const char *file_path);
 
 int urls_are_equivalent(const char *a, const char *b);
+
+// reads a byte size like 512, 64K, 256M or 2G from the env var, default when unset or invalid
+size_t get_env_size(const char *name, size_t default_value);
+
+// parses a byte size like 512, 64K, 256M or 2G, default when NULL or invalid
+size_t parse_size(const char *value, size_t default_value);
+
+// parses an HTTP-date like "Sun, 06 Nov 1994 08:49:37 GMT", 0 when invalid
+time_t parse_http_date(const char *value);
+
+// 64 bit FNV-1a hash of the string
+uint64_t hash_string(const char *str);
+
+// 64 bit FNV-1a hash of len bytes
+uint64_t hash_bytes(const void *data, size_t len);
 #endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef WRITE_BEHIND_H
+#define WRITE_BEHIND_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cache.h"
+#include "deadline.h"
+
+// no of hash buckets finding pending writes by key
+#define WRITE_BEHIND_BUCKETS 256
+
+// max jobs a writer thread takes per wakeup
+#define WRITE_BEHIND_BATCH 16
+
+// what a miss does when the queue is full
+typedef enum
+{
+    WRITE_FULL_BLOCK, // waits for a free slot
+    WRITE_FULL_DROP,  // skips caching the response
+    WRITE_FULL_SYNC,  // writes it on the request thread
+} WriteFullPolicy;
+
+// a response waiting to be written to the disk tier
+typedef struct WriteJob
+{
+    char key[CACHE_KEY_LEN + 1];
+    char *url;
+    CacheObject *object; // body shared with the responses sending it
+    CacheMeta meta;
+    int writing;   // taken by a writer, a newer job for the key gets its own entry written after it
+    int cancelled; // entry got deleted meanwhile, undone after the write
+    struct WriteJob *next;        // fifo order
+    struct WriteJob *bucket_next; // pending lookup by key
+} WriteJob;
+
+typedef struct WriteBehind
+{
+    WriteJob *head;
+    WriteJob *tail;
+    size_t count;    // queued jobs, not counting the ones being written
+    size_t capacity;
+    WriteFullPolicy full_policy;
+    WriteJob *buckets[WRITE_BEHIND_BUCKETS]; // queued and in progress jobs
+    CacheLRU *cache;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} WriteBehind;
+
+// starts the writer threads and attaches the queue to the cache
+WriteBehind *start_write_behind(CacheLRU *cache, size_t capacity, int n_threads, WriteFullPolicy full_policy);
+
+// parses block, drop or sync, 0 when unknown
+int parse_write_full_policy(const char *name, WriteFullPolicy *policy);
+
+// stores the response in the cache, on a writer thread when write-behind runs,
+// waiting for room in a full queue is bounded by the write phase and drops the write
+void submit_cache_write(CacheLRU *cache, const char *url, CacheObject *object, const CacheMeta *meta,
+                        Deadline *deadline);
+
+// retained object of the newest pending write of the key, NULL when none
+CacheObject *find_pending_write(WriteBehind *wb, const char *key, CacheMeta *meta);
+
+// drops queued writes of the key and undoes the one in progress
+void cancel_pending_write(WriteBehind *wb, const char *key);
+
+#endif
@@ -0,0 +1,148 @@
+#include "../include/cache-codec.h"
+
+// set once at startup
+static int compress_level = 0;
+
+static const char *content_class_names[] = {"html", "css", "js", "json", "xml", "text", "other"};
+
+// whether the media type, parameters excluded, is exactly type
+static int is_type(const char *content_type, size_t len, const char *type)
+{
+    return len == strlen(type) && strncasecmp(content_type, type, len) == 0;
+}
+
+// whether the media type ends with the structured syntax suffix, like +json
+static int has_suffix(const char *content_type, size_t len, const char *suffix)
+{
+    size_t suffix_len = strlen(suffix);
+    return len > suffix_len && strncasecmp(content_type + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+ContentClass get_content_class(const char *content_type)
+{
+    if (!content_type)
+        return CONTENT_OTHER;
+
+    size_t len = strcspn(content_type, "; \t");
+
+    if (is_type(content_type, len, "text/html") || is_type(content_type, len, "application/xhtml+xml"))
+        return CONTENT_HTML;
+    if (is_type(content_type, len, "text/css"))
+        return CONTENT_CSS;
+    if (is_type(content_type, len, "application/javascript") || is_type(content_type, len, "text/javascript") ||
+        is_type(content_type, len, "application/x-javascript") || is_type(content_type, len, "application/ecmascript"))
+        return CONTENT_JS;
+    if (is_type(content_type, len, "application/json") || has_suffix(content_type, len, "+json"))
+        return CONTENT_JSON;
+    if (is_type(content_type, len, "application/xml") || is_type(content_type, len, "text/xml") ||
+        has_suffix(content_type, len, "+xml"))
+        return CONTENT_XML;
+    if (len > 5 && strncasecmp(content_type, "text/", 5) == 0)
+        return CONTENT_TEXT;
+
+    return CONTENT_OTHER;
+}
+
+const char *content_class_name(ContentClass content_class)
+{
+    return content_class_names[content_class];
+}
+
+void set_cache_compress_level(int level)
+{
+    compress_level = level;
+}
+
+#ifdef HAVE_ZSTD
+// contexts are reused by each thread, creating one per object costs more than small decodes
+static __thread ZSTD_CCtx *compress_ctx;
+static __thread ZSTD_DCtx *decompress_ctx;
+#endif
+
+int encode_cache_body(const char *content_type, const char *data, size_t data_len,
+                      char **encoded, size_t *encoded_len)
+{
+#ifdef HAVE_ZSTD
+    ContentClass content_class = get_content_class(content_type);
+    if (!compress_level || content_class == CONTENT_OTHER ||
+        data_len < CACHE_COMPRESS_MIN_SIZE || data_len > CACHE_COMPRESS_MAX_SIZE)
+        return CACHE_CODEC_NONE;
+
+    if (!compress_ctx && !(compress_ctx = ZSTD_createCCtx()))
+        return CACHE_CODEC_NONE;
+
+    size_t bound = ZSTD_compressBound(data_len);
+    char *out = malloc(bound);
+    if (!out)
+        return CACHE_CODEC_NONE;
+
+    size_t out_len = ZSTD_compressCCtx(compress_ctx, out, bound, data, data_len, compress_level);
+
+    // counted either way so the ratio reflects everything of the class
+    CompressionStats *stats = &proxy_stats.compression[content_class];
+    int worth_it = !ZSTD_isError(out_len) && out_len <= data_len - data_len / 8;
+    atomic_fetch_add_explicit(&stats->objects, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->raw_bytes, data_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->stored_bytes, worth_it ? out_len : data_len, memory_order_relaxed);
+
+    // a body that barely shrinks isn't worth decoding on every hit
+    if (!worth_it)
+    {
+        free(out);
+        return CACHE_CODEC_NONE;
+    }
+
+    *encoded = out;
+    *encoded_len = out_len;
+    return CACHE_CODEC_ZSTD;
+#else
+    (void)content_type;
+    (void)data;
+    (void)data_len;
+    (void)encoded;
+    (void)encoded_len;
+    return CACHE_CODEC_NONE;
+#endif
+}
+
+int decode_cache_body(int codec, const char *content_type, const char *src, size_t src_len,
+                      char *dst, size_t dst_len)
+{
+    if (codec == CACHE_CODEC_NONE)
+    {
+        if (src_len != dst_len)
+            return 0;
+        memcpy(dst, src, src_len);
+        return 1;
+    }
+
+#ifdef HAVE_ZSTD
+    if (codec != CACHE_CODEC_ZSTD)
+        return 0;
+
+    if (!decompress_ctx && !(decompress_ctx = ZSTD_createDCtx()))
+        return 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t n = ZSTD_decompressDCtx(decompress_ctx, dst, dst_len, src, src_len);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ContentClass content_class = get_content_class(content_type);
+    if (content_class != CONTENT_OTHER)
+    {
+        CompressionStats *stats = &proxy_stats.compression[content_class];
+        unsigned long ns = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+        atomic_fetch_add_explicit(&stats->decodes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->decode_ns, ns, memory_order_relaxed);
+    }
+
+    return !ZSTD_isError(n) && n == dst_len;
+#else
+    // written by a build with zstd, a miss here
+    (void)content_type;
+    (void)src;
+    (void)dst;
+    return 0;
+#endif
+}
@@ -0,0 +1,329 @@
+#include "../include/cache-manifest.h"
+
+// journal a running snapshot folds in, replayed only if it never committed
+#define CACHE_MANIFEST_JOURNAL_OLD CACHE_MANIFEST_JOURNAL ".old"
+#define CACHE_MANIFEST_SNAPSHOT_TMP CACHE_MANIFEST_SNAPSHOT ".tmp"
+
+#define MANIFEST_MAGIC 0x464d5850 // "PXMF"
+#define MANIFEST_VERSION 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+} ManifestHeader;
+
+// on disk layout of an entry, followed by the etag and last modified bytes
+typedef struct
+{
+    uint32_t length;   // of the whole record, padded to 8 bytes so the next one stays aligned
+    uint32_t checksum; // of the bytes after this field, a torn tail fails it
+    int64_t last_access;
+    int64_t stored_at;
+    int64_t expires_at;
+    uint64_t size;
+    uint8_t op;
+    uint8_t queue;
+    uint8_t freq;
+    uint8_t must_revalidate;
+    uint16_t etag_len;
+    uint16_t last_modified_len;
+    uint32_t segment;
+    uint32_t segment_offset;
+    char key[CACHE_KEY_LEN];
+} ManifestRecord;
+
+// largest encoded record, validators are bounded by CacheMeta
+#define MANIFEST_RECORD_MAX (sizeof(ManifestRecord) + sizeof(((CacheMeta *)0)->etag) + \
+                             sizeof(((CacheMeta *)0)->last_modified) + 8)
+
+struct ManifestWriter
+{
+    CacheManifest *manifest;
+    FILE *file;
+    int failed;
+};
+
+static uint32_t record_checksum(const unsigned char *record, size_t length)
+{
+    size_t offset = offsetof(ManifestRecord, last_access);
+    return (uint32_t)hash_bytes(record + offset, length - offset);
+}
+
+// serializes the entry into buf, returns the record length
+static size_t encode_record(const ManifestEntry *entry, unsigned char *buf)
+{
+    ManifestRecord *record = (ManifestRecord *)buf;
+    memset(record, 0, sizeof(ManifestRecord));
+
+    record->last_access = entry->last_access;
+    record->stored_at = entry->meta.stored_at;
+    record->expires_at = entry->meta.expires_at;
+    record->size = entry->size;
+    record->op = entry->op;
+    record->queue = entry->queue;
+    record->freq = entry->freq;
+    record->must_revalidate = entry->meta.must_revalidate;
+    record->etag_len = strnlen(entry->meta.etag, sizeof(entry->meta.etag) - 1);
+    record->last_modified_len = strnlen(entry->meta.last_modified, sizeof(entry->meta.last_modified) - 1);
+    record->segment = entry->location.segment;
+    record->segment_offset = entry->location.offset;
+    memcpy(record->key, entry->key, CACHE_KEY_LEN);
+
+    size_t length = sizeof(ManifestRecord);
+    memcpy(buf + length, entry->meta.etag, record->etag_len);
+    length += record->etag_len;
+    memcpy(buf + length, entry->meta.last_modified, record->last_modified_len);
+    length += record->last_modified_len;
+
+    size_t padded = (length + 7) & ~(size_t)7;
+    memset(buf + length, 0, padded - length);
+
+    record->length = padded;
+    record->checksum = record_checksum(buf, padded);
+    return padded;
+}
+
+// parses the record at p, returns its length or 0 when it is torn or corrupt
+static size_t decode_record(const unsigned char *p, size_t avail, ManifestEntry *entry)
+{
+    if (avail < sizeof(ManifestRecord))
+        return 0;
+
+    const ManifestRecord *record = (const ManifestRecord *)p;
+    if (record->length < sizeof(ManifestRecord) || record->length > avail ||
+        record->length > MANIFEST_RECORD_MAX || record->length % 8 != 0)
+        return 0;
+    if (record->checksum != record_checksum(p, record->length))
+        return 0;
+    if (record->etag_len >= sizeof(entry->meta.etag) ||
+        record->last_modified_len >= sizeof(entry->meta.last_modified) ||
+        sizeof(ManifestRecord) + record->etag_len + record->last_modified_len > record->length)
+        return 0;
+
+    memset(entry, 0, sizeof(ManifestEntry));
+    entry->op = record->op;
+    entry->queue = record->queue;
+    entry->freq = record->freq;
+    memcpy(entry->key, record->key, CACHE_KEY_LEN);
+    entry->size = record->size;
+    entry->location.segment = record->segment;
+    entry->location.offset = record->segment_offset;
+    entry->last_access = record->last_access;
+    entry->meta.stored_at = record->stored_at;
+    entry->meta.expires_at = record->expires_at;
+    entry->meta.must_revalidate = record->must_revalidate;
+
+    const char *strings = (const char *)p + sizeof(ManifestRecord);
+    memcpy(entry->meta.etag, strings, record->etag_len);
+    memcpy(entry->meta.last_modified, strings + record->etag_len, record->last_modified_len);
+
+    return record->length;
+}
+
+// maps the manifest file read only, NULL when missing or not a manifest
+static const unsigned char *map_manifest_file(const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ManifestHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    const ManifestHeader *header = data;
+    if (header->magic != MANIFEST_MAGIC || header->version != MANIFEST_VERSION)
+    {
+        printf("ignoring unknown manifest: %s\n", path);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    return data;
+}
+
+// feeds every valid record of the file to fn, returns the bytes of the valid prefix
+static size_t replay_manifest_file(const char *path, void (*fn)(const ManifestEntry *entry, void *arg), void *arg)
+{
+    size_t length = 0;
+    const unsigned char *data = map_manifest_file(path, &length);
+    if (!data)
+        return 0;
+
+    size_t offset = sizeof(ManifestHeader);
+    ManifestEntry entry;
+    size_t record_len;
+    while ((record_len = decode_record(data + offset, length - offset, &entry)) > 0)
+    {
+        if (fn)
+            fn(&entry, arg);
+        offset += record_len;
+    }
+
+    if (offset != length)
+        printf("manifest %s: dropping %zu bytes of torn records\n", path, length - offset);
+
+    munmap((void *)data, length);
+    return offset;
+}
+
+// opens the journal for appending, a new or broken one starts with a fresh header
+static int open_journal(const char *path)
+{
+    // torn tail of a crashed run is cut so new records stay reachable
+    size_t valid = replay_manifest_file(path, NULL, NULL);
+
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        perror("open manifest journal");
+        return -1;
+    }
+
+    if (ftruncate(fd, valid) != 0 || lseek(fd, 0, SEEK_END) < 0)
+    {
+        perror("truncate manifest journal");
+        close(fd);
+        return -1;
+    }
+
+    if (valid == 0)
+    {
+        ManifestHeader header = {.magic = MANIFEST_MAGIC, .version = MANIFEST_VERSION};
+        if (write(fd, &header, sizeof(header)) != sizeof(header))
+        {
+            perror("write manifest journal");
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+int open_cache_manifest(CacheManifest *manifest)
+{
+    manifest->journal_records = 0;
+    atomic_init(&manifest->loading, 0);
+    pthread_mutex_init(&manifest->lock, NULL);
+    pthread_cond_init(&manifest->wake, NULL);
+
+    manifest->journal_fd = open_journal(CACHE_MANIFEST_JOURNAL);
+    return manifest->journal_fd >= 0;
+}
+
+void close_cache_manifest(CacheManifest *manifest)
+{
+    if (manifest->journal_fd >= 0)
+        close(manifest->journal_fd);
+    manifest->journal_fd = -1;
+
+    pthread_cond_destroy(&manifest->wake);
+    pthread_mutex_destroy(&manifest->lock);
+}
+
+void manifest_append(CacheManifest *manifest, const ManifestEntry *entry)
+{
+    unsigned char buf[MANIFEST_RECORD_MAX];
+    size_t length = encode_record(entry, buf);
+
+    pthread_mutex_lock(&manifest->lock);
+
+    if (manifest->journal_fd >= 0)
+    {
+        // a single append, concurrent writers never interleave within a record
+        if (write(manifest->journal_fd, buf, length) != (ssize_t)length)
+            perror("write manifest journal");
+
+        if (++manifest->journal_records >= CACHE_MANIFEST_MAX_JOURNAL)
+            pthread_cond_signal(&manifest->wake);
+    }
+
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+int load_cache_manifest(void (*fn)(const ManifestEntry *entry, void *arg), void *arg)
+{
+    // later files hold later changes, replaying all of them in order gives the last state
+    int found = 0;
+    found |= replay_manifest_file(CACHE_MANIFEST_SNAPSHOT, fn, arg) > 0;
+    found |= replay_manifest_file(CACHE_MANIFEST_JOURNAL_OLD, fn, arg) > 0;
+    found |= replay_manifest_file(CACHE_MANIFEST_JOURNAL, fn, arg) > sizeof(ManifestHeader);
+    return found;
+}
+
+ManifestWriter *begin_manifest_snapshot(CacheManifest *manifest)
+{
+    ManifestWriter *writer = calloc(1, sizeof(ManifestWriter));
+    if (!writer)
+        return NULL;
+    writer->manifest = manifest;
+
+    writer->file = fopen(CACHE_MANIFEST_SNAPSHOT_TMP, "wb");
+    if (!writer->file)
+    {
+        perror("open manifest snapshot");
+        free(writer);
+        return NULL;
+    }
+
+    ManifestHeader header = {.magic = MANIFEST_MAGIC, .version = MANIFEST_VERSION};
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1)
+        writer->failed = 1;
+
+    pthread_mutex_lock(&manifest->lock);
+
+    // changes made while the snapshot is written land in a fresh journal, an
+    // old journal left by a failed snapshot is still needed so it is kept
+    if (access(CACHE_MANIFEST_JOURNAL_OLD, F_OK) != 0 && manifest->journal_fd >= 0)
+    {
+        close(manifest->journal_fd);
+        if (rename(CACHE_MANIFEST_JOURNAL, CACHE_MANIFEST_JOURNAL_OLD) != 0)
+            perror("rotate manifest journal");
+        manifest->journal_fd = open_journal(CACHE_MANIFEST_JOURNAL);
+        manifest->journal_records = 0;
+    }
+
+    pthread_mutex_unlock(&manifest->lock);
+
+    return writer;
+}
+
+void manifest_snapshot_add(ManifestWriter *writer, const ManifestEntry *entry)
+{
+    unsigned char buf[MANIFEST_RECORD_MAX];
+    size_t length = encode_record(entry, buf);
+
+    if (fwrite(buf, 1, length, writer->file) != length)
+        writer->failed = 1;
+}
+
+int commit_manifest_snapshot(ManifestWriter *writer)
+{
+    int ok = !writer->failed && fflush(writer->file) == 0 && fsync(fileno(writer->file)) == 0;
+    fclose(writer->file);
+
+    // old snapshot stays in place till the new one is complete on disk
+    if (ok && rename(CACHE_MANIFEST_SNAPSHOT_TMP, CACHE_MANIFEST_SNAPSHOT) == 0)
+        unlink(CACHE_MANIFEST_JOURNAL_OLD);
+    else
+    {
+        printf("failed to write manifest snapshot\n");
+        unlink(CACHE_MANIFEST_SNAPSHOT_TMP);
+        ok = 0;
+    }
+
+    free(writer);
+    return ok;
+}
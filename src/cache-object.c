@@ -0,0 +1,72 @@
+#include "../include/cache-object.h"
+
+CacheObject *alloc_cache_object(const char *content_type, size_t length)
+{
+    CacheObject *object = malloc(sizeof(CacheObject) + length + 1);
+    if (!object)
+        return NULL;
+
+    atomic_init(&object->refs, 1);
+    object->length = length;
+    object->fd = -1;
+    object->offset = 0;
+    object->body[length] = '\0';
+
+    object->content_type[0] = '\0';
+    if (content_type)
+        strncat(object->content_type, content_type, sizeof(object->content_type) - 1);
+
+    return object;
+}
+
+CacheObject *new_cache_object(const char *content_type, const char *data, size_t length)
+{
+    CacheObject *object = alloc_cache_object(content_type, length);
+    if (object)
+        memcpy(object->body, data, length);
+
+    return object;
+}
+
+CacheObject *resize_cache_object(CacheObject *object, size_t length)
+{
+    CacheObject *resized = realloc(object, sizeof(CacheObject) + length + 1);
+    if (!resized)
+        return NULL;
+
+    resized->length = length;
+    resized->body[length] = '\0';
+
+    return resized;
+}
+
+CacheObject *new_file_cache_object(const char *content_type, int fd, off_t offset, size_t length)
+{
+    CacheObject *object = alloc_cache_object(content_type, 0);
+    if (!object)
+        return NULL;
+
+    object->length = length;
+    object->fd = fd;
+    object->offset = offset;
+
+    return object;
+}
+
+CacheObject *retain_cache_object(CacheObject *object)
+{
+    if (object)
+        atomic_fetch_add_explicit(&object->refs, 1, memory_order_relaxed);
+
+    return object;
+}
+
+void release_cache_object(CacheObject *object)
+{
+    if (object && atomic_fetch_sub_explicit(&object->refs, 1, memory_order_acq_rel) == 1)
+    {
+        if (object->fd >= 0)
+            close(object->fd);
+        free(object);
+    }
+}
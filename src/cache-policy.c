@@ -0,0 +1,227 @@
+#include "../include/cache-policy.h"
+#include "../include/cache.h"
+
+static void list_unlink(CacheEntry **head, CacheEntry **tail, CacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        *head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        *tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void list_push_head(CacheEntry **head, CacheEntry **tail, CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = *head;
+
+    if (*head)
+        (*head)->prev = entry;
+    *head = entry;
+
+    if (!*tail)
+        *tail = entry;
+}
+
+// takes the entry out of whichever queue it is in
+static void queue_unlink(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->queue == CACHE_QUEUE_SMALL)
+    {
+        list_unlink(&shard->small_head, &shard->small_tail, entry);
+        shard->small_bytes -= entry->size;
+    }
+    else
+        list_unlink(&shard->head, &shard->tail, entry);
+}
+
+static void lru_on_insert(CacheShard *shard, CacheEntry *entry)
+{
+    entry->queue = CACHE_QUEUE_MAIN;
+    list_push_head(&shard->head, &shard->tail, entry);
+}
+
+// entries are restored oldest first, so pushing each to the head keeps the order
+static void lru_on_restore(CacheShard *shard, CacheEntry *entry)
+{
+    lru_on_insert(shard, entry);
+}
+
+static void lru_on_hit(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry == shard->head)
+        return;
+
+    list_unlink(&shard->head, &shard->tail, entry);
+    list_push_head(&shard->head, &shard->tail, entry);
+}
+
+static CacheEntry *lru_victim(CacheShard *shard)
+{
+    return shard->tail;
+}
+
+const CachePolicy lru_policy = {
+    .name = "lru",
+    .on_insert = lru_on_insert,
+    .on_restore = lru_on_restore,
+    .on_hit = lru_on_hit,
+    .on_remove = queue_unlink,
+    .victim = lru_victim,
+};
+
+// ghost slot of the hash, table is direct mapped so old ghosts get overwritten
+static uint64_t *ghost_slot(CacheShard *shard, uint64_t hash)
+{
+    return &shard->ghosts[(hash >> 16) & (shard->ghost_capacity - 1)];
+}
+
+// remembers a key evicted from the small queue without keeping its data
+static void ghost_put(CacheShard *shard, uint64_t hash)
+{
+    // ghost history tracks about as many keys as the shard indexes
+    if (shard->ghost_capacity < shard->capacity)
+    {
+        uint64_t *old_ghosts = shard->ghosts;
+        size_t old_capacity = shard->ghost_capacity;
+        uint64_t *ghosts = calloc(shard->capacity, sizeof(uint64_t));
+        if (!ghosts)
+            return;
+
+        shard->ghosts = ghosts;
+        shard->ghost_capacity = shard->capacity;
+
+        // the history carries over, readmission keeps working while the shard grows
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_ghosts[i])
+                *ghost_slot(shard, old_ghosts[i]) = old_ghosts[i];
+        }
+        free(old_ghosts);
+    }
+
+    *ghost_slot(shard, hash) = hash;
+}
+
+// checks whether the key was recently evicted, forgetting it if so
+static int ghost_take(CacheShard *shard, uint64_t hash)
+{
+    if (!shard->ghosts)
+        return 0;
+
+    uint64_t *slot = ghost_slot(shard, hash);
+    if (*slot != hash)
+        return 0;
+
+    *slot = 0;
+    return 1;
+}
+
+static void s3fifo_on_insert(CacheShard *shard, CacheEntry *entry)
+{
+    entry->freq = 0;
+
+    // seen shortly before, skip probation
+    if (ghost_take(shard, entry->hash))
+    {
+        entry->queue = CACHE_QUEUE_MAIN;
+        list_push_head(&shard->head, &shard->tail, entry);
+        return;
+    }
+
+    entry->queue = CACHE_QUEUE_SMALL;
+    list_push_head(&shard->small_head, &shard->small_tail, entry);
+    shard->small_bytes += entry->size;
+}
+
+// queue and credits come from the manifest, ghosts are not persisted
+static void s3fifo_on_restore(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->freq > S3FIFO_MAX_FREQ)
+        entry->freq = S3FIFO_MAX_FREQ;
+
+    if (entry->queue == CACHE_QUEUE_SMALL)
+    {
+        list_push_head(&shard->small_head, &shard->small_tail, entry);
+        shard->small_bytes += entry->size;
+    }
+    else
+    {
+        entry->queue = CACHE_QUEUE_MAIN;
+        list_push_head(&shard->head, &shard->tail, entry);
+    }
+}
+
+// hits only bump a counter, queues are reordered lazily on eviction
+static void s3fifo_on_hit(CacheShard *shard, CacheEntry *entry)
+{
+    (void)shard;
+    if (entry->freq < S3FIFO_MAX_FREQ)
+        entry->freq++;
+}
+
+static CacheEntry *s3fifo_victim(CacheShard *shard)
+{
+    while (1)
+    {
+        // one hit wonders leave through the small queue without touching main
+        if (shard->small_tail &&
+            (shard->small_bytes * 100 > shard->disk_bytes * S3FIFO_SMALL_PERCENT || !shard->tail))
+        {
+            CacheEntry *entry = shard->small_tail;
+            if (entry->freq == 0)
+            {
+                ghost_put(shard, entry->hash);
+                return entry;
+            }
+
+            // got hit while on probation, promote to main
+            queue_unlink(shard, entry);
+            entry->freq = 0;
+            entry->queue = CACHE_QUEUE_MAIN;
+            list_push_head(&shard->head, &shard->tail, entry);
+            continue;
+        }
+
+        CacheEntry *entry = shard->tail;
+        if (!entry)
+            return NULL;
+
+        if (entry->freq == 0)
+            return entry;
+
+        // reinserted with one less credit, loop ends as credits run out
+        entry->freq--;
+        list_unlink(&shard->head, &shard->tail, entry);
+        list_push_head(&shard->head, &shard->tail, entry);
+    }
+}
+
+const CachePolicy s3fifo_policy = {
+    .name = "s3fifo",
+    .on_insert = s3fifo_on_insert,
+    .on_restore = s3fifo_on_restore,
+    .on_hit = s3fifo_on_hit,
+    .on_remove = queue_unlink,
+    .victim = s3fifo_victim,
+};
+
+const CachePolicy *get_cache_policy(const char *name)
+{
+    if (!name)
+        return NULL;
+
+    if (strcasecmp(name, lru_policy.name) == 0)
+        return &lru_policy;
+    if (strcasecmp(name, s3fifo_policy.name) == 0)
+        return &s3fifo_policy;
+
+    return NULL;
+}
@@ -1,5 +1,8 @@
 #include "../include/cache-store.h"
 
+// durability of object writes, set once at startup
+static CacheFsyncPolicy fsync_policy = CACHE_FSYNC_NONE;
+
 void ensure_cache_dir()
 {
     struct stat st = {0};
@@ -9,122 +12,643 @@ void ensure_cache_dir()
     }
 }
 
-// sanitizes invalid chars from the url for filename
-char *get_cache_filename(const char *url)
+// cached/ab/cd/abcd..., fan-out dirs come from the first 2 bytes of the key
+static void get_cache_path(const char *key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%.2s/%.2s/%s", CACHE_DIR, key, key + 2, key);
+}
+
+// creates the fan-out dirs of the key, existing ones are fine
+static void ensure_key_dirs(const char *key)
+{
+    char dir[64];
+
+    snprintf(dir, sizeof(dir), "%s/%.2s", CACHE_DIR, key);
+    mkdir(dir, 0700);
+
+    snprintf(dir, sizeof(dir), "%s/%.2s/%.2s", CACHE_DIR, key, key + 2);
+    mkdir(dir, 0700);
+}
+
+// same resource spelled differently gets the same key, scheme and host are
+// case insensitive, fragment never reaches the origin, empty path is "/"
+static char *canonical_url(const char *url)
 {
-    size_t url_len = strlen(url);
+    size_t url_len = strcspn(url, "#");
 
-    char *filename = malloc(url_len + 1);
-    if (!filename)
+    // room for the "/" appended to a bare host
+    char *canonical = malloc(url_len + 2);
+    if (!canonical)
         return NULL;
-    filename[url_len] = '\0';
+    memcpy(canonical, url, url_len);
+    canonical[url_len] = '\0';
+
+    char *host = strstr(canonical, "://");
+    host = host ? host + 3 : canonical;
+
+    char *path = host + strcspn(host, "/?");
+    for (char *p = canonical; p < path; p++)
+        *p = tolower((unsigned char)*p);
 
-    const char *invalid = "<>:\"/\\|?*";
-    for (int i = 0; url[i]; i++)
+    if (*path != '/')
     {
-        unsigned char ch = url[i];
-        if (ch < 32 || strchr(invalid, ch))
-            filename[i] = '-';
-        else
-            filename[i] = url[i];
+        memmove(path + 1, path, strlen(path) + 1);
+        *path = '/';
     }
 
-    // removing trailing / or -
-    if (filename[url_len - 1] == '-')
-        filename[url_len - 1] = '\0';
+    return canonical;
+}
+
+int is_cache_url_storable(const char *url)
+{
+    char *canonical = canonical_url(url);
+    int storable = canonical && strlen(canonical) <= CACHE_OBJECT_MAX_URL;
+    free(canonical);
 
-    return filename;
+    return storable;
 }
 
-int write_cache_file(const char *filename, const char *content_type, const char *data, size_t data_len)
+char *get_cache_key(const char *url)
 {
-    char full_path[1024];
-    snprintf(full_path, sizeof(full_path) - 1, "%s/%s", CACHE_DIR, filename);
+    char *canonical = canonical_url(url);
+    if (!canonical)
+        return NULL;
+
+    // truncated sha-256, collisions are still caught by the url stored in the file
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    int ok = EVP_Digest(canonical, strlen(canonical), digest, &digest_len, EVP_sha256(), NULL);
+    free(canonical);
+    if (!ok || digest_len < CACHE_KEY_BYTES)
+        return NULL;
 
-    FILE *fptr = fopen(full_path, "wb");
-    if (!fptr)
+    char *key = malloc(CACHE_KEY_LEN + 1);
+    if (!key)
+        return NULL;
+
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < CACHE_KEY_BYTES; i++)
     {
-        printf("failed to write file: %s\n", full_path);
+        key[i * 2] = hex[digest[i] >> 4];
+        key[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+    key[CACHE_KEY_LEN] = '\0';
+
+    return key;
+}
+
+int stat_cache_file(const char *key, size_t *footprint, time_t *mtime)
+{
+    char full_path[256];
+    get_cache_path(key, full_path, sizeof(full_path));
+
+    struct stat st;
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode))
         return 0;
+
+    // allocated blocks, a 300 byte file still costs a whole block
+    size_t blocks = (size_t)st.st_blocks * 512;
+    *footprint = blocks > (size_t)st.st_size ? blocks : (size_t)st.st_size;
+    *mtime = st.st_mtime;
+    return 1;
+}
+
+void remove_cache_file(const char *key)
+{
+    char full_path[256];
+    get_cache_path(key, full_path, sizeof(full_path));
+    remove(full_path);
+}
+
+// header and length prefixed metadata, fills the lengths
+static size_t encode_object_header(CacheObjectHeader *header, char *metadata, const char *url,
+                                   int status_code, const char *content_type, const CacheMeta *meta)
+{
+    const char *etag = meta ? meta->etag : "";
+    const char *last_modified = meta ? meta->last_modified : "";
+
+    memset(header, 0, sizeof(CacheObjectHeader));
+    header->magic = CACHE_OBJECT_MAGIC;
+    header->version = CACHE_OBJECT_VERSION;
+    header->status_code = status_code;
+    header->url_len = strlen(url);
+    header->content_type_len = MIN_LEN(strlen(content_type), CACHE_OBJECT_MAX_FIELD);
+    header->etag_len = MIN_LEN(strlen(etag), CACHE_OBJECT_MAX_FIELD);
+    header->last_modified_len = MIN_LEN(strlen(last_modified), CACHE_OBJECT_MAX_FIELD);
+    if (meta)
+    {
+        header->stored_at = meta->stored_at;
+        header->expires_at = meta->expires_at;
+        header->must_revalidate = meta->must_revalidate;
     }
 
-    // writing the content type with separator \n
-    if (fprintf(fptr, "%s\n", content_type) <= 0)
+    size_t len = 0;
+    memcpy(metadata + len, url, header->url_len);
+    len += header->url_len;
+    memcpy(metadata + len, content_type, header->content_type_len);
+    len += header->content_type_len;
+    memcpy(metadata + len, etag, header->etag_len);
+    len += header->etag_len;
+    memcpy(metadata + len, last_modified, header->last_modified_len);
+    len += header->last_modified_len;
+
+    // body starts 8 byte aligned right after the metadata
+    size_t padded = (len + 7) & ~(size_t)7;
+    memset(metadata + len, 0, padded - len);
+    header->body_offset = sizeof(CacheObjectHeader) + padded;
+
+    return padded;
+}
+
+size_t encode_cache_object_header(CacheObjectHeader *header, char *metadata, const char *url,
+                                  int status_code, const char *content_type, const CacheMeta *meta,
+                                  const char *data, size_t data_len, const char **body, char **encoded)
+{
+    char *canonical = canonical_url(url);
+    if (!canonical)
+        return 0;
+
+    // a cut url would never match on read, the object could not be served
+    if (strlen(canonical) > CACHE_OBJECT_MAX_URL)
     {
-        printf("failed to write content type to file: %s\n", filename);
-        fclose(fptr);
+        printf("url too long to cache: %.64s...\n", canonical);
+        free(canonical);
         return 0;
     }
 
-    // writing the actual data
-    if (fwrite(data, 1, data_len, fptr) != data_len)
+    size_t metadata_len = encode_object_header(header, metadata, canonical, status_code,
+                                               content_type ? content_type : "", meta);
+    free(canonical);
+
+    *encoded = NULL;
+    *body = data;
+    size_t encoded_len = 0;
+    header->codec = encode_cache_body(content_type, data, data_len, encoded, &encoded_len);
+    if (header->codec != CACHE_CODEC_NONE)
     {
-        printf("failed to write full data to file: %s\n", filename);
-        fclose(fptr);
+        header->raw_len = data_len;
+        *body = *encoded;
+        data_len = encoded_len;
+    }
+
+    header->body_len = data_len;
+    header->body_crc = crc32c(0, *body, data_len);
+    header->header_crc = crc32c(crc32c(0, header, sizeof(CacheObjectHeader)), metadata, metadata_len);
+
+    return metadata_len;
+}
+
+size_t cache_object_raw_len(const CacheObjectHeader *header)
+{
+    return header->codec == CACHE_CODEC_NONE ? header->body_len : header->raw_len;
+}
+
+int check_cache_object_header(const CacheObjectHeader *header, const char *name)
+{
+    if (header->magic != CACHE_OBJECT_MAGIC || header->version != CACHE_OBJECT_VERSION)
+    {
+        printf("not a cache object: %s\n", name);
+        return 0;
+    }
+
+    if (header->url_len > CACHE_OBJECT_MAX_URL || header->content_type_len > CACHE_OBJECT_MAX_FIELD ||
+        header->etag_len > CACHE_OBJECT_MAX_FIELD || header->last_modified_len > CACHE_OBJECT_MAX_FIELD ||
+        header->body_offset < sizeof(CacheObjectHeader) ||
+        header->body_offset - sizeof(CacheObjectHeader) > CACHE_OBJECT_MAX_METADATA)
+    {
+        printf("corrupt cache object header: %s\n", name);
         return 0;
     }
 
-    fclose(fptr);
     return 1;
 }
-char *read_cache_file(const char *filename, char *content_type_out, size_t *data_len_out)
+
+int check_cache_object_metadata(CacheObjectHeader *header, const char *metadata, const char *name)
 {
-    FILE *fptr = NULL;
-    char *data = NULL;
+    size_t metadata_len = header->body_offset - sizeof(CacheObjectHeader);
+
+    uint32_t stored_crc = header->header_crc;
+    header->header_crc = 0;
+    uint32_t crc = crc32c(crc32c(0, header, sizeof(CacheObjectHeader)), metadata, metadata_len);
+    header->header_crc = stored_crc;
+    if (crc != stored_crc)
+    {
+        printf("cache object header checksum mismatch: %s\n", name);
+        return 0;
+    }
 
-    char full_path[1024];
-    snprintf(full_path, sizeof(full_path) - 1, "%s/%s", CACHE_DIR, filename);
+    return 1;
+}
+
+int cache_object_url_matches(const CacheObjectHeader *header, const char *metadata, const char *url)
+{
+    char *canonical = canonical_url(url);
+    int matches = canonical && strlen(canonical) == header->url_len &&
+                  memcmp(metadata, canonical, header->url_len) == 0;
+    free(canonical);
 
-    fptr = fopen(full_path, "rb");
-    if (!fptr)
+    return matches;
+}
+
+void set_cache_fsync_policy(CacheFsyncPolicy policy)
+{
+    fsync_policy = policy;
+}
+
+CacheFsyncPolicy get_cache_fsync_policy()
+{
+    return fsync_policy;
+}
+
+int parse_cache_fsync_policy(const char *name, CacheFsyncPolicy *policy)
+{
+    if (strcasecmp(name, "none") == 0)
+        *policy = CACHE_FSYNC_NONE;
+    else if (strcasecmp(name, "data") == 0)
+        *policy = CACHE_FSYNC_DATA;
+    else if (strcasecmp(name, "full") == 0)
+        *policy = CACHE_FSYNC_FULL;
+    else
+        return 0;
+
+    return 1;
+}
+
+// writes all len bytes, retrying short writes
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
     {
-        printf("failed to read file: %s\n", full_path);
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// makes the rename itself durable by syncing the directory holding the file
+static void fsync_parent_dir(const char *path)
+{
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+        return;
+    *slash = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+int write_cache_file(const char *key, const char *url, int status_code, const char *content_type,
+                     const CacheMeta *meta, const char *data, size_t data_len)
+{
+    char full_path[256];
+    get_cache_path(key, full_path, sizeof(full_path));
+
+    ensure_key_dirs(key);
+
+    CacheObjectHeader header;
+    char metadata[CACHE_OBJECT_MAX_METADATA];
+    const char *body;
+    char *encoded;
+    size_t metadata_len = encode_cache_object_header(&header, metadata, url, status_code, content_type,
+                                                     meta, data, data_len, &body, &encoded);
+    if (!metadata_len)
+        return 0;
+
+    // written next to the final path, readers only ever open complete files
+    char temp_path[256];
+    snprintf(temp_path, sizeof(temp_path), "%s/%.2s/%.2s/" CACHE_TEMP_PREFIX "%s-XXXXXX",
+             CACHE_DIR, key, key + 2, key);
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+    {
+        printf("failed to write file: %s\n", full_path);
+        free(encoded);
+        return 0;
+    }
+
+    // writing the header with its metadata, then the actual data
+    if (!write_all(fd, &header, sizeof(header)) || !write_all(fd, metadata, metadata_len) ||
+        !write_all(fd, body, header.body_len))
+    {
+        printf("failed to write full data to file: %s\n", full_path);
         goto catch;
     }
 
-    // getting file stats, like size
-    struct stat st;
-    if (stat(full_path, &st) != 0)
+    if ((fsync_policy == CACHE_FSYNC_DATA && fdatasync(fd) != 0) ||
+        (fsync_policy == CACHE_FSYNC_FULL && fsync(fd) != 0))
+    {
+        printf("failed to sync file: %s\n", full_path);
         goto catch;
-    long file_size = st.st_size;
+    }
+
+    close(fd);
+    fd = -1;
+
+    // replaces the old object atomically, its open readers keep the old inode
+    if (rename(temp_path, full_path) != 0)
+    {
+        printf("failed to rename file: %s\n", full_path);
+        goto catch;
+    }
+
+    if (fsync_policy == CACHE_FSYNC_FULL)
+        fsync_parent_dir(full_path);
+
+    free(encoded);
+    return 1;
+
+catch:
+    if (fd >= 0)
+        close(fd);
+    unlink(temp_path);
+    free(encoded);
+    return 0;
+}
+
+// reads and verifies the header and metadata of an open cache file, 0 when it
+// isn't a complete object of this version
+static int read_object_header(int fd, const char *path, CacheObjectHeader *header, char *metadata)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return 0;
+
+    if (pread(fd, header, sizeof(CacheObjectHeader), 0) != sizeof(CacheObjectHeader))
+    {
+        printf("not a cache object: %s\n", path);
+        return 0;
+    }
+
+    if (!check_cache_object_header(header, path))
+        return 0;
+
+    // a write cut short leaves the file shorter than the header says
+    if ((uint64_t)st.st_size != header->body_offset + header->body_len)
+    {
+        printf("truncated cache object: %s\n", path);
+        return 0;
+    }
+
+    size_t metadata_len = header->body_offset - sizeof(CacheObjectHeader);
+    if (pread(fd, metadata, metadata_len, sizeof(CacheObjectHeader)) != (ssize_t)metadata_len)
+        return 0;
+
+    return check_cache_object_metadata(header, metadata, path);
+}
+
+// opens the cache file of the key and verifies its header, returns the fd or
+// -1 when missing, corrupt, truncated or stored for another url
+static int open_object_file(const char *key, const char *url, CacheObjectHeader *header, char *content_type)
+{
+    char full_path[256];
+    get_cache_path(key, full_path, sizeof(full_path));
+
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("failed to read file: %s\n", full_path);
+        return -1;
+    }
 
-    // reading the content type
-    int ch = '\0';
-    while ((ch = getc(fptr)) != '\n')
-        *content_type_out++ = ch;
-    *content_type_out = '\0';
+    char metadata[CACHE_OBJECT_MAX_METADATA];
+    if (!read_object_header(fd, full_path, header, metadata))
+    {
+        close(fd);
+        return -1;
+    }
+
+    // another url hashing to the same key is a miss
+    if (url && !cache_object_url_matches(header, metadata, url))
+    {
+        printf("cache key collision: %s\n", key);
+        close(fd);
+        return -1;
+    }
 
-    // calculating the body data length
-    long body_start = ftell(fptr);
-    if (body_start < 0 || body_start >= file_size)
+    memcpy(content_type, metadata + header->url_len, header->content_type_len);
+    content_type[header->content_type_len] = '\0';
+
+    return fd;
+}
+
+CacheObject *read_cache_object(const char *key, const char *url)
+{
+    CacheObject *object = NULL;
+    char *stored = NULL;
+
+    CacheObjectHeader header;
+    char content_type[CACHE_OBJECT_MAX_FIELD + 1];
+    int fd = open_object_file(key, url, &header, content_type);
+    if (fd < 0)
         goto catch;
-    size_t body_len = file_size - body_start;
 
-    // allocating space
-    data = (char *)malloc(body_len + 1);
-    if (!data)
+    // allocating the object with space for the decoded body
+    object = alloc_cache_object(content_type, cache_object_raw_len(&header));
+    if (!object)
     {
         printf("failed to allocated space for data\n");
         goto catch;
     }
 
-    size_t bytes_read = fread(data, 1, body_len, fptr);
-    data[bytes_read] = '\0';
-    *data_len_out = bytes_read;
+    // raw bodies are read straight into the object, encoded ones through a buffer
+    stored = header.codec == CACHE_CODEC_NONE ? object->body : malloc(header.body_len);
+    if (!stored)
+        goto catch;
 
-    if (bytes_read != body_len)
+    // body sits at a known offset, no scanning for separators
+    if (pread(fd, stored, header.body_len, header.body_offset) != (ssize_t)header.body_len)
     {
-        printf("failed to read specified bytes from file: %s\n", filename);
+        printf("failed to read specified bytes from cache object: %s\n", key);
         goto catch;
     }
 
-    fclose(fptr);
-    return data;
+    if (crc32c(0, stored, header.body_len) != header.body_crc)
+    {
+        printf("cache object body checksum mismatch: %s\n", key);
+        goto catch;
+    }
+
+    if (header.codec != CACHE_CODEC_NONE &&
+        !decode_cache_body(header.codec, content_type, stored, header.body_len, object->body, object->length))
+    {
+        printf("failed to decode cache object: %s\n", key);
+        goto catch;
+    }
+
+    if (stored != object->body)
+        free(stored);
+    close(fd);
+    return object;
 
 catch:
-    if (fptr)
-        fclose(fptr);
-    if (data)
-        free(data);
+    if (fd >= 0)
+        close(fd);
+    if (object && stored != object->body)
+        free(stored);
+    if (object)
+        release_cache_object(object);
     return NULL;
 }
+
+CacheObject *open_cache_object(const char *key, const char *url)
+{
+    CacheObjectHeader header;
+    char content_type[CACHE_OBJECT_MAX_FIELD + 1];
+    int fd = open_object_file(key, url, &header, content_type);
+    if (fd < 0)
+        return NULL;
+
+    // an encoded body has to be decoded in memory, it can't be sent as is
+    if (header.codec != CACHE_CODEC_NONE)
+    {
+        close(fd);
+        return read_cache_object(key, url);
+    }
+
+    // body is never read here, the header checks guard against truncation
+    CacheObject *object = new_file_cache_object(content_type, fd, header.body_offset, header.body_len);
+    if (!object)
+        close(fd);
+
+    return object;
+}
+
+int read_cache_meta(const char *key, CacheMeta *meta)
+{
+    char full_path[256];
+    get_cache_path(key, full_path, sizeof(full_path));
+
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    CacheObjectHeader header;
+    char metadata[CACHE_OBJECT_MAX_METADATA];
+    int ok = read_object_header(fd, full_path, &header, metadata);
+    close(fd);
+    if (!ok)
+        return 0;
+
+    memset(meta, 0, sizeof(CacheMeta));
+    meta->stored_at = header.stored_at;
+    meta->expires_at = header.expires_at;
+    meta->must_revalidate = header.must_revalidate;
+
+    const char *etag = metadata + header.url_len + header.content_type_len;
+    memcpy(meta->etag, etag, MIN_LEN(header.etag_len, sizeof(meta->etag) - 1));
+    memcpy(meta->last_modified, etag + header.etag_len,
+           MIN_LEN(header.last_modified_len, sizeof(meta->last_modified) - 1));
+
+    return 1;
+}
+
+// whether the name is one level of the hex fan-out
+static int is_fanout_dir_name(const char *name)
+{
+    return strlen(name) == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]);
+}
+
+// calls fn with every file name in the leaf fan-out directories
+static void walk_cache_dirs(void (*fn)(const char *dir, const char *name, void *arg), void *arg)
+{
+    DIR *top = opendir(CACHE_DIR);
+    if (!top)
+        return;
+
+    char path[256];
+    struct dirent *de1;
+    while ((de1 = readdir(top)) != NULL)
+    {
+        if (!is_fanout_dir_name(de1->d_name))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%.2s", CACHE_DIR, de1->d_name);
+        DIR *mid = opendir(path);
+        if (!mid)
+            continue;
+
+        struct dirent *de2;
+        while ((de2 = readdir(mid)) != NULL)
+        {
+            if (!is_fanout_dir_name(de2->d_name))
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%.2s/%.2s", CACHE_DIR, de1->d_name, de2->d_name);
+            DIR *leaf = opendir(path);
+            if (!leaf)
+                continue;
+
+            struct dirent *de3;
+            while ((de3 = readdir(leaf)) != NULL)
+            {
+                if (de3->d_name[0] != '.' || strncmp(de3->d_name, CACHE_TEMP_PREFIX, strlen(CACHE_TEMP_PREFIX)) == 0)
+                    fn(path, de3->d_name, arg);
+            }
+            closedir(leaf);
+        }
+        closedir(mid);
+    }
+    closedir(top);
+}
+
+typedef struct
+{
+    void (*fn)(const char *key, void *arg);
+    void *arg;
+} KeyVisitor;
+
+static void visit_key(const char *dir, const char *name, void *arg)
+{
+    (void)dir;
+    KeyVisitor *visitor = arg;
+
+    // only full width keys, anything else is not ours
+    if (strlen(name) == CACHE_KEY_LEN)
+        visitor->fn(name, visitor->arg);
+}
+
+void for_each_cache_file(void (*fn)(const char *key, void *arg), void *arg)
+{
+    KeyVisitor visitor = {.fn = fn, .arg = arg};
+    walk_cache_dirs(visit_key, &visitor);
+}
+
+typedef struct
+{
+    time_t older_than;
+    size_t removed;
+} OrphanSweep;
+
+static void remove_orphan(const char *dir, const char *name, void *arg)
+{
+    OrphanSweep *sweep = arg;
+    if (strncmp(name, CACHE_TEMP_PREFIX, strlen(CACHE_TEMP_PREFIX)) != 0)
+        return;
+
+    // temp files of writes running right now are newer
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_mtime < sweep->older_than && unlink(path) == 0)
+        sweep->removed++;
+}
+
+size_t remove_orphan_temp_files(time_t older_than)
+{
+    OrphanSweep sweep = {.older_than = older_than, .removed = 0};
+    walk_cache_dirs(remove_orphan, &sweep);
+    return sweep.removed;
+}
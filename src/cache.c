@@ -1,260 +1,951 @@
 #include "../include/cache.h"
+#include "../include/write-behind.h"
 
-CacheLRU *init_cache_lru(int max_size)
+// picks the shard owning the hash, high bits so slots use the low ones
+static CacheShard *get_shard(CacheLRU *cache, uint64_t hash)
 {
-    CacheLRU *cache = (CacheLRU *)malloc(sizeof(CacheLRU));
-    cache->head = NULL;
-    cache->tail = NULL;
-    cache->current_size = 0;
-    cache->max_size = max_size;
+    return &cache->shards[(hash >> 32) % CACHE_SHARD_COUNT];
+}
+
+// returns the slot holding the key or the empty slot where it would go
+static size_t index_probe(CacheShard *shard, uint64_t hash, const char *key)
+{
+    size_t mask = shard->capacity - 1;
+    size_t i = hash & mask;
+
+    while (shard->slots[i].entry &&
+           (shard->slots[i].hash != hash || strcmp(shard->slots[i].entry->key, key) != 0))
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+// finds the node of the key in the shard, caller must hold shard lock
+static CacheEntry *shard_find(CacheShard *shard, uint64_t hash, const char *key)
+{
+    return shard->slots[index_probe(shard, hash, key)].entry;
+}
+
+// doubles the index, hashes are stored so no key is rehashed
+static int index_grow(CacheShard *shard)
+{
+    size_t new_capacity = shard->capacity * 2;
+    CacheSlot *new_slots = calloc(new_capacity, sizeof(CacheSlot));
+    if (!new_slots)
+        return 0;
+
+    for (size_t i = 0; i < shard->capacity; i++)
+    {
+        if (!shard->slots[i].entry)
+            continue;
+
+        size_t j = shard->slots[i].hash & (new_capacity - 1);
+        while (new_slots[j].entry)
+            j = (j + 1) & (new_capacity - 1);
+        new_slots[j] = shard->slots[i];
+    }
 
-    // open the directory for taking cache filenames
-    DIR *dir = opendir(CACHE_DIR);
+    free(shard->slots);
+    shard->slots = new_slots;
+    shard->capacity = new_capacity;
+    return 1;
+}
+
+// adds a new entry to the index keeping load factor under 3/4
+static int index_put(CacheShard *shard, CacheEntry *entry)
+{
+    if ((size_t)(shard->current_size + 1) * 4 > shard->capacity * 3 && !index_grow(shard))
+        return 0;
+
+    size_t i = index_probe(shard, entry->hash, entry->key);
+    shard->slots[i].hash = entry->hash;
+    shard->slots[i].entry = entry;
+    return 1;
+}
+
+// removes the entry using backward shift deletion, so no tombstones pile up
+static void index_remove(CacheShard *shard, CacheEntry *entry)
+{
+    size_t mask = shard->capacity - 1;
+    size_t i = index_probe(shard, entry->hash, entry->key);
+    if (!shard->slots[i].entry)
+        return;
 
-    // traversing through entries in the directory and adding their names in cache
-    struct dirent *de;
-    struct stat st;
-    char full_path[1024];
-    while ((de = readdir(dir)) != NULL)
+    size_t j = i;
+    while (1)
     {
-        // skip unwanted entries like '.', '..', '.meta'
-        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        j = (j + 1) & mask;
+        if (!shard->slots[j].entry)
+            break;
+
+        // slot j can fill the hole only if its home isn't between hole and j
+        size_t home = shard->slots[j].hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
             continue;
 
-        // taking the full path
-        snprintf(full_path, sizeof(full_path), "%s/%s", CACHE_DIR, de->d_name);
+        shard->slots[i] = shard->slots[j];
+        i = j;
+    }
+
+    shard->slots[i].entry = NULL;
+    shard->slots[i].hash = 0;
+}
+
+// marks the node as just used and lets the policy reorder it, caller must hold shard lock
+static void shard_touch(CacheLRU *cache, CacheShard *shard, CacheEntry *entry)
+{
+    entry->last_access = time(NULL);
+    cache->policy->on_hit(shard, entry);
+}
+
+// size an object is charged to the memory tier
+static size_t object_footprint(const CacheObject *object)
+{
+    return sizeof(CacheObject) + object->length + 1;
+}
+
+// detaches the node from the memory tier list, caller must hold shard lock
+static void mem_unlink(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->mem_prev)
+        entry->mem_prev->mem_next = entry->mem_next;
+    else
+        shard->mem_head = entry->mem_next;
+
+    if (entry->mem_next)
+        entry->mem_next->mem_prev = entry->mem_prev;
+    else
+        shard->mem_tail = entry->mem_prev;
+
+    entry->mem_prev = NULL;
+    entry->mem_next = NULL;
+}
+
+// moves the node to the head of the memory tier list, caller must hold shard lock
+static void mem_link_head(CacheShard *shard, CacheEntry *entry)
+{
+    entry->mem_prev = NULL;
+    entry->mem_next = shard->mem_head;
+
+    if (shard->mem_head)
+        shard->mem_head->mem_prev = entry;
+    shard->mem_head = entry;
+
+    if (!shard->mem_tail)
+        shard->mem_tail = entry;
+}
+
+// drops the in memory copy, entry stays served from disk, caller must hold shard lock
+static void mem_demote(CacheShard *shard, CacheEntry *entry)
+{
+    if (!entry->object)
+        return;
+
+    size_t footprint = object_footprint(entry->object);
+
+    mem_unlink(shard, entry);
+    shard->mem_bytes -= footprint;
+    STATS_SUB(mem_bytes, footprint);
+    STATS_SUB(mem_objects, 1);
+
+    // responses still sending it hold their own reference
+    release_cache_object(entry->object);
+    entry->object = NULL;
+}
+
+// keeps a copy of the object in memory, demoting the coldest ones over budget
+static void mem_promote(CacheShard *shard, CacheEntry *entry, CacheObject *object)
+{
+    size_t footprint = object_footprint(object);
+    if (entry->object || footprint > shard->mem_max_bytes)
+        return;
+
+    while (shard->mem_tail && shard->mem_bytes + footprint > shard->mem_max_bytes)
+        mem_demote(shard, shard->mem_tail);
+
+    entry->object = retain_cache_object(object);
+    mem_link_head(shard, entry);
+    shard->mem_bytes += footprint;
+    STATS_ADD(mem_bytes, footprint);
+    STATS_ADD(mem_objects, 1);
+}
+
+// copies the freshness info and validators into the entry
+static void entry_set_meta(CacheEntry *entry, const CacheMeta *meta)
+{
+    entry->stored_at = meta->stored_at;
+    entry->expires_at = meta->expires_at;
+    entry->must_revalidate = meta->must_revalidate;
+
+    free(entry->etag);
+    free(entry->last_modified);
+    entry->etag = meta->etag[0] ? strdup(meta->etag) : NULL;
+    entry->last_modified = meta->last_modified[0] ? strdup(meta->last_modified) : NULL;
+}
+
+// fills the meta with the freshness info and validators of the entry
+static void entry_get_meta(const CacheEntry *entry, CacheMeta *meta)
+{
+    memset(meta, 0, sizeof(CacheMeta));
+    meta->stored_at = entry->stored_at;
+    meta->expires_at = entry->expires_at;
+    meta->must_revalidate = entry->must_revalidate;
+
+    if (entry->etag)
+        strncpy(meta->etag, entry->etag, sizeof(meta->etag) - 1);
+    if (entry->last_modified)
+        strncpy(meta->last_modified, entry->last_modified, sizeof(meta->last_modified) - 1);
+}
+
+static void free_entry(CacheEntry *entry)
+{
+    release_cache_object(entry->object);
+    free(entry->etag);
+    free(entry->last_modified);
+    free(entry->key);
+    free(entry);
+}
+
+// fills the manifest record of the entry
+static void entry_to_record(const CacheEntry *entry, unsigned char op, ManifestEntry *record)
+{
+    memset(record, 0, sizeof(ManifestEntry));
+    record->op = op;
+    record->queue = entry->queue;
+    record->freq = entry->freq;
+    strncpy(record->key, entry->key, CACHE_KEY_LEN);
+    record->size = entry->size;
+    record->location = entry->location;
+    record->last_access = entry->last_access;
+    entry_get_meta(entry, &record->meta);
+}
+
+// records the entry's current state in the manifest journal
+static void journal_entry(CacheLRU *cache, const CacheEntry *entry, unsigned char op)
+{
+    ManifestEntry record;
+    entry_to_record(entry, op, &record);
+    manifest_append(&cache->manifest, &record);
+}
+
+// creates and indexes an entry without linking it in any queue, caller must hold shard lock
+static CacheEntry *shard_add(CacheLRU *cache, CacheShard *shard, const char *key, uint64_t hash,
+                             size_t size, SegmentLoc location, const CacheMeta *meta)
+{
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (!entry || !(entry->key = strdup(key)))
+    {
+        printf("failed to add entry in list\n");
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->size = size;
+    entry->location = location;
+    entry->version = ++shard->last_version;
+    entry->last_access = time(NULL);
+    entry_set_meta(entry, meta);
+
+    if (!index_put(shard, entry))
+    {
+        printf("failed to add entry in index\n");
+        free_entry(entry);
+        return NULL;
+    }
+
+    shard->current_size++;
+    shard->disk_bytes += size;
+    if (location.segment)
+        segment_mark_live(cache->segments, location, size);
+
+    atomic_fetch_add(&cache->disk_bytes, size);
+    STATS_ADD(disk_bytes, size);
+    STATS_INC(disk_objects);
 
-        // taking the stats of the file
-        if (stat(full_path, &st) == -1)
+    return entry;
+}
+
+// drops the node from the shard keeping its cache file, a segment record
+// becomes garbage, caller must hold shard lock
+static void shard_unindex(CacheLRU *cache, CacheShard *shard, CacheEntry *curr)
+{
+    if (curr->location.segment)
+        segment_release(cache->segments, curr->location, curr->size);
+
+    atomic_fetch_sub(&cache->disk_bytes, curr->size);
+    STATS_SUB(disk_bytes, curr->size);
+    STATS_SUB(disk_objects, 1);
+
+    shard->disk_bytes -= curr->size;
+
+    mem_demote(shard, curr);
+    index_remove(shard, curr);
+    cache->policy->on_remove(shard, curr);
+
+    free_entry(curr);
+    shard->current_size--;
+}
+
+// removes the node and its cache file, caller must hold shard lock
+static void shard_remove(CacheLRU *cache, CacheShard *shard, CacheEntry *curr)
+{
+    journal_entry(cache, curr, MANIFEST_DEL);
+
+    // remove the corresponding file, segment records are reclaimed by compaction
+    if (!curr->location.segment)
+        remove_cache_file(curr->key);
+
+    shard_unindex(cache, shard, curr);
+}
+
+// evicts entries till the disk tier fits its budget
+static void evict_over_budget(CacheLRU *cache)
+{
+    while (atomic_load(&cache->disk_bytes) > cache->disk_max_bytes)
+    {
+        // keys spread evenly over shards, so the fullest shard gives up its victim
+        CacheShard *victim = NULL;
+        size_t largest = 0;
+        for (int i = 0; i < CACHE_SHARD_COUNT; i++)
         {
-            perror("stat failed");
-            closedir(dir);
-            free_cache_lru(cache);
-            return NULL;
+            CacheShard *shard = &cache->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            if (shard->current_size > 0 && shard->disk_bytes > largest)
+            {
+                victim = shard;
+                largest = shard->disk_bytes;
+            }
+            pthread_mutex_unlock(&shard->lock);
         }
 
-        // if it is a regular file then add name in cache
-        if (S_ISREG(st.st_mode))
-            lru_insert(cache, de->d_name, NULL, 0, NULL);
+        if (!victim)
+            return;
+
+        pthread_mutex_lock(&victim->lock);
+        lru_evict(cache, victim);
+        pthread_mutex_unlock(&victim->lock);
     }
+}
 
-    // closing the directory
-    closedir(dir);
+// indexes the object of the key stored at location, rewritten when its
+// content just changed, returns the entry's version, 0 when it isn't kept
+static uint64_t index_object(CacheLRU *cache, const char *key, size_t size, SegmentLoc location,
+                             int rewritten, const CacheMeta *meta)
+{
+    // objects stored without headers live for the default ttl
+    time_t now = time(NULL);
+    CacheMeta default_meta = {.stored_at = now, .expires_at = now + CACHE_DEFAULT_TTL};
+    if (!meta)
+        meta = &default_meta;
+
+    // object alone is bigger than the whole disk tier, don't keep it
+    if (size > cache->disk_max_bytes)
+    {
+        printf("too large to cache: %s\n", key);
+        if (!location.segment)
+            remove_cache_file(key);
+        return 0;
+    }
 
-    // returning the head of final cache
-    return cache;
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    // if url already in the list then only move it to head
+    CacheEntry *entry = shard_find(shard, hash, key);
+    if (entry)
+    {
+        // file got rewritten, in memory copy and reads in flight are outdated
+        if (rewritten)
+        {
+            mem_demote(shard, entry);
+            entry->version = ++shard->last_version;
+        }
+
+        // the previous copy is garbage once the object moved, a file rewritten
+        // in place was already replaced by the rename
+        if (entry->location.segment)
+            segment_release(cache->segments, entry->location, entry->size);
+        else if (location.segment)
+            remove_cache_file(key);
+        if (location.segment)
+            segment_mark_live(cache->segments, location, size);
+        entry->location = location;
+
+        atomic_fetch_add(&cache->disk_bytes, size - entry->size);
+        STATS_ADD(disk_bytes, size - entry->size);
+        shard->disk_bytes += size - entry->size;
+        if (entry->queue == CACHE_QUEUE_SMALL)
+            shard->small_bytes += size - entry->size;
+        entry->size = size;
+        entry->restored = 0;
+        entry_set_meta(entry, meta);
+
+        shard_touch(cache, shard, entry);
+    }
+    else
+    {
+        // a file of the previous run may still wait for the restore
+        if (location.segment && atomic_load(&cache->manifest.loading))
+            remove_cache_file(key);
+
+        entry = shard_add(cache, shard, key, hash, size, location, meta);
+        if (entry)
+            cache->policy->on_insert(shard, entry);
+    }
+
+    // files found by the startup scan go into the snapshot written right after it
+    if (entry && rewritten)
+        journal_entry(cache, entry, MANIFEST_PUT);
+
+    uint64_t version = entry ? entry->version : 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    // remove least recently used cache till it fits again
+    evict_over_budget(cache);
+    return version;
 }
 
-void free_cache_lru(CacheLRU *cache)
+// indexes the cache file of the key, rewritten when its content just changed,
+// returns the entry's version, 0 when it isn't kept
+static uint64_t index_cache_file(CacheLRU *cache, const char *key, int rewritten, const CacheMeta *meta)
 {
-    if (!cache)
+    // real space taken on disk, 0 when the file couldn't be written
+    size_t size = 0;
+    time_t mtime = 0;
+    if (!stat_cache_file(key, &size, &mtime))
+        return 0;
+
+    // files found on disk carry no headers, they live as long as they used to
+    CacheMeta default_meta = {.stored_at = mtime, .expires_at = mtime + CACHE_DEFAULT_TTL};
+    if (!meta)
+        meta = &default_meta;
+
+    SegmentLoc own_file = {0};
+    return index_object(cache, key, size, own_file, rewritten, meta);
+}
+
+// startup scan callback for files of a run that left no manifest
+static void index_existing_file(const char *key, void *arg)
+{
+    // freshness is stored with the object, unreadable files fall back to the default ttl
+    CacheMeta meta;
+    index_cache_file((CacheLRU *)arg, key, 0, read_cache_meta(key, &meta) ? &meta : NULL);
+}
+
+// applies one manifest record, entries a live request already replaced are left alone
+static void restore_entry(const ManifestEntry *record, void *arg)
+{
+    CacheLRU *cache = (CacheLRU *)arg;
+
+    uint64_t hash = hash_string(record->key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *entry = shard_find(shard, hash, record->key);
+    if (entry && !entry->restored)
+        goto unlock;
+
+    // later record of the same key supersedes the earlier one
+    if (entry)
+        shard_unindex(cache, shard, entry);
+
+    if (record->op != MANIFEST_PUT)
+        goto unlock;
+
+    // segment got compacted away after the record was written
+    if (record->location.segment && !segment_exists(cache->segments, record->location))
+        goto unlock;
+
+    entry = shard_add(cache, shard, record->key, hash, record->size, record->location, &record->meta);
+    if (!entry)
+        goto unlock;
+
+    entry->last_access = record->last_access;
+    entry->queue = record->queue;
+    entry->freq = record->freq;
+    entry->restored = 1;
+    cache->policy->on_restore(shard, entry);
+
+unlock:
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// writes every entry to a new snapshot, oldest first in each queue so that
+// restoring them one by one rebuilds the same order
+static void snapshot_manifest(CacheLRU *cache)
+{
+    ManifestWriter *writer = begin_manifest_snapshot(&cache->manifest);
+    if (!writer)
         return;
 
-    CacheEntry *curr = cache->head;
-    while (curr)
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++)
     {
-        CacheEntry *next = curr->next;
-        free(curr->url);
-        free(curr);
-        curr = next;
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+
+        CacheEntry *queues[] = {shard->tail, shard->small_tail};
+        for (int q = 0; q < 2; q++)
+        {
+            for (CacheEntry *entry = queues[q]; entry; entry = entry->prev)
+            {
+                ManifestEntry record;
+                entry_to_record(entry, MANIFEST_PUT, &record);
+                manifest_snapshot_add(writer, &record);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
     }
-    free(cache);
+
+    commit_manifest_snapshot(writer);
 }
 
-int lru_contains(CacheLRU *cache, const char *url)
+// whether the key's entry still points at the segment record
+static int segment_entry_is_live(void *arg, const char *key, SegmentLoc loc)
 {
+    CacheLRU *cache = (CacheLRU *)arg;
 
-    if (!cache || !url || url[0] == '\0')
-        return 0;
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
 
-    CacheEntry *tmp = cache->head;
-    char *filename = get_cache_filename(url);
+    CacheEntry *entry = shard_find(shard, hash, key);
+    int live = entry && entry->location.segment == loc.segment && entry->location.offset == loc.offset;
 
-    char full_path[1024] = {0};
-    snprintf(full_path, sizeof(full_path) - 1, "%s/%s", CACHE_DIR, filename);
+    pthread_mutex_unlock(&shard->lock);
+    return live;
+}
 
-    // finding the node which has that url
-    while (tmp &&
-           tmp->url &&
-           (!urls_are_equivalent(tmp->url, filename)))
-        tmp = tmp->next;
+// points the key's entry at the copy the compactor made of its record
+static int relocate_segment_entry(void *arg, const char *key, SegmentLoc from, SegmentLoc to)
+{
+    CacheLRU *cache = (CacheLRU *)arg;
 
-    free(filename);
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
 
-    // if >2 hours are passed of the cache then cache shouldn't exist
-    // remove entry from the cache as new entry can cause duplication
-    if (tmp && time_passed_in_hours_for_file(full_path) > 2)
+    // replaced or evicted while the record was copied
+    CacheEntry *entry = shard_find(shard, hash, key);
+    int moved = entry && entry->location.segment == from.segment && entry->location.offset == from.offset;
+    if (moved)
     {
-        printf("cache invalidated for: %s\n", url);
-        lru_delete(cache, url);
-        return 0;
+        segment_release(cache->segments, from, entry->size);
+        segment_mark_live(cache->segments, to, entry->size);
+        entry->location = to;
+        entry->restored = 0;
+        journal_entry(cache, entry, MANIFEST_PUT);
     }
 
-    // return the node  if found or null
-    return tmp != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return moved;
 }
 
-void lru_touch(CacheLRU *cache, const char *url)
+// restores the previous run's entries, then keeps folding the journal into snapshots
+static void *manifest_thread_func(void *arg)
 {
-    CacheEntry *curr = cache->head;
-    char *filename = get_cache_filename(url);
-    while (curr)
+    CacheLRU *cache = (CacheLRU *)arg;
+    CacheManifest *manifest = &cache->manifest;
+
+    // whole directory is scanned only when the previous run left no manifest
+    if (!load_cache_manifest(restore_entry, cache))
+        for_each_cache_file(index_existing_file, cache);
+
+    atomic_store(&manifest->loading, 0);
+    printf("restored %lu cache entries\n", atomic_load(&proxy_stats.disk_objects));
+
+    // budget may have shrunk since the previous run
+    evict_over_budget(cache);
+
+    // writes cut short by a crash leave their temp files behind
+    size_t orphans = remove_orphan_temp_files(cache->started_at);
+    if (orphans)
+        printf("removed %zu orphaned temp files\n", orphans);
+
+    // live bytes of the segments are only known once every entry is back
+    if (!start_segment_compactor(cache->segments, segment_entry_is_live, relocate_segment_entry, cache))
+        printf("failed to start segment compactor\n");
+
+    while (1)
     {
-        if (strcmp(curr->url, filename) == 0)
+        snapshot_manifest(cache);
+
+        // wake up when the journal got long, or periodically so recency stays recent
+        pthread_mutex_lock(&manifest->lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_MANIFEST_SNAPSHOT_INTERVAL;
+
+        while (manifest->journal_records < CACHE_MANIFEST_MAX_JOURNAL)
         {
-            // Already at head
-            if (curr == cache->head)
-                return;
-
-            // Detach from current position
-            if (curr->prev)
-                curr->prev->next = curr->next;
-            if (curr->next)
-                curr->next->prev = curr->prev;
-
-            if (curr == cache->tail)
-                cache->tail = curr->prev;
-
-            // Move to head
-            curr->prev = NULL;
-            curr->next = cache->head;
-            if (cache->head)
-                cache->head->prev = curr;
-            cache->head = curr;
-            free(filename);
-            return;
+            int rc = pthread_cond_timedwait(&manifest->wake, &manifest->lock, &deadline);
+            if (rc != 0 && manifest->journal_records > 0)
+                break;
+            if (rc != 0)
+                deadline.tv_sec += CACHE_MANIFEST_SNAPSHOT_INTERVAL;
         }
-        curr = curr->next;
+
+        pthread_mutex_unlock(&manifest->lock);
     }
-    free(filename);
+
+    return NULL;
 }
 
-void lru_insert(CacheLRU *cache, const char *url, const char *data, size_t data_len, const char *content_type)
+CacheLRU *init_cache_lru(const CacheConfig *config)
 {
-    if (!cache || !url)
-        return;
+    CacheLRU *cache = (CacheLRU *)calloc(1, sizeof(CacheLRU));
+    if (!cache)
+        return NULL;
+
+    cache->policy = config->policy ? config->policy : &lru_policy;
+    cache->manifest.journal_fd = -1;
+    cache->started_at = time(NULL);
+    set_cache_fsync_policy(config->fsync_policy);
+    set_cache_compress_level(config->compress_level);
+
+    cache->mem_max_bytes = config->mem_max_bytes;
+    cache->disk_max_bytes = config->disk_max_bytes;
+    cache->max_object_bytes = config->max_object_bytes;
+    cache->stale_while_revalidate = config->stale_while_revalidate;
+    cache->stale_if_error = config->stale_if_error;
+    atomic_init(&cache->disk_bytes, 0);
+
+    cache->segments = open_segment_store(config->segment_max_object);
+    if (!cache->segments)
+    {
+        free(cache);
+        return NULL;
+    }
 
-    char *filename = get_cache_filename(url);
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->current_size = 0;
+        shard->mem_max_bytes = config->mem_max_bytes / CACHE_SHARD_COUNT;
+        shard->capacity = CACHE_INDEX_INITIAL_CAPACITY;
+        shard->slots = calloc(shard->capacity, sizeof(CacheSlot));
+        pthread_mutex_init(&shard->lock, NULL);
+
+        if (!shard->slots)
+        {
+            free_cache_lru(cache);
+            return NULL;
+        }
+    }
+
+    init_inflight_table(&cache->inflight);
 
-    // if url already in the list then skip
-    if (lru_contains(cache, filename))
+    // without a journal entries still get restored, just not persisted
+    if (!open_cache_manifest(&cache->manifest))
+        printf("cache manifest unavailable, changes won't survive a restart\n");
+
+    // restoring a large cache takes a while, requests are served meanwhile
+    atomic_store(&cache->manifest.loading, 1);
+    pthread_t manifest_thread;
+    if (pthread_create(&manifest_thread, NULL, manifest_thread_func, cache) != 0)
     {
-        lru_touch(cache, filename);
-        free(filename);
+        perror("pthread_create");
+        free_cache_lru(cache);
+        return NULL;
+    }
+    pthread_detach(manifest_thread);
+
+    // returning the head of final cache
+    return cache;
+}
+
+void free_cache_lru(CacheLRU *cache)
+{
+    if (!cache)
         return;
+
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        // every entry is indexed whichever queue it is in
+        for (size_t j = 0; shard->slots && j < shard->capacity; j++)
+        {
+            CacheEntry *curr = shard->slots[j].entry;
+            if (curr)
+                free_entry(curr);
+        }
+        free(shard->slots);
+        free(shard->ghosts);
+        pthread_mutex_destroy(&shard->lock);
     }
+    free_inflight_table(&cache->inflight);
+    close_cache_manifest(&cache->manifest);
+    free(cache);
+}
+
+// object of a write still queued for the key, counted as a memory hit when fresh
+static CacheObject *pending_get(CacheLRU *cache, const char *key, CacheMeta *meta)
+{
+    CacheObject *object = find_pending_write(cache->write_behind, key, meta);
+    if (object && is_cache_meta_fresh(meta, time(NULL)))
+        STATS_INC(mem_hits);
+
+    return object;
+}
 
-    // remove least recently used cache
-    if (cache->current_size >= cache->max_size)
-        lru_evict(cache);
+CacheObject *lru_get(CacheLRU *cache, const char *url, CacheMeta *meta, int read_disk)
+{
+    if (!cache || !url || url[0] == '\0')
+        return NULL;
+
+    char *key = get_cache_key(url);
+    if (!key)
+        return NULL;
 
-    // Step 1: Write to disk
-    if (data && content_type)
-        write_cache_file(filename, content_type, data, data_len);
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
 
-    // Step 2: Create new LRU entry
-    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    CacheEntry *entry = shard_find(shard, hash, key);
     if (!entry)
     {
-        printf("failed to add entry in list\n");
-        free(filename);
-        return;
+        pthread_mutex_unlock(&shard->lock);
+        CacheObject *pending = pending_get(cache, key, meta);
+        free(key);
+        return pending;
+    }
+
+    // only on disk, left untouched for a caller that may block on the read
+    if (!read_disk && !entry->object)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        return NULL;
+    }
+
+    shard_touch(cache, shard, entry);
+    entry_get_meta(entry, meta);
+    int is_fresh = is_cache_meta_fresh(meta, entry->last_access);
+    size_t size = entry->size;
+    SegmentLoc location = entry->location;
+    uint64_t version = entry->version;
+
+    // refetched response not on disk yet, it is newer than the stale entry
+    if (!is_fresh)
+    {
+        CacheMeta pending_meta;
+        CacheObject *pending = pending_get(cache, key, &pending_meta);
+        if (pending)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            *meta = pending_meta;
+            free(key);
+            return pending;
+        }
+    }
+
+    // hot object, served straight from memory
+    if (entry->object)
+    {
+        CacheObject *object = retain_cache_object(entry->object);
+        if (entry != shard->mem_head)
+        {
+            mem_unlink(shard, entry);
+            mem_link_head(shard, entry);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        if (is_fresh)
+            STATS_INC(mem_hits);
+        return object;
     }
 
-    entry->url = strdup(filename);
-    entry->prev = NULL;
-    entry->next = cache->head;
+    pthread_mutex_unlock(&shard->lock);
+
+    // reading from disk without holding the lock
+    // large objects never enter memory, they are sent straight from the file
+    CacheObject *object;
+    if (location.segment)
+        object = segment_read(cache->segments, location, size, url);
+    else
+        object = size > CACHE_MEM_MAX_OBJECT_SIZE ? open_cache_object(key, url) : read_cache_object(key, url);
+    if (!object)
+    {
+        // file vanished behind the index's back, or the record is unreadable,
+        // forget the entry unless compaction just moved it
+        time_t mtime;
+        if (location.segment || !stat_cache_file(key, &size, &mtime))
+        {
+            pthread_mutex_lock(&shard->lock);
+            entry = shard_find(shard, hash, key);
+            if (entry && entry->version == version && entry->location.segment == location.segment &&
+                entry->location.offset == location.offset)
+                shard_remove(cache, shard, entry);
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        free(key);
+        return NULL;
+    }
+    if (is_fresh)
+        STATS_INC(disk_hits);
+
+    // small objects are promoted, unless the entry went away or was rewritten
+    // while it was read, the body read then belongs to the previous version
+    if (object->fd < 0 && object->length <= CACHE_MEM_MAX_OBJECT_SIZE)
+    {
+        pthread_mutex_lock(&shard->lock);
+
+        entry = shard_find(shard, hash, key);
+        if (entry && entry->version == version)
+            mem_promote(shard, entry, object);
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    free(key);
+    return object;
+}
+
+uint64_t lru_insert(CacheLRU *cache, const char *url, const char *data, size_t data_len, const char *content_type, const CacheMeta *meta)
+{
+    if (!cache || !url)
+        return 0;
 
-    if (cache->head)
-        cache->head->prev = entry;
-    cache->head = entry;
+    char *key = get_cache_key(url);
+    if (!key)
+        return 0;
 
-    if (!cache->tail)
-        cache->tail = entry;
+    // write to disk, outside of the lock as it is slow
+    // small objects are appended to a segment, the rest and failed appends get their own file
+    SegmentLoc location;
+    size_t length;
+    uint64_t version = 0;
+    if (segment_accepts(cache->segments, data_len) &&
+        segment_append(cache->segments, url, 200, content_type, meta, data, data_len, &location, &length))
+    {
+        version = index_object(cache, key, length, location, 1, meta);
+        segment_unpin(cache->segments, location);
+    }
+    else if (write_cache_file(key, url, 200, content_type, meta, data, data_len))
+        version = index_cache_file(cache, key, 1, meta);
 
-    cache->current_size++;
-    free(filename);
+    free(key);
+    return version;
 }
 
-void lru_evict(CacheLRU *cache)
+void lru_refresh(CacheLRU *cache, const char *url, const CacheMeta *meta)
 {
-    if (!cache || !cache->tail)
+    char *key = get_cache_key(url);
+    if (!key)
         return;
 
-    CacheEntry *victim = cache->tail;
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
 
-    if (victim->prev)
-        victim->prev->next = NULL;
-    else
-        cache->head = NULL;
+    CacheEntry *entry = shard_find(shard, hash, key);
+    if (entry)
+    {
+        entry->restored = 0;
+        entry_set_meta(entry, meta);
+        journal_entry(cache, entry, MANIFEST_PUT);
+    }
 
-    cache->tail = victim->prev;
+    pthread_mutex_unlock(&shard->lock);
+    free(key);
+}
 
-    if (victim->url)
-        remove(victim->url);
+void lru_evict(CacheLRU *cache, CacheShard *shard)
+{
+    if (!shard)
+        return;
 
-    free(victim->url);
-    free(victim);
+    CacheEntry *victim = cache->policy->victim(shard);
+    if (!victim)
+        return;
 
-    cache->current_size--;
+    STATS_INC(evictions);
+    shard_remove(cache, shard, victim);
 }
 
 void lru_delete(CacheLRU *cache, const char *url)
 {
-    CacheEntry *curr = cache->head;
+    char *key = get_cache_key(url);
+    if (!key)
+        return;
 
-    char *filename = get_cache_filename(url);
+    // a queued write would bring it back
+    cancel_pending_write(cache->write_behind, key);
 
-    while (curr)
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *curr = shard_find(shard, hash, key);
+    if (curr)
+        shard_remove(cache, shard, curr);
+    else if (atomic_load(&cache->manifest.loading))
     {
-        if (strcmp(curr->url, filename) == 0)
-        {
-            // point the prev node's next to current's next
-            if (curr->prev)
-                curr->prev->next = curr->next;
-
-            // if here it means head this is
-            // move head to next
-            else
-                cache->head = curr->next;
-
-            // point current's next's prev to current's prev
-            if (curr->next)
-                curr->next->prev = curr->prev;
-
-            // if here it means tail this is
-            // move tail to prev
-            else
-                cache->tail = curr->prev;
-
-            // remove the corresponding file
-            if (curr->url)
-                remove(curr->url);
-
-            free(filename);
-            free(curr->url);
-            free(curr);
-            cache->current_size--;
-            return;
-        }
-        curr = curr->next;
+        // not restored yet, its file must not come back with the restore
+        ManifestEntry record = {.op = MANIFEST_DEL};
+        strncpy(record.key, key, CACHE_KEY_LEN);
+        manifest_append(&cache->manifest, &record);
+        remove_cache_file(key);
     }
 
-    free(filename);
+    pthread_mutex_unlock(&shard->lock);
+    free(key);
+}
+
+// removes the entry only if the stored version still matches, a newer write
+// of the url stays
+void lru_undo_insert(CacheLRU *cache, const char *url, uint64_t version)
+{
+    if (!version)
+        return;
+
+    char *key = get_cache_key(url);
+    if (!key)
+        return;
+
+    uint64_t hash = hash_string(key);
+    CacheShard *shard = get_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *curr = shard_find(shard, hash, key);
+    if (curr && curr->version == version)
+        shard_remove(cache, shard, curr);
+
+    pthread_mutex_unlock(&shard->lock);
+    free(key);
 }
 
 // print the cache list urls
 void print_cache_list(CacheLRU *cache)
 {
-    if (!cache || cache->current_size == 0)
+    if (!cache)
         return;
 
     printf("\ncurrent_list_scenario:\n");
-    CacheEntry *temp = cache->head;
-    while (temp)
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++)
     {
-        printf("%s\n", temp->url);
-        temp = temp->next;
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+
+        CacheEntry *queues[] = {shard->head, shard->small_head};
+        for (int q = 0; q < 2; q++)
+        {
+            CacheEntry *temp = queues[q];
+            while (temp)
+            {
+                printf("%s\n", temp->key);
+                temp = temp->next;
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
     }
     printf("\n");
-}
\ No newline at end of file
+}
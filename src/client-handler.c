@@ -1,63 +1,131 @@
+#define _GNU_SOURCE
 #include "../include/client-handler.h"
 
-void *handle_client(void *arg)
+ClientConn *create_client_conn(int fd, struct EventLoop *loop)
 {
-    ClientHandlerArgs *args = (ClientHandlerArgs *)arg;
+    ClientConn *conn = calloc(1, sizeof(ClientConn));
+    if (!conn)
+        return NULL;
+
+    conn->fd = fd;
+    conn->loop = loop;
+    conn->state = CLIENT_READING_REQUEST;
+    conn->file_fd = -1;
+    conn->file_slot = -1;
 
-    char *raw_request = NULL;
-    char *data = NULL;
-    HttpRequest *req = NULL;
-    HttpResponse *res = NULL;
+    // every wait on the client or the origin is bounded by the request's deadline
+    start_deadline(&conn->deadline);
+    conn->io_deadline = phase_deadline(&conn->deadline, PHASE_HEADER);
+    return conn;
+}
+
+void free_client_conn(ClientConn *conn)
+{
+    if (!conn)
+        return;
 
-    size_t raw_len = 0;
-    raw_request = recv_request(args->client_fd, &raw_len);
-    if (!raw_request)
+    if (conn->fd != -1)
+        close(conn->fd);
+    if (conn->res)
     {
-        printf("failed to receive request from client\n");
-        close(args->client_fd);
-        return NULL;
+        free_http_response(conn->res);
+        free(conn->res);
+    }
+    release_cache_object(conn->stale);
+    free(conn->request);
+    free(conn->url);
+    free(conn->data);
+    free(conn->chunk);
+    free(conn);
+}
+
+void respond_error(ClientConn *conn, int error_code)
+{
+    int len = format_error_response(conn->head, sizeof(conn->head), error_code);
+    if (len < 0)
+    {
+        conn->state = CLIENT_CLOSING;
+        return;
+    }
+
+    conn->head_len = len;
+    conn->head_sent = 0;
+    conn->body_len = 0;
+    conn->state = CLIENT_WRITING_RESPONSE;
+}
+
+// queues a 200 with the body, taken from memory or from file_fd when it is >= 0
+static void respond_body(ClientConn *conn, const char *body, int file_fd, off_t file_offset, size_t body_len,
+                         const char *content_type)
+{
+    int len = format_response_headers(conn->head, sizeof(conn->head), body_len, content_type);
+    if (len < 0 || (size_t)len >= sizeof(conn->head) - 1)
+    {
+        respond_error(conn, INTRSERVERR);
+        return;
     }
 
-    req = parse_http_request(raw_request, raw_len);
+    conn->head_len = len;
+    conn->head_sent = 0;
+    conn->body = body;
+    conn->file_fd = file_fd;
+    conn->file_offset = file_offset;
+    conn->body_len = body_len;
+    conn->body_sent = 0;
+    conn->state = CLIENT_WRITING_RESPONSE;
+}
+
+// queues a response of the cache or the origin, large cached bodies go from their file
+static void respond_response(ClientConn *conn, HttpResponse *res)
+{
+    conn->res = res;
+    if (res->object && res->object->fd >= 0)
+        respond_body(conn, NULL, res->object->fd, res->object->offset, res->bodyLength, res->contentType);
+    else
+        respond_body(conn, res->body, -1, 0, res->bodyLength, res->contentType);
+}
+
+// queues a page read or rendered by the proxy itself, taking data
+static void respond_data(ClientConn *conn, char *data, size_t data_size, const char *content_type)
+{
+    if (!data)
+    {
+        respond_error(conn, INTRSERVERR);
+        return;
+    }
+
+    conn->data = data;
+    respond_body(conn, data, -1, 0, data_size, content_type);
+}
+
+void handle_request(ClientConn *conn, const char *raw_request, size_t raw_len, SharedContext *ctx)
+{
+    conn->state = CLIENT_LOOKING_UP;
+
+    HttpRequest *req = parse_http_request(raw_request, raw_len);
     if (!req)
     {
         printf("request parsing failed\n");
-        handle_sending_error(args->client_fd, BADCLNTREQ);
-        goto cleanup;
+        respond_error(conn, BADCLNTREQ);
+        return;
     }
 
     // Dispatch based on path:
+    size_t data_size = 0;
     if (req->query == NULL && strcmp(req->path, "/") == 0)
     {
-        size_t data_size = 0;
-        data = read_file("static/search.html", &data_size);
-        if (!data)
-        {
-            handle_sending_error(args->client_fd, INTRSERVERR);
-            goto cleanup;
-        }
-
-        if (send_http_response(args->client_fd, data, data_size, "text/html") <= 0)
-        {
-            printf("failed to send response to client\n");
-            goto cleanup;
-        }
+        char *data = read_file("static/search.html", &data_size);
+        respond_data(conn, data, data_size, "text/html");
     }
     else if (strcmp(req->path, "/favicon.ico") == 0)
     {
-        size_t data_size = 0;
-        data = read_file("static/favicon.ico", &data_size);
-        if (!data)
-        {
-            handle_sending_error(args->client_fd, INTRSERVERR);
-            goto cleanup;
-        }
-
-        if (send_http_response(args->client_fd, data, data_size, "image/x-icon") <= 0)
-        {
-            printf("failed to send response to client\n");
-            goto cleanup;
-        }
+        char *data = read_file("static/favicon.ico", &data_size);
+        respond_data(conn, data, data_size, "image/x-icon");
+    }
+    else if (strcmp(req->path, "/stats") == 0)
+    {
+        char *data = render_stats(&data_size);
+        respond_data(conn, data, data_size, "text/plain");
     }
     else if (req->query)
     {
@@ -65,49 +133,132 @@ void *handle_client(void *arg)
         parse_url(req->query, &parsed_url);
 
         // close the connection if the site is blocked
-        if (is_site_blocked(args->blocked_sites, args->n_of_b_sites, parsed_url.host))
+        if (is_site_blocked(ctx->blocked_sites, ctx->n_of_b_sites, parsed_url.host))
         {
             printf("closing connection as blocked site is requested\n");
-            handle_sending_error(args->client_fd, BLCKDSITEERR);
-            goto cleanup;
+            respond_error(conn, BLCKDSITEERR);
+        }
+        else
+        {
+            // memory hits are answered right here, anything needing the disk
+            // or the origin goes to a worker so the loop never blocks
+            STATS_INC(requests);
+            HttpResponse *res = lookup_cache(ctx->cache, req->query, &conn->stale, &conn->meta, 0);
+            if (res)
+                respond_response(conn, res);
+            else if ((conn->url = strdup(req->query)))
+                conn->state = CLIENT_FETCHING;
+            else
+                respond_error(conn, INTRSERVERR);
         }
+    }
+    else
+    {
+        conn->state = CLIENT_CLOSING;
+    }
+
+    free_http_request(req);
+    free(req);
+}
 
-        // locking so that no other thread should alter the cache this time
-        pthread_mutex_lock(args->cache_lock);
-        res = fetch_cache_or_url(args->cache, req->query, MAX_REDIRECTS_ALLOWED);
-        pthread_mutex_unlock(args->cache_lock);
+void client_received(ClientConn *conn, const char *data, size_t len, SharedContext *ctx)
+{
+    // client stopped sending mid head, whatever came is all there is
+    if (!len)
+    {
+        if (conn->request_len)
+            handle_request(conn, conn->request, conn->request_len, ctx);
+        else
+            conn->state = CLIENT_CLOSING;
+        return;
+    }
 
-        // if no response then close connection
-        if (!res){
-            handle_sending_error(args->client_fd,SERVRESFAIL);
-            goto cleanup;
-        }
+    // whole head in one read, parsed straight from the loop's buffer
+    if (!conn->request && memmem(data, len, "\r\n\r\n", 4))
+    {
+        handle_request(conn, data, len, ctx);
+        return;
+    }
+
+    if (conn->request_len + len > CLIENT_MAX_REQUEST_SIZE)
+    {
+        printf("request head too large\n");
+        respond_error(conn, BADCLNTREQ);
+        return;
+    }
 
-        // send response back to client
-        if (send_http_response(args->client_fd, res->body, res->bodyLength, res->contentType) <= 0)
+    char *request = realloc(conn->request, conn->request_len + len + 1);
+    if (!request)
+    {
+        conn->state = CLIENT_CLOSING;
+        return;
+    }
+
+    // the blank line may straddle the previous read
+    size_t search_from = conn->request_len > 3 ? conn->request_len - 3 : 0;
+    memcpy(request + conn->request_len, data, len);
+    conn->request = request;
+    conn->request_len += len;
+    conn->request[conn->request_len] = '\0';
+
+    if (memmem(conn->request + search_from, conn->request_len - search_from, "\r\n\r\n", 4))
+        handle_request(conn, conn->request, conn->request_len, ctx);
+}
+
+int is_client_late(const ClientConn *conn, long now)
+{
+    return (conn->io_deadline && now >= conn->io_deadline) ||
+           (conn->deadline.end_ms && now >= conn->deadline.end_ms);
+}
+
+void client_timed_out(ClientConn *conn)
+{
+    if (conn->state == CLIENT_READING_REQUEST)
+    {
+        printf("failed to receive request from client\n");
+        conn->deadline.expired = 1;
+        respond_error(conn, CLNTTIMEOUT);
+        return;
+    }
+
+    printf("timed out sending response to client\n");
+    conn->state = CLIENT_CLOSING;
+}
+
+void handle_client_miss(ClientConn *conn, SharedContext *ctx)
+{
+    // the loop only looked in memory, the copy may still be on disk
+    if (!conn->stale)
+    {
+        HttpResponse *res = lookup_cache(ctx->cache, conn->url, &conn->stale, &conn->meta, 1);
+        if (res)
         {
-            printf("failed to respond data to client\n");
-            goto cleanup;
+            respond_response(conn, res);
+            return;
         }
     }
 
-    goto cleanup;
+    // cache does its own fine grained locking, remote fetches run in parallel
+    CacheObject *stale = conn->stale;
+    conn->stale = NULL;
+    HttpResponse *res = fetch_cache_miss(ctx->cache, conn->url, MAX_REDIRECTS_ALLOWED, stale, &conn->meta, conn->fd,
+                                         &conn->deadline);
 
-cleanup:
-    if (req)
+    // if no response then tell the client why
+    if (!res)
     {
-        free_http_request(req);
-        free(req);
+        respond_error(conn, conn->deadline.expired ? SERVTIMEOUT : SERVRESFAIL);
+        return;
     }
-    if (res)
+
+    // body already went out while it was received
+    if (res->relayed)
     {
         free_http_response(res);
         free(res);
+        conn->state = CLIENT_CLOSING;
+        return;
     }
-    if (raw_request)
-        free(raw_request);
-    if (args->client_fd != -1)
-        close(args->client_fd);
 
-    return NULL;
+    respond_response(conn, res);
 }
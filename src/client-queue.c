@@ -8,10 +8,10 @@ void init_client_queue(ClientQueue *q)
 }
 
 // add client to queue by locking the queue
-void enqueue_client(ClientQueue *q, int client_sock)
+void enqueue_client(ClientQueue *q, struct ClientConn *conn)
 {
     ClientQueueNode *node = malloc(sizeof(ClientQueueNode));
-    node->client_sock = client_sock;
+    node->conn = conn;
     node->next = NULL;
 
     pthread_mutex_lock(&q->lock);
@@ -29,20 +29,20 @@ void enqueue_client(ClientQueue *q, int client_sock)
 }
 
 // remove client from queue, No LOCKS used
-int dequeue_client(ClientQueue *q)
+struct ClientConn *dequeue_client(ClientQueue *q)
 {
     if (is_queue_empty(q))
-        return -1;
+        return NULL;
 
     ClientQueueNode *node = q->front;
-    int client_sock = node->client_sock;
+    struct ClientConn *conn = node->conn;
 
     q->front = node->next;
     if (q->front == NULL)
         q->rear = NULL;
 
     free(node);
-    return client_sock;
+    return conn;
 }
 
 // check whether given queue is empty or not
@@ -0,0 +1,109 @@
+#include "../include/deadline.h"
+
+// set once at startup
+static TimeoutConfig timeouts;
+
+void set_timeouts(const TimeoutConfig *config)
+{
+    timeouts = *config;
+}
+
+long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void start_deadline(Deadline *deadline)
+{
+    deadline->end_ms = timeouts.total_ms ? monotonic_ms() + timeouts.total_ms : 0;
+    deadline->expired = 0;
+}
+
+long phase_deadline(const Deadline *deadline, RequestPhase phase)
+{
+    long budget = 0;
+    switch (phase)
+    {
+    case PHASE_CONNECT:
+        budget = timeouts.connect_ms;
+        break;
+    case PHASE_TLS:
+        budget = timeouts.tls_ms;
+        break;
+    case PHASE_HEADER:
+        budget = timeouts.header_ms;
+        break;
+    case PHASE_BODY:
+        budget = timeouts.body_ms;
+        break;
+    case PHASE_WRITE:
+        budget = timeouts.write_ms;
+        break;
+    }
+
+    long until = budget ? monotonic_ms() + budget : 0;
+    long end = deadline ? deadline->end_ms : 0;
+    if (!until || (end && end < until))
+        return end;
+    return until;
+}
+
+int wait_fd(Deadline *deadline, int fd, short events, long until)
+{
+    struct pollfd pfd = {.fd = fd, .events = events};
+
+    while (1)
+    {
+        int timeout = -1;
+        if (until)
+        {
+            long left = until - monotonic_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        int ready = poll(&pfd, 1, timeout);
+        if (ready > 0)
+            return 1;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return -1;
+
+        if (deadline)
+            deadline->expired = 1;
+        errno = ETIMEDOUT;
+        return 0;
+    }
+}
+
+int wait_cond(Deadline *deadline, pthread_cond_t *cond, pthread_mutex_t *lock, long until)
+{
+    if (!until)
+    {
+        pthread_cond_wait(cond, lock);
+        return 1;
+    }
+
+    long left = until - monotonic_ms();
+    struct timespec abstime;
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    if (left > 0)
+    {
+        abstime.tv_sec += left / 1000;
+        abstime.tv_nsec += (left % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
+        {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    if (left > 0 && pthread_cond_timedwait(cond, lock, &abstime) != ETIMEDOUT)
+        return 1;
+
+    if (deadline)
+        deadline->expired = 1;
+    return 0;
+}
@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+#include "../include/dns-resolver.h"
+#include <ctype.h>
+#include <errno.h>
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_NAME 253
+#define DNS_MAX_PACKET 1500
+
+// once one family answered, the other gets this much longer before it's given up on
+#define DNS_RESOLUTION_DELAY_MS 50
+
+// outcome of resolving a name
+enum
+{
+    DNS_FOUND,
+    DNS_NOT_FOUND,
+    DNS_FAILED,
+};
+
+// addresses of a name and how long they can be kept
+typedef struct
+{
+    DnsAddress addrs[DNS_MAX_ADDRS];
+    int n_addrs;
+    time_t ttl;
+} DnsResult;
+
+// the answer to the A or the AAAA query
+typedef struct
+{
+    int answered;
+    int rcode;
+    DnsAddress addrs[DNS_MAX_ADDRS];
+    int n_addrs;
+    uint32_t ttl;     // lowest of the records leading to the addresses
+    uint32_t soa_ttl; // how long the name is known not to exist, 0 without a soa record
+} DnsAnswer;
+
+static DnsShard shards[DNS_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+// set once at startup, no server means getaddrinfo resolves every name
+static struct sockaddr_storage server_addr;
+static socklen_t server_len = 0;
+static time_t ttl_min = DNS_FALLBACK_TTL;
+static time_t ttl_max = DNS_FALLBACK_TTL;
+static time_t negative_ttl = 0;
+
+static void init_shards(void)
+{
+    for (int i = 0; i < DNS_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].resolved, NULL);
+    }
+}
+
+// parses "ip", "ip:port" or "[ipv6]:port", port 53 when missing
+static int parse_server(const char *value, struct sockaddr_storage *addr, socklen_t *len)
+{
+    char host[INET6_ADDRSTRLEN + 2];
+    const char *port = "53";
+    const char *colon = strrchr(value, ':');
+
+    if (value[0] == '[')
+    {
+        const char *end = strchr(value, ']');
+        if (!end || (size_t)(end - value - 1) >= sizeof(host))
+            return 0;
+        memcpy(host, value + 1, end - value - 1);
+        host[end - value - 1] = '\0';
+        if (end[1] == ':')
+            port = end + 2;
+    }
+    else if (colon && colon == strchr(value, ':'))
+    {
+        // a single colon separates the port, more make it an ipv6 address
+        if ((size_t)(colon - value) >= sizeof(host))
+            return 0;
+        memcpy(host, value, colon - value);
+        host[colon - value] = '\0';
+        port = colon + 1;
+    }
+    else
+    {
+        if (strlen(value) >= sizeof(host))
+            return 0;
+        strcpy(host, value);
+    }
+
+    struct addrinfo hints = {.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return 0;
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 1;
+}
+
+// first nameserver of /etc/resolv.conf
+static int read_resolv_conf(struct sockaddr_storage *addr, socklen_t *len)
+{
+    FILE *file = fopen("/etc/resolv.conf", "r");
+    if (!file)
+        return 0;
+
+    char line[256];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), file))
+    {
+        char server[64];
+        if (sscanf(line, " nameserver %63s", server) == 1)
+        {
+            // a scoped link local address isn't worth supporting here
+            if (!strchr(server, '%') && strchr(server, ':'))
+            {
+                char bracketed[sizeof(server) + 2];
+                snprintf(bracketed, sizeof(bracketed), "[%s]", server);
+                found = parse_server(bracketed, addr, len);
+            }
+            else if (!strchr(server, '%'))
+                found = parse_server(server, addr, len);
+        }
+    }
+
+    fclose(file);
+    return found;
+}
+
+void init_dns_resolver(const char *server, time_t min, time_t max, time_t negative)
+{
+    pthread_once(&shards_once, init_shards);
+
+    ttl_min = min;
+    ttl_max = max > min ? max : min;
+    negative_ttl = negative;
+
+    if (server && *server)
+    {
+        if (!parse_server(server, &server_addr, &server_len))
+            fprintf(stderr, "invalid dns server: %s\n", server);
+    }
+    else if (!read_resolv_conf(&server_addr, &server_len))
+        fprintf(stderr, "no nameserver in /etc/resolv.conf, using getaddrinfo\n");
+}
+
+static time_t clamp_ttl(time_t ttl)
+{
+    if (ttl < ttl_min)
+        return ttl_min;
+    return ttl > ttl_max ? ttl_max : ttl;
+}
+
+// how long a name that doesn't exist is remembered, soa_ttl is 0 without a soa
+// record, 0 when negative caching is off
+static time_t clamp_negative_ttl(uint32_t soa_ttl)
+{
+    if (!negative_ttl)
+        return 0;
+
+    time_t ttl = soa_ttl && soa_ttl < negative_ttl ? soa_ttl : negative_ttl;
+    return ttl < ttl_min ? ttl_min : ttl;
+}
+
+static uint16_t read_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void write_u16(unsigned char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+}
+
+// encodes the name as dns labels, returns the length or -1 when it isn't a valid name
+static int encode_name(const char *name, unsigned char *out, size_t size)
+{
+    size_t pos = 0;
+    const char *label = name;
+
+    while (*label)
+    {
+        size_t len = strcspn(label, ".");
+        if (len == 0 || len > 63 || pos + len + 2 > size)
+            return -1;
+
+        out[pos++] = len;
+        memcpy(out + pos, label, len);
+        pos += len;
+        label += len;
+        if (*label == '.')
+            label++;
+    }
+
+    out[pos++] = 0;
+    return pos;
+}
+
+static int build_query(unsigned char *buf, uint16_t id, const unsigned char *qname, int qname_len, int qtype)
+{
+    memset(buf, 0, DNS_HEADER_SIZE);
+    write_u16(buf, id);
+    write_u16(buf + 2, 0x0100); // recursion desired
+    write_u16(buf + 4, 1);      // one question
+
+    memcpy(buf + DNS_HEADER_SIZE, qname, qname_len);
+    write_u16(buf + DNS_HEADER_SIZE + qname_len, qtype);
+    write_u16(buf + DNS_HEADER_SIZE + qname_len + 2, DNS_CLASS_IN);
+    return DNS_HEADER_SIZE + qname_len + 4;
+}
+
+// offset after the possibly compressed name at off, -1 when it runs past the packet
+static int skip_name(const unsigned char *buf, size_t len, size_t off)
+{
+    while (off < len)
+    {
+        unsigned char c = buf[off];
+        if (c == 0)
+            return off + 1;
+        if ((c & 0xc0) == 0xc0)
+            return off + 2 <= len ? (int)off + 2 : -1;
+        if (c & 0xc0)
+            return -1;
+        off += c + 1;
+    }
+    return -1;
+}
+
+// whether the question echoes the name asked, the server may have changed its case
+static int same_qname(const unsigned char *a, const unsigned char *b, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        if (tolower(a[i]) != tolower(b[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// parses buf as the answer to the query, 0 when it answers something else
+static int parse_answer(const unsigned char *buf, size_t len, uint16_t id, int qtype,
+                        const unsigned char *qname, int qname_len, DnsAnswer *answer)
+{
+    if (len < DNS_HEADER_SIZE || read_u16(buf) != id)
+        return 0;
+
+    uint16_t flags = read_u16(buf + 2);
+    if (!(flags & 0x8000) || (flags & 0x7800)) // a response to a standard query
+        return 0;
+
+    int qdcount = read_u16(buf + 4), ancount = read_u16(buf + 6), nscount = read_u16(buf + 8);
+    size_t off = DNS_HEADER_SIZE;
+    if (qdcount != 1 || off + qname_len + 4 > len || !same_qname(buf + off, qname, qname_len) ||
+        read_u16(buf + off + qname_len) != qtype || read_u16(buf + off + qname_len + 2) != DNS_CLASS_IN)
+        return 0;
+    off += qname_len + 4;
+
+    answer->answered = 1;
+    answer->rcode = flags & 0x000f;
+    answer->ttl = UINT32_MAX;
+
+    // truncated, getaddrinfo retries it over tcp
+    if (flags & 0x0200)
+    {
+        answer->rcode = DNS_RCODE_SERVFAIL;
+        return 1;
+    }
+
+    int addr_len = qtype == DNS_TYPE_A ? 4 : 16;
+    for (int i = 0; i < ancount + nscount; i++)
+    {
+        int next = skip_name(buf, len, off);
+        if (next < 0 || (size_t)next + 10 > len)
+            break;
+        off = next;
+
+        int type = read_u16(buf + off), class = read_u16(buf + off + 2);
+        uint32_t ttl = read_u32(buf + off + 4);
+        size_t rdlen = read_u16(buf + off + 8);
+        const unsigned char *rdata = buf + off + 10;
+        if (off + 10 + rdlen > len)
+            break;
+        off += 10 + rdlen;
+
+        if (class != DNS_CLASS_IN)
+            continue;
+
+        if (i < ancount)
+        {
+            // cnames leading to the addresses expire with them
+            if (ttl < answer->ttl)
+                answer->ttl = ttl;
+
+            if (type != qtype || (int)rdlen != addr_len || answer->n_addrs == DNS_MAX_ADDRS)
+                continue;
+
+            DnsAddress *address = &answer->addrs[answer->n_addrs++];
+            memset(address, 0, sizeof(*address));
+            if (qtype == DNS_TYPE_A)
+            {
+                struct sockaddr_in *sin = (struct sockaddr_in *)&address->addr;
+                sin->sin_family = AF_INET;
+                memcpy(&sin->sin_addr, rdata, 4);
+                address->len = sizeof(*sin);
+            }
+            else
+            {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&address->addr;
+                sin6->sin6_family = AF_INET6;
+                memcpy(&sin6->sin6_addr, rdata, 16);
+                address->len = sizeof(*sin6);
+            }
+        }
+        else if (type == DNS_TYPE_SOA && rdlen >= 20)
+        {
+            // negative answers are kept for the lower of the soa ttl and its minimum field
+            uint32_t minimum = read_u32(rdata + rdlen - 4);
+            answer->soa_ttl = ttl < minimum ? ttl : minimum;
+        }
+    }
+
+    return 1;
+}
+
+// sends the A and AAAA queries and waits for both answers till until (0 for
+// no limit), resending those still missing on each attempt
+static void exchange_queries(const char *name, DnsAnswer answers[2], long until)
+{
+    static const int qtypes[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+    unsigned char qname[DNS_MAX_NAME + 2];
+    unsigned char queries[2][DNS_HEADER_SIZE + sizeof(qname) + 4];
+    int query_len[2];
+    uint16_t ids[2];
+
+    int qname_len = encode_name(name, qname, sizeof(qname));
+    if (qname_len < 0)
+        return;
+
+    // unpredictable ids so a spoofed answer has to guess them
+    if (getrandom(ids, sizeof(ids), 0) != sizeof(ids))
+    {
+        ids[0] = (uint16_t)(monotonic_ms() ^ (uintptr_t)pthread_self());
+        ids[1] = ids[0] ^ 0x5a5a;
+    }
+    for (int q = 0; q < 2; q++)
+        query_len[q] = build_query(queries[q], ids[q], qname, qname_len, qtypes[q]);
+
+    // connected so only the server's datagrams are received
+    int fd = socket(server_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return;
+    if (connect(fd, (struct sockaddr *)&server_addr, server_len) == -1)
+        goto cleanup;
+
+    int done = 0;
+    for (int attempt = 0; attempt < DNS_QUERY_ATTEMPTS && !done && (!until || monotonic_ms() < until); attempt++)
+    {
+        for (int q = 0; q < 2; q++)
+        {
+            if (answers[q].answered)
+                continue;
+            // refused by icmp, nothing listens there
+            if (send(fd, queries[q], query_len[q], 0) != query_len[q])
+                goto cleanup;
+            STATS_INC(dns_queries);
+        }
+
+        // an attempt never waits past what's left of the request's budget
+        long deadline = monotonic_ms() + DNS_QUERY_TIMEOUT_MS;
+        if (until && until < deadline)
+            deadline = until;
+        while (!(answers[0].answered && answers[1].answered))
+        {
+            long remaining = deadline - monotonic_ms();
+            if (remaining <= 0)
+                break;
+
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            int ready = poll(&pfd, 1, remaining);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                break;
+
+            unsigned char buf[DNS_MAX_PACKET];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0)
+            {
+                if (errno != EAGAIN && errno != EINTR)
+                    goto cleanup;
+                continue;
+            }
+
+            for (int q = 0; q < 2; q++)
+            {
+                if (!answers[q].answered &&
+                    parse_answer(buf, n, ids[q], qtypes[q], qname, qname_len, &answers[q]))
+                {
+                    // the other family isn't waited on for long once there's something to connect to
+                    if (answers[q].n_addrs)
+                    {
+                        done = 1;
+                        if (deadline - monotonic_ms() > DNS_RESOLUTION_DELAY_MS)
+                            deadline = monotonic_ms() + DNS_RESOLUTION_DELAY_MS;
+                    }
+                    break;
+                }
+            }
+        }
+
+        done |= answers[0].answered && answers[1].answered;
+    }
+
+cleanup:
+    close(fd);
+}
+
+static int query_dns(const char *name, DnsResult *result, long until)
+{
+    DnsAnswer answers[2];
+    memset(answers, 0, sizeof(answers));
+    exchange_queries(name, answers, until);
+
+    uint32_t ttl = UINT32_MAX;
+    for (int q = 0; q < 2; q++)
+    {
+        if (!answers[q].answered || answers[q].rcode != DNS_RCODE_NOERROR)
+            continue;
+
+        for (int i = 0; i < answers[q].n_addrs && result->n_addrs < DNS_MAX_ADDRS; i++)
+            result->addrs[result->n_addrs++] = answers[q].addrs[i];
+        if (answers[q].n_addrs && answers[q].ttl < ttl)
+            ttl = answers[q].ttl;
+    }
+
+    if (result->n_addrs)
+    {
+        result->ttl = clamp_ttl(ttl);
+        return DNS_FOUND;
+    }
+
+    // the name doesn't exist, or exists without addresses of either family
+    int nxdomain = answers[0].rcode == DNS_RCODE_NXDOMAIN || answers[1].rcode == DNS_RCODE_NXDOMAIN;
+    int nodata = answers[0].answered && answers[1].answered &&
+                 answers[0].rcode == DNS_RCODE_NOERROR && answers[1].rcode == DNS_RCODE_NOERROR;
+    if ((answers[0].answered || answers[1].answered) && (nxdomain || nodata))
+    {
+        uint32_t soa_ttl = answers[0].soa_ttl > answers[1].soa_ttl ? answers[0].soa_ttl : answers[1].soa_ttl;
+        result->ttl = clamp_negative_ttl(soa_ttl);
+        return DNS_NOT_FOUND;
+    }
+
+    return DNS_FAILED;
+}
+
+// asks the system resolver, which also knows /etc/hosts and search domains
+static int query_getaddrinfo(const char *name, int flags, DnsResult *result)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = flags};
+    struct addrinfo *res;
+
+    int err = getaddrinfo(name, NULL, &hints, &res);
+    if (err == EAI_NONAME || err == EAI_NODATA)
+    {
+        result->ttl = clamp_negative_ttl(0);
+        return DNS_NOT_FOUND;
+    }
+    if (err != 0)
+        return DNS_FAILED;
+
+    // ipv4 first, like the dns answers
+    for (int family = 0; family < 2; family++)
+    {
+        for (struct addrinfo *p = res; p && result->n_addrs < DNS_MAX_ADDRS; p = p->ai_next)
+        {
+            if (p->ai_family != (family ? AF_INET6 : AF_INET) || p->ai_addrlen > sizeof(struct sockaddr_storage))
+                continue;
+
+            DnsAddress *address = &result->addrs[result->n_addrs++];
+            memset(address, 0, sizeof(*address));
+            memcpy(&address->addr, p->ai_addr, p->ai_addrlen);
+            address->len = p->ai_addrlen;
+        }
+    }
+
+    freeaddrinfo(res);
+    result->ttl = clamp_ttl(DNS_FALLBACK_TTL);
+    return result->n_addrs ? DNS_FOUND : DNS_NOT_FOUND;
+}
+
+static int resolve_name(const char *name, DnsResult *result, Deadline *deadline, long until)
+{
+    // single labels go through the search domains of the system resolver
+    int outcome = DNS_FAILED;
+    time_t dns_ttl = 0;
+    if (server_len && strchr(name, '.'))
+    {
+        outcome = query_dns(name, result, until);
+        if (outcome == DNS_FOUND)
+            return outcome;
+        dns_ttl = result->ttl;
+        memset(result, 0, sizeof(*result));
+    }
+
+    // getaddrinfo can't be bounded, once the budget is spent the request fails instead
+    if (until && monotonic_ms() >= until)
+    {
+        if (deadline)
+            deadline->expired = 1;
+        return DNS_FAILED;
+    }
+
+    // a name missing from dns may still be in /etc/hosts
+    STATS_INC(dns_fallbacks);
+    int fallback = query_getaddrinfo(name, 0, result);
+    if (fallback != DNS_FOUND && outcome == DNS_NOT_FOUND)
+    {
+        result->ttl = dns_ttl;
+        return DNS_NOT_FOUND;
+    }
+    return fallback;
+}
+
+// caller must hold the shard lock
+static DnsEntry *find_entry(DnsShard *shard, size_t bucket, const char *name)
+{
+    for (DnsEntry *entry = shard->buckets[bucket]; entry; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// drops the expired entries, or the one expiring first when none is,
+// caller must hold the shard lock
+static void evict_entries(DnsShard *shard)
+{
+    time_t now = time(NULL);
+    DnsEntry *oldest = NULL;
+
+    for (int pass = 0; pass < 2 && shard->n_entries >= DNS_SHARD_MAX_ENTRIES; pass++)
+    {
+        for (int i = 0; i < DNS_SHARD_BUCKETS; i++)
+        {
+            DnsEntry **ep = &shard->buckets[i];
+            while (*ep)
+            {
+                DnsEntry *entry = *ep;
+                if (!entry->resolving && (entry->expires_at <= now || entry == oldest))
+                {
+                    *ep = entry->next;
+                    free(entry->name);
+                    free(entry);
+                    shard->n_entries--;
+                    continue;
+                }
+                if (!pass && !entry->resolving && (!oldest || entry->expires_at < oldest->expires_at))
+                    oldest = entry;
+                ep = &entry->next;
+            }
+        }
+    }
+}
+
+// caller must hold the shard lock
+static DnsEntry *add_entry(DnsShard *shard, size_t bucket, const char *name)
+{
+    if (shard->n_entries >= DNS_SHARD_MAX_ENTRIES)
+        evict_entries(shard);
+
+    DnsEntry *entry = calloc(1, sizeof(DnsEntry));
+    if (!entry || !(entry->name = strdup(name)))
+    {
+        free(entry);
+        return NULL;
+    }
+
+    entry->next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    shard->n_entries++;
+    return entry;
+}
+
+// resolves through the cache, a name being resolved by another thread is
+// waited for till until
+static int lookup_name(const char *name, DnsResult *result, Deadline *deadline, long until)
+{
+    uint64_t hash = hash_string(name);
+    DnsShard *shard = &shards[hash & (DNS_CACHE_SHARDS - 1)];
+    size_t bucket = (hash / DNS_CACHE_SHARDS) % DNS_SHARD_BUCKETS;
+    int waited = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    DnsEntry *entry = find_entry(shard, bucket, name);
+    while (entry && entry->resolving)
+    {
+        waited = 1;
+        if (!wait_cond(deadline, &shard->resolved, &shard->lock, until))
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return DNS_FAILED;
+        }
+        entry = find_entry(shard, bucket, name);
+    }
+
+    // a waiter takes whatever the resolution it waited for came to, even a failure
+    if (entry && (waited || time(NULL) < entry->expires_at))
+    {
+        memcpy(result->addrs, entry->addrs, entry->n_addrs * sizeof(DnsAddress));
+        result->n_addrs = entry->n_addrs;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (waited)
+            STATS_INC(dns_coalesced);
+        else
+            STATS_INC(dns_cache_hits);
+        return result->n_addrs ? DNS_FOUND : DNS_NOT_FOUND;
+    }
+
+    if (!entry)
+        entry = add_entry(shard, bucket, name);
+    if (entry)
+        entry->resolving = 1;
+    pthread_mutex_unlock(&shard->lock);
+
+    int outcome = resolve_name(name, result, deadline, until);
+    if (!entry)
+        return outcome;
+
+    pthread_mutex_lock(&shard->lock);
+    time_t now = time(NULL);
+    if (outcome == DNS_FAILED)
+    {
+        // the last known addresses stay in use until the server answers again
+        STATS_INC(dns_failures);
+        memcpy(result->addrs, entry->addrs, entry->n_addrs * sizeof(DnsAddress));
+        result->n_addrs = entry->n_addrs;
+        entry->expires_at = entry->n_addrs ? now + ttl_min : now;
+        if (entry->n_addrs)
+            outcome = DNS_FOUND;
+    }
+    else
+    {
+        memcpy(entry->addrs, result->addrs, result->n_addrs * sizeof(DnsAddress));
+        entry->n_addrs = result->n_addrs;
+        entry->expires_at = now + result->ttl;
+    }
+    entry->resolving = 0;
+    pthread_cond_broadcast(&shard->resolved);
+    pthread_mutex_unlock(&shard->lock);
+
+    return outcome;
+}
+
+int resolve_host(const char *host, const char *port, DnsAddress *out, int max, Deadline *deadline, long until)
+{
+    pthread_once(&shards_once, init_shards);
+    STATS_INC(dns_lookups);
+
+    size_t len = strlen(host);
+    if (len == 0 || len > DNS_MAX_NAME + 1)
+        return 0;
+
+    // names are case insensitive, a trailing dot is the same name
+    char name[DNS_MAX_NAME + 2];
+    for (size_t i = 0; i <= len; i++)
+        name[i] = tolower((unsigned char)host[i]);
+    if (name[len - 1] == '.' && len > 1)
+        name[len - 1] = '\0';
+
+    DnsResult result;
+    memset(&result, 0, sizeof(result));
+
+    // literal addresses aren't worth a cache entry
+    struct in6_addr literal;
+    if (inet_pton(AF_INET, name, &literal) == 1 || inet_pton(AF_INET6, name, &literal) == 1)
+        query_getaddrinfo(name, AI_NUMERICHOST, &result);
+    else
+        lookup_name(name, &result, deadline, until);
+
+    uint16_t port_n = htons((uint16_t)atoi(port));
+    int n = result.n_addrs < max ? result.n_addrs : max;
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = result.addrs[i];
+        if (out[i].addr.ss_family == AF_INET)
+            ((struct sockaddr_in *)&out[i].addr)->sin_port = port_n;
+        else
+            ((struct sockaddr_in6 *)&out[i].addr)->sin6_port = port_n;
+    }
+
+    return n;
+}
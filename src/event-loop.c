@@ -0,0 +1,362 @@
+#include "../include/event-loop.h"
+#include "../include/uring-loop.h"
+
+void link_client(EventLoop *loop, ClientConn *conn)
+{
+    conn->prev = NULL;
+    conn->next = loop->conns;
+    if (loop->conns)
+        loop->conns->prev = conn;
+    loop->conns = conn;
+}
+
+void unlink_client(EventLoop *loop, ClientConn *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+// closing the fd also drops it from the epoll set
+static void close_client(EventLoop *loop, ClientConn *conn)
+{
+    unlink_client(loop, conn);
+    free_client_conn(conn);
+    STATS_SUB(clients_open, 1);
+}
+
+// sends the head then the body till all of it is out or the socket is full,
+// returns 1 when done, 0 when it has to wait for EPOLLOUT, -1 on error
+static int write_client(ClientConn *conn)
+{
+    while (conn->head_sent < conn->head_len)
+    {
+        int flags = MSG_NOSIGNAL | (conn->body_sent < conn->body_len ? MSG_MORE : 0);
+        ssize_t n = send(conn->fd, conn->head + conn->head_sent, conn->head_len - conn->head_sent, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+
+        conn->head_sent += n;
+        conn->io_deadline = phase_deadline(&conn->deadline, PHASE_BODY);
+    }
+
+    while (conn->body_sent < conn->body_len)
+    {
+        ssize_t n = 0;
+        if (conn->file_fd >= 0)
+        {
+            off_t offset = conn->file_offset + conn->body_sent;
+            n = sendfile(conn->fd, conn->file_fd, &offset, conn->body_len - conn->body_sent);
+
+            // file is shorter than its entry
+            if (n == 0)
+                return -1;
+        }
+        else
+        {
+            n = send(conn->fd, conn->body + conn->body_sent, conn->body_len - conn->body_sent, MSG_NOSIGNAL);
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+
+        conn->body_sent += n;
+        conn->io_deadline = phase_deadline(&conn->deadline, PHASE_BODY);
+    }
+
+    return 1;
+}
+
+// moves a connection on after its state changed
+static void advance_client(EventLoop *loop, ClientConn *conn)
+{
+    if (conn->state == CLIENT_FETCHING)
+    {
+        // a worker owns it till client_fetched, the loop stops polling it meanwhile
+        unlink_client(loop, conn);
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        enqueue_client(loop->ctx->client_queue, conn);
+        return;
+    }
+
+    if (conn->state == CLIENT_WRITING_RESPONSE)
+    {
+        if (!conn->head_sent)
+            conn->io_deadline = phase_deadline(&conn->deadline, PHASE_BODY);
+
+        int sent = write_client(conn);
+        if (sent == 0)
+            return;
+        if (sent < 0)
+            printf("failed to send response to client\n");
+    }
+
+    close_client(loop, conn);
+}
+
+// reads whatever the client sent, routing the request once its head is complete
+static void read_client(EventLoop *loop, ClientConn *conn)
+{
+    while (conn->state == CLIENT_READING_REQUEST)
+    {
+        ssize_t n = recv(conn->fd, loop->read_buf, EVENT_LOOP_READ_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+
+        if (n < 0)
+        {
+            perror("recv_request");
+            close_client(loop, conn);
+            return;
+        }
+
+        client_received(conn, loop->read_buf, n, loop->ctx);
+    }
+
+    advance_client(loop, conn);
+}
+
+// takes every pending client, when out of fds the rest wait for the next sweep
+static void accept_clients(EventLoop *loop)
+{
+    while (1)
+    {
+        int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (fd < 0)
+        {
+            if (errno != EAGAIN)
+                perror("accept");
+            return;
+        }
+
+        ClientConn *conn = create_client_conn(fd, loop);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (!conn || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            if (conn)
+                free_client_conn(conn);
+            else
+                close(fd);
+            continue;
+        }
+
+        STATS_INC(clients_accepted);
+        STATS_INC(clients_open);
+        link_client(loop, conn);
+    }
+}
+
+// polls the connections the workers are done with again and writes their responses
+static void take_fetched(EventLoop *loop)
+{
+    // drained before taking the list so a push after it wakes the loop again
+    uint64_t count;
+    while (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&loop->done_lock);
+    ClientConn *conn = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (conn)
+    {
+        ClientConn *next = conn->next;
+        link_client(loop, conn);
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (conn->state != CLIENT_WRITING_RESPONSE || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+            close_client(loop, conn);
+        else
+            advance_client(loop, conn);
+
+        conn = next;
+    }
+}
+
+// answers 408 to clients too slow sending their request, drops those too slow reading the response
+static void sweep_clients(EventLoop *loop)
+{
+    long now = monotonic_ms();
+    ClientConn *conn = loop->conns;
+    while (conn)
+    {
+        ClientConn *next = conn->next;
+        if (is_client_late(conn, now))
+        {
+            client_timed_out(conn);
+            advance_client(loop, conn);
+        }
+        conn = next;
+    }
+
+    accept_clients(loop);
+}
+
+static void run_epoll_loop(EventLoop *loop)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    long next_sweep = monotonic_ms() + EVENT_LOOP_SWEEP_MS;
+
+    while (1)
+    {
+        long left = next_sweep - monotonic_ms();
+        int n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, left > 0 ? (int)left : 0);
+        if (n < 0 && errno != EINTR)
+            perror("epoll_wait");
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &loop->listen_fd)
+                accept_clients(loop);
+            else if (events[i].data.ptr == &loop->wake_fd)
+                take_fetched(loop);
+            else
+            {
+                ClientConn *conn = (ClientConn *)events[i].data.ptr;
+                if (conn->state == CLIENT_READING_REQUEST)
+                    read_client(loop, conn);
+                else
+                    advance_client(loop, conn);
+            }
+        }
+
+        if (monotonic_ms() >= next_sweep)
+        {
+            sweep_clients(loop);
+            next_sweep = monotonic_ms() + EVENT_LOOP_SWEEP_MS;
+        }
+    }
+}
+
+static void *event_loop_thread(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    if (loop->backend == IO_BACKEND_URING)
+        run_uring_loop(loop);
+    else
+        run_epoll_loop(loop);
+
+    return NULL;
+}
+
+static int init_event_loop(EventLoop *loop, int listen_fd, IoBackend backend, SharedContext *ctx)
+{
+    loop->backend = backend;
+    loop->listen_fd = listen_fd;
+    loop->ctx = ctx;
+    pthread_mutex_init(&loop->done_lock, NULL);
+
+    // a ring reads the eventfd itself, it would get EAGAIN instead of waiting were it non-blocking
+    if (backend == IO_BACKEND_URING)
+    {
+        loop->epfd = -1;
+        loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (loop->wake_fd < 0)
+        {
+            perror("eventfd");
+            return -1;
+        }
+        return 0;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epfd < 0 || loop->wake_fd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    // every loop polls the listening socket, exclusive so a client wakes just one
+    struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, .data.ptr = &loop->listen_fd};
+    struct epoll_event wake_ev = {.events = EPOLLIN | EPOLLET, .data.ptr = &loop->wake_fd};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &listen_ev) < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &wake_ev) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parse_io_backend(const char *name, IoBackend *backend)
+{
+    if (strcasecmp(name, "epoll") == 0)
+        *backend = IO_BACKEND_EPOLL;
+    else if (strcasecmp(name, "io_uring") == 0 || strcasecmp(name, "uring") == 0)
+        *backend = IO_BACKEND_URING;
+    else
+        return 0;
+
+    return 1;
+}
+
+void run_event_loops(int listen_fd, int n, IoBackend backend, SharedContext *ctx)
+{
+    if (n <= 0)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    if (backend == IO_BACKEND_URING && !uring_supported())
+    {
+        fprintf(stderr, "io_uring not available, using epoll\n");
+        backend = IO_BACKEND_EPOLL;
+    }
+
+    // rings accept on their own, epoll loops accept till EAGAIN
+    if (backend == IO_BACKEND_EPOLL)
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    EventLoop *loops = calloc(n, sizeof(EventLoop));
+    if (!loops)
+        exit(EXIT_FAILURE);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (init_event_loop(&loops[i], listen_fd, backend, ctx) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < n; i++)
+    {
+        if (pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(loops[i].thread);
+    }
+
+    printf("running %d %s event loops\n", n, backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+    event_loop_thread(&loops[0]);
+}
+
+void client_fetched(ClientConn *conn)
+{
+    EventLoop *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->done_lock);
+    conn->next = loop->done;
+    loop->done = conn;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+        perror("write eventfd");
+}
@@ -59,14 +59,13 @@ int parse_url(const char *url, ParsedURL *out)
 
     return 1; // success
 }
-struct HttpResponse *fetch_url(const char *url, int max_redirects)
+
+HttpStream *open_http_stream(const char *url, int max_redirects, const char *etag, const char *last_modified,
+                             Deadline *deadline)
 {
-    int sockfd = -1;
     ParsedURL parsed;
-    SSL_CTX *ctx = NULL;
-    SSL *ssl = NULL;
+    HttpStream *stream = NULL;
     char *raw = NULL;
-    struct HttpResponse *res = NULL;
 
     if (max_redirects <= 0)
     {
@@ -81,47 +80,84 @@ struct HttpResponse *fetch_url(const char *url, int max_redirects)
         return NULL;
     }
 
-    // Connect to remote server
-    sockfd = open_connection(parsed.host, parsed.port);
-    if (sockfd < 0)
-        goto cleanup;
-
-    // Perform SSL/TLS handshake if needed
-    if (strcmp(parsed.scheme, "https") == 0)
+    stream = calloc(1, sizeof(HttpStream));
+    if (!stream)
+        return NULL;
+    stream->deadline = deadline;
+
+    // validators of the stored copy, origin answers 304 if it is still valid
+    char conditional_headers[256] = {0};
+    size_t headers_len = 0;
+    if (etag && *etag)
+        headers_len += snprintf(conditional_headers + headers_len, sizeof(conditional_headers) - headers_len,
+                                "If-None-Match: %s\r\n", etag);
+    if (last_modified && *last_modified && headers_len < sizeof(conditional_headers))
+        snprintf(conditional_headers + headers_len, sizeof(conditional_headers) - headers_len,
+                 "If-Modified-Since: %s\r\n", last_modified);
+
+    size_t raw_len, header_len;
+    while (1)
     {
-        ssl = ssl_wrap(sockfd, parsed.host, &ctx);
-        if (!ssl)
+        // pooled connection to the origin, or a new one
+        stream->conn = checkout_upstream(parsed.scheme, parsed.host, parsed.port, deadline);
+        if (!stream->conn)
             goto cleanup;
-    }
 
-    // Send HTTP request
-    if (send_http_request(sockfd, ssl, parsed.host, parsed.path) < 0)
-        goto cleanup;
+        // Send HTTP request and receive the headers, the body is left in the socket
+        if (send_http_request(stream->conn->sockfd, stream->conn->ssl, parsed.host, parsed.path,
+                              conditional_headers, upstream_keep_alive(), deadline) >= 0 &&
+            (raw = recv_response_head(stream->conn->sockfd, stream->conn->ssl, &raw_len, &header_len, deadline)))
+            break;
+
+        // the origin may close an idle connection just as it is reused, a GET is
+        // safe to send again, on a new connection once the idle ones are used up,
+        // an origin too slow to answer isn't asked again
+        int reused = stream->conn->reused;
+        checkin_upstream(stream->conn, 0);
+        stream->conn = NULL;
+        if (!reused || (deadline && deadline->expired))
+            goto cleanup;
 
-    // Receive raw response
-    size_t raw_len;
-    raw = recv_response(sockfd, ssl, &raw_len);
-    if (!raw)
+        STATS_INC(upstream_retries);
+        printf("reused connection to %s was closed, retrying\n", parsed.host);
+    }
+
+    stream->head = parse_http_response_head(raw, header_len);
+    if (!stream->head)
         goto cleanup;
 
-    // Parse response
-    res = parse_http_response(raw, raw_len);
-    free(raw);
+    // body bytes that came along with the headers are handed out first
+    stream->buffer = raw;
+    stream->buffered = raw_len;
+    stream->consumed = header_len;
     raw = NULL;
 
-    if (!res)
-        goto cleanup;
-
-    // Handle Redirects (e.g., 301, 302)
-    if (res->isRedirect || (res->statusCode >= 300 && res->statusCode < 400))
+    HttpResponse *res = stream->head;
+    stream->keep_alive = upstream_keep_alive() && res->keepAlive;
+
+    // no body in these, else chunked, the announced length or everything till
+    // the origin closes, chunked wins over a Content-Length sent along
+    init_chunk_decoder(&stream->decoder);
+    stream->remaining = -1;
+    if (res->statusCode < 200 || res->statusCode == 204 || res->statusCode == 304)
+        stream->remaining = 0;
+    else if (res->isChunked)
+        stream->chunked = 1;
+    else if (res->contentLength >= 0)
+        stream->remaining = res->contentLength;
+
+    // Handle Redirects (e.g., 301, 302), 304 is an answer to the conditional request
+    if (res->isRedirect || (res->statusCode >= 300 && res->statusCode < 400 && res->statusCode != 304))
     {
         char redirect_url[URL_MAX_LEN] = {0};
 
         if (res->location[0] == '/')
         {
-            // Handle relative redirect
-            snprintf(redirect_url, sizeof(redirect_url), "%s://%s%s",
-                     parsed.scheme, parsed.host, res->location);
+            // Handle relative redirect, on the same origin including its port
+            int default_port = strcmp(parsed.port, strcmp(parsed.scheme, "https") == 0 ? "443" : "80") == 0;
+            snprintf(redirect_url, sizeof(redirect_url), "%s://%s%s%s%s",
+                     parsed.scheme, parsed.host, default_port ? "" : ":", default_port ? "" : parsed.port,
+                     res->location);
         }
         else
         {
@@ -138,130 +174,396 @@ struct HttpResponse *fetch_url(const char *url, int max_redirects)
 
         fprintf(stderr, "Redirecting to: %s\n", redirect_url);
 
-        // Free resources and recurse
-        free_http_response(res);
-        free(res);
-        close(sockfd);
-        SSL_CTX_free(ctx);
-        SSL_free(ssl);
-        ctx = NULL;
-        ssl = NULL;
-        sockfd = -1;
-
-        res = fetch_url(redirect_url, max_redirects - 1);
+        // Free resources and recurse, a redirect to the same origin reuses the connection
+        close_http_stream(stream);
+        return open_http_stream(redirect_url, max_redirects - 1, etag, last_modified, deadline);
     }
 
-    if (sockfd != -1)
-        close(sockfd);
-    if (ctx)
-        SSL_CTX_free(ctx);
-    if (ssl)
-        SSL_free(ssl);
-
-    return res;
+    return stream;
 
 cleanup:
-    if (sockfd != -1)
-        close(sockfd);
-    if (ctx)
-        SSL_CTX_free(ctx);
-    if (ssl)
-        SSL_free(ssl);
-    if (raw)
-        free(raw);
-    if (res)
+    free(raw);
+    close_http_stream(stream);
+    return NULL;
+}
+
+// builds a 200 response whose body is borrowed from the cached object
+static HttpResponse *response_from_object(CacheObject *object)
+{
+    // allocate space for res object
+    HttpResponse *res = (HttpResponse *)calloc(1, sizeof(HttpResponse));
+    if (!res)
     {
-        free_http_response(res);
-        free(res);
+        printf("failed to allocate space for response object\n");
+        release_cache_object(object);
+        return NULL;
     }
-    return NULL;
+
+    // initialize the res, body is borrowed from the shared object
+    res->statusCode = 200;
+    strcpy(res->statusMessage, "OK");
+    strcpy(res->httpVersion, "HTTP/1.1");
+    strcpy(res->contentType, object->content_type);
+    res->bodyLength = object->length;
+    res->contentLength = object->length;
+    res->isChunked = 0;
+    res->isRedirect = 0;
+    res->body = object->body;
+    res->object = object;
+
+    return res;
 }
-struct HttpResponse *fetch_cache_or_url(CacheLRU *cache, const char *url, int max_redirects)
+
+// receives the whole body, rewrites html and stores the response if allowed
+static HttpResponse *buffer_and_store(CacheLRU *cache, const char *url, HttpStream *stream,
+                                      CacheMeta *meta, InflightCall *call, time_t request_time,
+                                      Deadline *deadline)
 {
-    // when cache present then move the node to head and return cache response
-    if (lru_contains(cache, url))
+    HttpResponse *res = NULL;
+    if (read_http_stream_body(stream) == 0)
     {
-        // move to head
-        lru_touch(cache, url);
+        res = stream->head;
+        stream->head = NULL;
+    }
+    close_http_stream(stream);
 
-        // initializing vars
-        char *cache_filename = NULL;
-        char *data = NULL;
-        HttpResponse *res = NULL;
-        char content_type[128] = {0};
-        size_t data_len = 0;
+    if (!res)
+    {
+        inflight_complete(&cache->inflight, call, NULL);
+        return NULL;
+    }
 
-        // get the sanitized filename
-        cache_filename = get_cache_filename(url);
+    // rewrite html links for our proxy
+    if (strcasestr(res->contentType, "text/html"))
+    {
+        ParsedURL parsed_url;
+        parse_url(url, &parsed_url);
 
-        // return cache response
-        data = read_cache_file(cache_filename, content_type, &data_len);
+        // parsing html so that every
+        size_t new_length;
+        char *new_body = rewrite_all_html(res->body, res->bodyLength, parsed_url.host, &new_length);
+
+        if (new_body)
+        {
+            free(res->body);
+            res->body = new_body;
+            res->bodyLength = new_length;
+        }
+    }
 
-        if (!data)
-            goto catch;
+    // cache the response if the origin allows it, else the old copy is useless
+    CacheObject *object = NULL;
+    if (is_response_storable(res) && is_cache_url_storable(url))
+    {
+        compute_cache_meta(res, request_time, time(NULL), meta);
 
-        // allocate space for res object
-        res = (HttpResponse *)calloc(1, sizeof(HttpResponse));
-        if (!res)
+        // body moves into a shared object, the client send and the disk write
+        // use the same bytes and the write needn't finish before the send
+        object = new_cache_object(res->contentType, res->body, res->bodyLength);
+        if (object)
         {
-            printf("failed to allocate space for response object\n");
-            goto catch;
+            free(res->body);
+            res->body = object->body;
+            res->object = object;
         }
+    }
+    else
+        lru_delete(cache, url);
 
-        // initialize the res
-        res->statusCode = 200;
-        strcpy(res->statusMessage, "OK");
-        strcpy(res->httpVersion, "HTTP/1.1");
-        strcpy(res->contentType, content_type);
-        res->bodyLength = data_len;
-        res->contentLength = data_len;
-        res->isChunked = 0;
-        res->isRedirect = 0;
-        res->body = data;
-        data = NULL;
+    // waiting threads get the response first, they needn't wait on a full write queue
+    inflight_complete(&cache->inflight, call, res);
+    if (object)
+        submit_cache_write(cache, url, object, meta, deadline);
 
-        printf("serving from cache\n");
+    return res;
+}
 
-        free(cache_filename);
-        return res;
+// sends the body to the client as it arrives, a storable body within the
+// object limit is received straight into its cache object on the way
+static HttpResponse *relay_and_store(CacheLRU *cache, const char *url, HttpStream *stream,
+                                     CacheMeta *meta, InflightCall *call, time_t request_time, int client_fd,
+                                     Deadline *deadline)
+{
+    HttpResponse *res = stream->head;
+    long length = stream->remaining;
+
+    int storable = is_response_storable(res) && is_cache_url_storable(url);
+    if (!storable)
+        lru_delete(cache, url);
 
-    // will run for errors
-    catch:
-        if (cache_filename)
-            free(cache_filename);
-        if (data)
-            free(data);
-        if (res)
-            free(res);
+    // announced length is allocated at once, else the object doubles as it fills
+    CacheObject *object = NULL;
+    if (storable && (length < 0 || (size_t)length <= cache->max_object_bytes))
+        object = alloc_cache_object(res->contentType, length >= 0 ? (size_t)length : RELAY_CHUNK_SIZE);
+
+    char *chunk = NULL;
+    if (!object && !(chunk = malloc(RELAY_CHUNK_SIZE)))
+    {
+        close_http_stream(stream);
+        inflight_complete(&cache->inflight, call, NULL);
         return NULL;
     }
 
-    printf("requesting remote server for response\n");
-
-    // fetch from remote server and cache the response
-    HttpResponse *res = fetch_url(url, max_redirects);
+    // followers needn't wait for a body that won't be kept
+    if (!object)
+    {
+        inflight_abandon(&cache->inflight, call);
+        call = NULL;
+    }
 
-    if (!res)
-        return NULL;
+    // the client keeps receiving even if the body turns out too big to keep,
+    // a client going away only stops the relay when nothing is kept
+    int client_ok = send_http_response_head(client_fd, length, res->contentType, stream->deadline) >= 0;
+    size_t received = 0;
+    int complete = 0;
 
-    // rewrite html links for our proxy
-    if (strcasestr(res->contentType, "text/html"))
+    while (client_ok || object)
     {
-        ParsedURL parsed_url;
-        parse_url(url, &parsed_url);
+        char *buf = chunk;
+        size_t size = RELAY_CHUNK_SIZE;
 
-        // parsing html so that every
-        char *new_body = rewrite_all_html(res->body, res->bodyLength, parsed_url.host);
+        if (object)
+        {
+            if (received == object->length && length < 0)
+            {
+                size_t capacity = MIN(object->length * 2, cache->max_object_bytes);
+                CacheObject *grown = capacity > object->length ? resize_cache_object(object, capacity) : NULL;
+                if (!grown)
+                {
+                    printf("response too large to cache, relaying only\n");
+                    release_cache_object(object);
+                    object = NULL;
+                    inflight_abandon(&cache->inflight, call);
+                    call = NULL;
+                    if (!client_ok || !(chunk = malloc(RELAY_CHUNK_SIZE)))
+                        break;
+                    continue;
+                }
+                object = grown;
+            }
+
+            buf = object->body + received;
+            size = object->length - received;
+        }
 
-        if (new_body)
+        ssize_t n = read_http_stream(stream, buf, size);
+        if (n <= 0)
         {
-            free(res->body);
-            res->body = new_body;
+            complete = n == 0;
+            break;
         }
+
+        if (client_ok && send_all(client_fd, buf, n, stream->deadline) < 0)
+        {
+            printf("client went away during relay\n");
+            client_ok = 0;
+        }
+
+        received += n;
     }
 
-    // cache the response
-    lru_insert(cache, url, res->body, res->bodyLength, res->contentType);
+    // the head outlives the stream as the response
+    stream->head = NULL;
+    close_http_stream(stream);
+    free(chunk);
+    res->relayed = 1;
+
+    // a truncated body is never stored, the client got what there was
+    if (object && complete)
+    {
+        CacheObject *trimmed = resize_cache_object(object, received);
+        if (trimmed)
+            object = trimmed;
+        object->length = received;
+        object->body[received] = '\0';
+
+        res->body = object->body;
+        res->bodyLength = received;
+        res->object = object;
+
+        compute_cache_meta(res, request_time, time(NULL), meta);
+        inflight_complete(&cache->inflight, call, res);
+        submit_cache_write(cache, url, object, meta, deadline);
+    }
+    else
+    {
+        release_cache_object(object);
+        inflight_abandon(&cache->inflight, call);
+    }
 
     return res;
-}
\ No newline at end of file
+}
+
+// leader of a fetch: revalidates or refetches the url, stores the result and
+// hands it to the followers, object is the stale copy or NULL and is consumed,
+// the body is relayed to client_fd as it arrives unless it is -1
+static HttpResponse *fetch_and_store(CacheLRU *cache, const char *url, int max_redirects,
+                                     CacheObject *object, CacheMeta *meta, InflightCall *call, int client_fd,
+                                     Deadline *deadline)
+{
+    // stale copy with validators is revalidated instead of refetched
+    int revalidate = object && has_cache_validators(meta);
+    time_t request_time = time(NULL);
+    HttpStream *stream = NULL;
+
+    if (revalidate)
+    {
+        printf("revalidating cache with remote server\n");
+        stream = open_http_stream(url, max_redirects, meta->etag, meta->last_modified, deadline);
+    }
+    else
+    {
+        STATS_INC(misses);
+        printf("requesting remote server for response\n");
+
+        // fetch from remote server and cache the response
+        stream = open_http_stream(url, max_redirects, NULL, NULL, deadline);
+    }
+
+    // only the headers are in yet, the body is still in the socket
+    HttpResponse *res = stream ? stream->head : NULL;
+
+    // origin is down or failing, a recently expired copy beats an error
+    if ((!res || res->statusCode >= 500) && object &&
+        is_cache_meta_usable_stale(meta, time(NULL), cache->stale_if_error))
+    {
+        STATS_INC(stale_if_error);
+        printf("origin failed, serving stale cache\n");
+
+        close_http_stream(stream);
+
+        res = response_from_object(object);
+        inflight_complete(&cache->inflight, call, res);
+        return res;
+    }
+
+    if (!res)
+    {
+        close_http_stream(stream);
+        release_cache_object(object);
+        inflight_complete(&cache->inflight, call, NULL);
+        return NULL;
+    }
+
+    // still valid, only the freshness gets renewed and the stored body is served
+    if (revalidate && res->statusCode == 304)
+    {
+        STATS_INC(revalidated);
+        refresh_cache_meta(meta, res, request_time, time(NULL));
+        lru_refresh(cache, url, meta);
+
+        close_http_stream(stream);
+
+        res = response_from_object(object);
+        inflight_complete(&cache->inflight, call, res);
+        return res;
+    }
+
+    if (revalidate)
+        STATS_INC(misses);
+    release_cache_object(object);
+
+    // html gets rewritten as a whole, background refreshes have nobody to relay to
+    if (client_fd < 0 || strcasestr(res->contentType, "text/html"))
+        return buffer_and_store(cache, url, stream, meta, call, request_time, deadline);
+
+    return relay_and_store(cache, url, stream, meta, call, request_time, client_fd, deadline);
+}
+
+struct HttpResponse *lookup_cache(CacheLRU *cache, const char *url, CacheObject **stale, CacheMeta *meta,
+                                  int read_disk)
+{
+    // object comes from the memory tier or the disk, NULL when not cached
+    CacheObject *object = lru_get(cache, url, meta, read_disk);
+    if (object && is_cache_meta_fresh(meta, time(NULL)))
+    {
+        printf("serving from cache\n");
+        return response_from_object(object);
+    }
+
+    // just expired, client gets the stale copy while it is refreshed in background
+    if (object && cache->refresher &&
+        is_cache_meta_usable_stale(meta, time(NULL), cache->stale_while_revalidate) &&
+        enqueue_refresh(cache->refresher, url) == 0)
+    {
+        STATS_INC(stale_served);
+        printf("serving stale cache, refresh queued\n");
+        return response_from_object(object);
+    }
+
+    *stale = object;
+    return NULL;
+}
+
+struct HttpResponse *fetch_cache_miss(CacheLRU *cache, const char *url, int max_redirects, CacheObject *object,
+                                      CacheMeta *meta, int client_fd, Deadline *deadline)
+{
+    // only one thread fetches a given url, others wait for its response
+    int is_leader = 1;
+    InflightCall *call = NULL;
+    char *key = get_cache_key(url);
+    if (key)
+    {
+        call = inflight_join(&cache->inflight, key, &is_leader);
+        free(key);
+    }
+
+    if (!is_leader)
+    {
+        release_cache_object(object);
+        STATS_INC(coalesced);
+        printf("waiting for in-flight fetch of: %s\n", url);
+
+        int abandoned = 0;
+        HttpResponse *res = inflight_wait(&cache->inflight, call, &abandoned, deadline);
+        if (!abandoned)
+            return res;
+
+        // leader relayed a body it didn't keep, nothing to share but the wait
+        printf("in-flight fetch not cached, fetching: %s\n", url);
+        return fetch_and_store(cache, url, max_redirects, NULL, meta, NULL, client_fd, deadline);
+    }
+
+    return fetch_and_store(cache, url, max_redirects, object, meta, call, client_fd, deadline);
+}
+
+void refresh_cache_entry(CacheLRU *cache, const char *url, int max_redirects)
+{
+    // entry may have been evicted or refreshed since it was queued
+    CacheMeta meta;
+    CacheObject *object = lru_get(cache, url, &meta, 1);
+    if (!object || is_cache_meta_fresh(&meta, time(NULL)))
+    {
+        release_cache_object(object);
+        return;
+    }
+
+    int is_leader = 1;
+    InflightCall *call = NULL;
+    char *key = get_cache_key(url);
+    if (key)
+    {
+        call = inflight_join(&cache->inflight, key, &is_leader);
+        free(key);
+    }
+
+    // a client miss is already fetching it
+    if (!is_leader)
+    {
+        release_cache_object(object);
+        inflight_leave(&cache->inflight, call);
+        return;
+    }
+
+    // nobody waits on a refresh, its budgets still keep a slow origin from pinning the thread
+    Deadline deadline;
+    start_deadline(&deadline);
+
+    STATS_INC(background_refreshes);
+    HttpResponse *res = fetch_and_store(cache, url, max_redirects, object, &meta, call, -1, &deadline);
+    if (res)
+    {
+        free_http_response(res);
+        free(res);
+    }
+}
@@ -0,0 +1,104 @@
+#include "../include/freshness.h"
+#include "../include/http-parser.h"
+
+int is_response_storable(const HttpResponse *res)
+{
+    if (!res || res->statusCode != 200)
+        return 0;
+
+    // private responses are for a single user, never for a shared cache
+    return !(res->cacheControl & (CC_NO_STORE | CC_PRIVATE));
+}
+
+// freshness lifetime in seconds as defined for shared caches
+static long freshness_lifetime(const HttpResponse *res, time_t response_time)
+{
+    if (res->cacheControl & CC_NO_CACHE)
+        return 0;
+
+    long lifetime = -1;
+
+    if (res->sMaxAge >= 0)
+        lifetime = res->sMaxAge;
+    else if (res->maxAge >= 0)
+        lifetime = res->maxAge;
+    else if (res->expires)
+        lifetime = (long)difftime(res->expires, res->date ? res->date : response_time);
+    else if (res->lastModified[0])
+    {
+        // heuristic, resources unchanged for long are likely to stay so
+        time_t last_modified = parse_http_date(res->lastModified);
+        time_t date = res->date ? res->date : response_time;
+        if (last_modified && last_modified < date)
+        {
+            lifetime = (long)difftime(date, last_modified) * CACHE_HEURISTIC_PERCENT / 100;
+            if (lifetime > CACHE_HEURISTIC_MAX_TTL)
+                lifetime = CACHE_HEURISTIC_MAX_TTL;
+        }
+    }
+
+    if (lifetime < 0)
+        lifetime = (res->cacheControl & CC_IMMUTABLE) ? CACHE_IMMUTABLE_TTL : CACHE_DEFAULT_TTL;
+
+    return lifetime;
+}
+
+// age the response already had when it was received
+static long initial_age(const HttpResponse *res, time_t request_time, time_t response_time)
+{
+    long apparent_age = res->date ? (long)difftime(response_time, res->date) : 0;
+    if (apparent_age < 0)
+        apparent_age = 0;
+
+    long corrected_age = res->age + (long)difftime(response_time, request_time);
+
+    return apparent_age > corrected_age ? apparent_age : corrected_age;
+}
+
+void compute_cache_meta(const HttpResponse *res, time_t request_time, time_t response_time, CacheMeta *meta)
+{
+    memset(meta, 0, sizeof(CacheMeta));
+
+    meta->stored_at = response_time;
+    meta->must_revalidate = (res->cacheControl & (CC_MUST_REVALIDATE | CC_NO_CACHE)) != 0;
+    meta->expires_at = response_time - initial_age(res, request_time, response_time) +
+                       freshness_lifetime(res, response_time);
+
+    strncpy(meta->etag, res->etag, sizeof(meta->etag) - 1);
+    strncpy(meta->last_modified, res->lastModified, sizeof(meta->last_modified) - 1);
+}
+
+void refresh_cache_meta(CacheMeta *meta, const HttpResponse *not_modified, time_t request_time, time_t response_time)
+{
+    CacheMeta fresh;
+    compute_cache_meta(not_modified, request_time, response_time, &fresh);
+
+    // 304 without its own freshness info keeps the lifetime of the stored response
+    int has_freshness = not_modified->maxAge >= 0 || not_modified->sMaxAge >= 0 || not_modified->expires;
+    if (!has_freshness && !(not_modified->cacheControl & CC_NO_CACHE))
+        fresh.expires_at = response_time + (meta->expires_at - meta->stored_at);
+
+    meta->stored_at = fresh.stored_at;
+    meta->expires_at = fresh.expires_at;
+    meta->must_revalidate |= fresh.must_revalidate;
+
+    if (fresh.etag[0])
+        strcpy(meta->etag, fresh.etag);
+    if (fresh.last_modified[0])
+        strcpy(meta->last_modified, fresh.last_modified);
+}
+
+int is_cache_meta_fresh(const CacheMeta *meta, time_t now)
+{
+    return meta->expires_at > now;
+}
+
+int is_cache_meta_usable_stale(const CacheMeta *meta, time_t now, time_t window)
+{
+    return !meta->must_revalidate && now < meta->expires_at + window;
+}
+
+int has_cache_validators(const CacheMeta *meta)
+{
+    return meta->etag[0] || meta->last_modified[0];
+}
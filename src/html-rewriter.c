@@ -14,7 +14,7 @@ void normalize_domain(const char *input, char *output)
         sprintf(output, "https://%s", input);
 }
 
-char *inject_base_tag(const char *html, size_t html_len, const char *host)
+char *inject_base_tag(const char *html, size_t html_len, const char *host, size_t *out_len)
 {
     if (!html || !host)
         return NULL;
@@ -23,12 +23,21 @@ char *inject_base_tag(const char *html, size_t html_len, const char *host)
     char normalized_host[512];
     normalize_domain(host, normalized_host);
 
-    char base_tag[512];
+    // room for the whole normalized host besides the tag around it
+    char base_tag[sizeof(normalized_host) + 32];
     snprintf(base_tag, sizeof(base_tag), base_fmt, normalized_host);
 
     const char *head_pos = strcasestr(html, "<head>");
     if (!head_pos)
-        return strndup(html, html_len);
+    {
+        char *copy = malloc(html_len + 1);
+        if (!copy)
+            return NULL;
+        memcpy(copy, html, html_len);
+        copy[html_len] = '\0';
+        *out_len = html_len;
+        return copy;
+    }
 
     size_t pre_len = head_pos - html + strlen("<head>");
     size_t base_len = strlen(base_tag);
@@ -42,6 +51,7 @@ char *inject_base_tag(const char *html, size_t html_len, const char *host)
     memcpy(result + pre_len, base_tag, base_len);
     memcpy(result + pre_len + base_len, html + pre_len, html_len - pre_len);
     result[new_len] = '\0';
+    *out_len = new_len;
 
     return result;
 }
@@ -261,7 +271,7 @@ char *rewrite_css_urls(const char *html, const char *host)
     return result;
 }
 
-char *rewrite_all_html(const char *html, size_t html_len, const char *host)
+char *rewrite_all_html(const char *html, size_t html_len, const char *host, size_t *out_len)
 {
     if (!html || !host)
         return NULL;
@@ -280,5 +290,5 @@ char *rewrite_all_html(const char *html, size_t html_len, const char *host)
     // free(srcset);
     // if (!css) return NULL;
 
-    return inject_base_tag(html, html_len, domain);
+    return inject_base_tag(html, html_len, domain, out_len);
 }
@@ -0,0 +1,139 @@
+#include "../include/http-framing.h"
+#include <string.h>
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+void init_chunk_decoder(ChunkDecoder *decoder)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->state = CHUNK_SIZE;
+}
+
+int chunk_decoder_done(const ChunkDecoder *decoder)
+{
+    return decoder->state == CHUNK_DONE;
+}
+
+// size line is complete, the chunk follows or the trailers if it was the last
+static int end_size_line(ChunkDecoder *decoder)
+{
+    if (decoder->digits == 0)
+        return -1;
+
+    decoder->state = decoder->size ? CHUNK_DATA : CHUNK_TRAILER_LINE_START;
+    return 0;
+}
+
+ssize_t decode_chunked(ChunkDecoder *decoder, char *buf, size_t len, size_t *consumed)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < len && decoder->state != CHUNK_DONE)
+    {
+        // data is moved down over the framing bytes before it, in bulk
+        if (decoder->state == CHUNK_DATA)
+        {
+            size_t n = len - in;
+            if (n > decoder->size)
+                n = decoder->size;
+
+            if (out != in)
+                memmove(buf + out, buf + in, n);
+            out += n;
+            in += n;
+
+            decoder->size -= n;
+            if (decoder->size == 0)
+                decoder->state = CHUNK_DATA_CR;
+            continue;
+        }
+
+        char c = buf[in++];
+
+        switch (decoder->state)
+        {
+        case CHUNK_SIZE:
+        {
+            int v = hex_value(c);
+            if (v >= 0)
+            {
+                // more than 16 digits can't fit the size
+                if (decoder->size >> 60)
+                    return -1;
+                decoder->size = decoder->size << 4 | v;
+                decoder->digits++;
+            }
+            else if (c == ';' || c == ' ' || c == '\t')
+                decoder->state = CHUNK_EXT;
+            else if (c == '\r')
+                decoder->state = CHUNK_SIZE_LF;
+            else if (c == '\n')
+            {
+                if (end_size_line(decoder) < 0)
+                    return -1;
+            }
+            else
+                return -1;
+            break;
+        }
+        case CHUNK_EXT:
+            if (c == '\r')
+                decoder->state = CHUNK_SIZE_LF;
+            else if (c == '\n' && end_size_line(decoder) < 0)
+                return -1;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n' || end_size_line(decoder) < 0)
+                return -1;
+            break;
+        case CHUNK_DATA_CR:
+            if (c == '\r')
+                decoder->state = CHUNK_DATA_LF;
+            else if (c == '\n')
+                init_chunk_decoder(decoder);
+            else
+                return -1;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            init_chunk_decoder(decoder);
+            break;
+        case CHUNK_TRAILER_LINE_START:
+            if (c == '\r')
+                decoder->state = CHUNK_FINAL_LF;
+            else if (c == '\n')
+                decoder->state = CHUNK_DONE;
+            else
+                decoder->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            // trailer fields aren't used, only their size is bounded
+            if (++decoder->trailer_bytes > MAX_CHUNK_TRAILER_SIZE)
+                return -1;
+            if (c == '\n')
+                decoder->state = CHUNK_TRAILER_LINE_START;
+            break;
+        case CHUNK_FINAL_LF:
+            if (c != '\n')
+                return -1;
+            decoder->state = CHUNK_DONE;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    *consumed = in;
+    return out;
+}
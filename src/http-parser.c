@@ -1,40 +1,69 @@
 #include "../include/http-parser.h"
+#include "../include/cache-object.h"
 
-HttpResponse *parse_http_response(const char *raw, size_t raw_len)
+// parses the comma separated Cache-Control directives
+static void parse_cache_control(const char *val, HttpResponse *res)
 {
-    if (!raw || raw_len == 0)
-        return NULL;
+    while (*val)
+    {
+        while (*val == ' ' || *val == ',')
+            val++;
+
+        size_t len = strcspn(val, ",");
+
+        if (strncasecmp(val, "max-age=", 8) == 0)
+            res->maxAge = atol(val + 8);
+        else if (strncasecmp(val, "s-maxage=", 9) == 0)
+            res->sMaxAge = atol(val + 9);
+        else if (strncasecmp(val, "no-store", 8) == 0)
+            res->cacheControl |= CC_NO_STORE;
+        else if (strncasecmp(val, "no-cache", 8) == 0)
+            res->cacheControl |= CC_NO_CACHE;
+        else if (strncasecmp(val, "private", 7) == 0)
+            res->cacheControl |= CC_PRIVATE;
+        else if (strncasecmp(val, "immutable", 9) == 0)
+            res->cacheControl |= CC_IMMUTABLE;
+        else if (strncasecmp(val, "must-revalidate", 15) == 0 || strncasecmp(val, "proxy-revalidate", 16) == 0)
+            res->cacheControl |= CC_MUST_REVALIDATE;
+
+        val += len;
+    }
+}
 
-    HttpResponse *res = calloc(1, sizeof(HttpResponse));
-    if (!res)
-        return NULL;
+// whether the comma separated header value lists the token, case insensitive
+static int has_token(const char *val, const char *token)
+{
+    size_t token_len = strlen(token);
 
-    res->contentLength = -1; // default if not specified
+    while (*val)
+    {
+        while (*val == ' ' || *val == '\t' || *val == ',')
+            val++;
 
-    // Step 1: Find header-body separator
-    const char *header_end = NULL;
-    size_t header_len = 0;
+        size_t len = strcspn(val, ", \t");
+        if (len == token_len && strncasecmp(val, token, len) == 0)
+            return 1;
 
-    // finding the headers end
-    for (size_t i = 0; i + 3 < raw_len; ++i)
-    {
-        if (raw[i] == '\r' && raw[i + 1] == '\n' && raw[i + 2] == '\r' && raw[i + 3] == '\n')
-        {
-            header_end = raw + i + 4;
-            header_len = i + 4;
-            break;
-        }
+        val += len;
     }
 
-    // invalid HTTP response
-    if (!header_end || header_end < raw || header_end > raw + raw_len)
-    {
-        free(res);
-        printf("no header end found, invalid response\n");
+    return 0;
+}
+
+HttpResponse *parse_http_response_head(const char *raw, size_t header_len)
+{
+    if (!raw || header_len == 0)
         return NULL;
-    }
 
-    // Step 2: Make a modifiable copy of the status+header section
+    HttpResponse *res = calloc(1, sizeof(HttpResponse));
+    if (!res)
+        return NULL;
+
+    res->contentLength = -1; // default if not specified
+    res->maxAge = -1;
+    res->sMaxAge = -1;
+
+    // Step 1: Make a modifiable copy of the status+header section
     char *headers = malloc(header_len + 1);
     if (!headers)
     {
@@ -45,7 +74,7 @@ HttpResponse *parse_http_response(const char *raw, size_t raw_len)
     memcpy(headers, raw, header_len);
     headers[header_len] = '\0'; // null-terminate for strtok_r
 
-    // Step 3: Parse status line
+    // Step 2: Parse status line
     char *saveptr;
     char *line = strtok_r(headers, "\r\n", &saveptr);
     if (!line)
@@ -54,7 +83,10 @@ HttpResponse *parse_http_response(const char *raw, size_t raw_len)
     if (sscanf(line, "%15s %d %63[^\r\n]", res->httpVersion, &res->statusCode, res->statusMessage) != 3)
         goto fail;
 
-    // Step 4: Parse headers line-by-line
+    // persistent by default from HTTP/1.1 on, the Connection header may say otherwise
+    res->keepAlive = strcmp(res->httpVersion, "HTTP/1.0") != 0;
+
+    // Step 3: Parse headers line-by-line
     while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL)
     {
         while (*line == ' ')
@@ -72,16 +104,37 @@ HttpResponse *parse_http_response(const char *raw, size_t raw_len)
             const char *val = line + 15;
             while (*val == ' ')
                 val++;
-            res->contentLength = atoi(val);
+            // a length that isn't a plain number makes the body boundary unknowable
+            char *end;
+            errno = 0;
+            res->contentLength = strtol(val, &end, 10);
+            while (*end == ' ' || *end == '\t')
+                end++;
+            if (end == val || *end || errno || res->contentLength < 0)
+            {
+                printf("invalid Content-Length: %s\n", val);
+                goto fail;
+            }
         }
         else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
         {
             const char *val = line + 18;
             while (*val == ' ')
                 val++;
-            if (strncasecmp(val, "chunked", 7) == 0)
+            // chunked is always the last coding applied
+            size_t len = strlen(val);
+            while (len && (val[len - 1] == ' ' || val[len - 1] == '\t'))
+                len--;
+            if (len >= 7 && strncasecmp(val + len - 7, "chunked", 7) == 0)
                 res->isChunked = 1;
         }
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+            if (has_token(line + 11, "close"))
+                res->keepAlive = 0;
+            else if (has_token(line + 11, "keep-alive"))
+                res->keepAlive = 1;
+        }
         else if (strncasecmp(line, "Location:", 9) == 0)
         {
             const char *val = line + 9;
@@ -89,18 +142,35 @@ HttpResponse *parse_http_response(const char *raw, size_t raw_len)
                 val++;
             strncpy(res->location, val, sizeof(res->location) - 1);
         }
+        else if (strncasecmp(line, "Cache-Control:", 14) == 0)
+            parse_cache_control(line + 14, res);
+        else if (strncasecmp(line, "Expires:", 8) == 0)
+        {
+            // invalid dates like "0" mean already expired
+            res->expires = parse_http_date(line + 8);
+            if (res->expires == 0)
+                res->expires = 1;
+        }
+        else if (strncasecmp(line, "Date:", 5) == 0)
+            res->date = parse_http_date(line + 5);
+        else if (strncasecmp(line, "Age:", 4) == 0)
+            res->age = atol(line + 4);
+        else if (strncasecmp(line, "ETag:", 5) == 0)
+        {
+            const char *val = line + 5;
+            while (*val == ' ')
+                val++;
+            strncpy(res->etag, val, sizeof(res->etag) - 1);
+        }
+        else if (strncasecmp(line, "Last-Modified:", 14) == 0)
+        {
+            const char *val = line + 14;
+            while (*val == ' ')
+                val++;
+            strncpy(res->lastModified, val, sizeof(res->lastModified) - 1);
+        }
     }
 
-    // Step 5: Handle body
-    size_t body_len = raw_len - (header_end - raw);
-    res->body = calloc(body_len + 1, 1);
-    if (!res->body)
-        goto fail;
-
-    memcpy(res->body, header_end, body_len);
-    res->body[body_len] = '\0';
-    res->bodyLength = body_len;
-
     free(headers);
     return res;
 
@@ -111,6 +181,17 @@ fail:
     return NULL;
 }
 
+size_t find_http_header_end(const char *raw, size_t raw_len)
+{
+    for (size_t i = 0; i + 3 < raw_len; ++i)
+    {
+        if (raw[i] == '\r' && raw[i + 1] == '\n' && raw[i + 2] == '\r' && raw[i + 3] == '\n')
+            return i + 4;
+    }
+
+    return 0;
+}
+
 HttpRequest *parse_http_request(const char *rawRequest, size_t raw_len)
 {
     if (!rawRequest || rawRequest[0] == '\0')
@@ -194,13 +275,53 @@ HttpRequest *parse_http_request(const char *rawRequest, size_t raw_len)
 
 void free_http_response(HttpResponse *res)
 {
-    if (res && res->body)
+    if (res && res->object)
+    {
+        release_cache_object(res->object);
+        res->object = NULL;
+        res->body = NULL;
+    }
+    else if (res && res->body)
     {
         free(res->body);
         res->body = NULL;
     }
 }
 
+HttpResponse *copy_http_response(const HttpResponse *res)
+{
+    if (!res)
+        return NULL;
+
+    HttpResponse *copy = malloc(sizeof(HttpResponse));
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, res, sizeof(HttpResponse));
+    copy->body = NULL;
+    copy->relayed = 0;
+
+    // cached bodies are immutable, sharing them is enough
+    if (res->object)
+    {
+        copy->object = retain_cache_object(res->object);
+        copy->body = res->body;
+    }
+    else if (res->body)
+    {
+        copy->body = malloc(res->bodyLength + 1);
+        if (!copy->body)
+        {
+            free(copy);
+            return NULL;
+        }
+        memcpy(copy->body, res->body, res->bodyLength);
+        copy->body[res->bodyLength] = '\0';
+    }
+
+    return copy;
+}
+
 void free_http_request(HttpRequest *req)
 {
     if (req && req->query)
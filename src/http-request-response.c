@@ -1,6 +1,8 @@
 #include "../include/http-request-response.h"
+#include "../include/http-parser.h"
 
-int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path)
+int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path, const char *extra_headers,
+                      int keep_alive, Deadline *deadline)
 {
     char request[2048];
     int len = snprintf(
@@ -12,9 +14,10 @@ int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path)
         "Accept: */*\r\n"
         "Accept-Encoding: identity\r\n"
         "Referer: https://%s\r\n"
-        "Connection: close\r\n"
+        "%s"
+        "Connection: %s\r\n"
         "\r\n",
-        path, host, host);
+        path, host, host, extra_headers ? extra_headers : "", keep_alive ? "keep-alive" : "close");
 
     if ((size_t)len >= sizeof(request))
     {
@@ -22,6 +25,8 @@ int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path)
         return -1;
     }
 
+    // sending the request counts against the wait for the response head
+    long until = phase_deadline(deadline, PHASE_HEADER);
     int sent = 0;
     while (sent < len)
     {
@@ -29,10 +34,14 @@ int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path)
         if (ssl)
         {
             n = SSL_write(ssl, request + sent, len - sent);
+            if (n <= 0 && wait_ssl(deadline, ssl, n, until) == 1)
+                continue;
         }
         else
         {
             n = send(sockfd, request + sent, len - sent, 0);
+            if (n < 0 && (errno == EINTR || (errno == EAGAIN && wait_fd(deadline, sockfd, POLLOUT, until) == 1)))
+                continue;
         }
 
         if (n <= 0)
@@ -47,144 +56,341 @@ int send_http_request(int sockfd, SSL *ssl, const char *host, const char *path)
     return sent;
 }
 
-char *recv_response(int sockfd, SSL *ssl, size_t *out_len)
+// one read from the origin, through tls when ssl is set, waiting till until
+// for something to arrive, -1 with errno ETIMEDOUT when nothing did
+static ssize_t recv_upstream(int sockfd, SSL *ssl, char *buf, size_t size, Deadline *deadline, long until)
 {
+    // origins writing headers and body separately would otherwise wait out our
+    // delayed ack on a reused connection, the kernel clears the flag as it goes
+    int quickack = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+
+    while (1)
+    {
+        if (ssl)
+        {
+            int n = SSL_read(ssl, buf, size > INT_MAX ? INT_MAX : (int)size);
+            if (n > 0 || SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN)
+                return n;
+
+            int waited = wait_ssl(deadline, ssl, n, until);
+            if (waited == 1)
+                continue;
+            return waited == 0 ? -1 : n;
+        }
+
+        ssize_t n = recv(sockfd, buf, size, 0);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN || wait_fd(deadline, sockfd, POLLIN, until) != 1)
+            return -1;
+    }
+}
+
+char *recv_response_head(int sockfd, SSL *ssl, size_t *out_len, size_t *header_len, Deadline *deadline)
+{
+    long until = phase_deadline(deadline, PHASE_HEADER);
     size_t buffer_size = INITIAL_BUFFER_SIZE;
-    char *buffer = calloc(buffer_size, 1);
+    char *buffer = malloc(buffer_size);
     if (!buffer)
         return NULL;
 
     size_t total_read = 0;
-    int n;
 
     while (1)
     {
+        ssize_t n = recv_upstream(sockfd, ssl, buffer + total_read, buffer_size - total_read, deadline, until);
+        if (n < 0)
+        {
+            perror("recv_response_head");
+            goto fail;
+        }
+
+        if (n == 0)
+        {
+            printf("connection closed before end of headers\n");
+            goto fail;
+        }
+
+        // the blank line may straddle the previous read
+        size_t scan_from = total_read > 3 ? total_read - 3 : 0;
+        total_read += n;
+
+        size_t found = find_http_header_end(buffer + scan_from, total_read - scan_from);
+        if (found)
+        {
+            *header_len = scan_from + found;
+            *out_len = total_read;
+            return buffer;
+        }
+
         // Resize buffer if full
-        if (total_read + 4096 > buffer_size)
+        if (total_read == buffer_size)
         {
+            if (buffer_size >= MAX_RESPONSE_HEAD_SIZE)
+            {
+                printf("response headers too large\n");
+                goto fail;
+            }
+
             buffer_size *= 2;
             char *new_buf = realloc(buffer, buffer_size);
             if (!new_buf)
-            {
-                free(buffer);
-                return NULL;
-            }
+                goto fail;
             buffer = new_buf;
         }
+    }
 
-        // Read data into buffer
-        if (ssl)
-        {
-            n = SSL_read(ssl, buffer + total_read, buffer_size - total_read);
-        }
-        else
+fail:
+    free(buffer);
+    return NULL;
+}
+
+// next bytes of the connection, those that came along with the headers first
+static ssize_t read_stream_bytes(HttpStream *stream, char *buf, size_t size)
+{
+    if (stream->consumed < stream->buffered)
+    {
+        size_t n = MIN(size, stream->buffered - stream->consumed);
+        memcpy(buf, stream->buffer + stream->consumed, n);
+        stream->consumed += n;
+        return n;
+    }
+
+    // the body budget is for each pause, not the whole body
+    ssize_t n = recv_upstream(stream->conn->sockfd, stream->conn->ssl, buf, size, stream->deadline,
+                              phase_deadline(stream->deadline, PHASE_BODY));
+    if (n < 0)
+        perror("read_http_stream");
+
+    return n;
+}
+
+// reads raw bytes and decodes them in place till some data comes out
+static ssize_t read_chunked(HttpStream *stream, char *buf, size_t size)
+{
+    while (!chunk_decoder_done(&stream->decoder))
+    {
+        ssize_t n = read_stream_bytes(stream, buf, size);
+        if (n < 0)
+            return -1;
+
+        if (n == 0)
         {
-            n = recv(sockfd, buffer + total_read, buffer_size - total_read, 0);
+            printf("connection closed before last chunk\n");
+            return -1;
         }
 
-        if (n < 0)
+        size_t consumed;
+        ssize_t decoded = decode_chunked(&stream->decoder, buf, n, &consumed);
+        if (decoded < 0)
         {
-            perror("recv_response");
-            free(buffer);
-            return NULL;
+            printf("malformed chunked body\n");
+            return -1;
         }
 
-        if (n == 0)
-            break; // connection closed
+        // anything past the trailers isn't ours, the connection can't be reused then
+        if (chunk_decoder_done(&stream->decoder))
+            stream->body_done = consumed == (size_t)n && stream->consumed == stream->buffered;
 
-        total_read += n;
+        if (decoded > 0)
+            return decoded;
     }
 
-    *out_len = total_read;
-    return buffer;
+    return 0;
 }
 
-int send_http_response(int sockfd, char *body, size_t body_length, char *content_type)
+// reads by the framing of the body, -1 also when it ended early or was malformed
+static ssize_t read_framed(HttpStream *stream, char *buf, size_t size)
 {
-    char response[512] = {0};
+    if (stream->chunked)
+        return read_chunked(stream, buf, size);
 
-    int len = snprintf(
-        response,
-        sizeof(response) - 1,
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "\r\n",
-        content_type,
-        body_length);
-
-    // sending status line and headers
-    int bytes_sent = 0;
-    if ((bytes_sent = send(sockfd, response, len, 0)) < 0)
+    if (stream->remaining == 0)
     {
-        printf("failed to send headers to client\n");
-        return -1;
+        stream->body_done = stream->consumed == stream->buffered;
+        return 0;
     }
 
-    if ((bytes_sent = send(sockfd, body, body_length, 0)) < 0)
+    if (stream->remaining > 0 && (size_t)stream->remaining < size)
+        size = stream->remaining;
+
+    ssize_t n = read_stream_bytes(stream, buf, size);
+    if (n < 0)
+        return -1;
+
+    // a close before the announced length is a truncated body
+    if (n == 0 && stream->remaining > 0)
     {
-        printf("failed to send body to client\n");
+        printf("connection closed %ld bytes before end of body\n", stream->remaining);
         return -1;
     }
 
-    return bytes_sent;
+    if (stream->remaining > 0)
+        stream->remaining -= n;
+
+    return n;
 }
 
-char *recv_request(int sockfd, size_t *out_len)
+ssize_t read_http_stream(HttpStream *stream, char *buf, size_t size)
 {
-    size_t buffer_size = INITIAL_BUFFER_SIZE;
-    char *buffer = calloc(buffer_size, 1);
+    if (size == 0)
+        return 0;
+
+    // where the connection stands is unknown after a failed read
+    ssize_t n = read_framed(stream, buf, size);
+    if (n < 0)
+        stream->keep_alive = 0;
+
+    return n;
+}
+
+int read_http_stream_body(HttpStream *stream)
+{
+    HttpResponse *res = stream->head;
+
+    // announced length is read in place, else the buffer doubles
+    size_t buffer_size = stream->remaining >= 0 ? (size_t)stream->remaining : INITIAL_BUFFER_SIZE;
+    char *buffer = malloc(buffer_size + 1);
     if (!buffer)
-        return NULL;
+        return -1;
 
     size_t total_read = 0;
 
     while (1)
     {
-        // Resize buffer if full
-        if (total_read + 4096 > buffer_size)
+        if (total_read == buffer_size)
         {
+            if (stream->remaining >= 0)
+                break;
+
             buffer_size *= 2;
-            char *new_buf = realloc(buffer, buffer_size);
+            char *new_buf = realloc(buffer, buffer_size + 1);
             if (!new_buf)
             {
                 free(buffer);
-                return NULL;
+                return -1;
             }
             buffer = new_buf;
         }
 
-        // Read data into buffer
-        int n = recv(sockfd, buffer + total_read, buffer_size - total_read - 1, 0);
-
+        ssize_t n = read_http_stream(stream, buffer + total_read, buffer_size - total_read);
         if (n < 0)
         {
-            perror("recv_response");
             free(buffer);
-            return NULL;
+            return -1;
         }
 
         if (n == 0)
-            break; // connection closed
+            break;
 
         total_read += n;
-        buffer[total_read] = '\0';
+    }
 
-        if (strstr(buffer, "\r\n\r\n") != NULL)
-            break;
+    buffer[total_read] = '\0';
+    res->body = buffer;
+    res->bodyLength = total_read;
+
+    return 0;
+}
+
+void close_http_stream(HttpStream *stream)
+{
+    if (!stream)
+        return;
+
+    // a small unread body, like that of a redirect, is cheaper to skip than a new connection
+    if (stream->conn && stream->keep_alive && !stream->body_done && (stream->chunked || stream->remaining >= 0))
+    {
+        char scratch[4096];
+        size_t drained = 0;
+        ssize_t n;
+        while (drained <= UPSTREAM_DRAIN_MAX && (n = read_http_stream(stream, scratch, sizeof(scratch))) > 0)
+            drained += n;
+    }
+
+    checkin_upstream(stream->conn, stream->keep_alive && stream->body_done);
+
+    if (stream->head)
+    {
+        free_http_response(stream->head);
+        free(stream->head);
+    }
+    free(stream->buffer);
+    free(stream);
+}
+
+int format_response_headers(char *response, size_t size, size_t body_length, const char *content_type)
+{
+    return snprintf(
+        response,
+        size - 1,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        content_type,
+        body_length);
+}
+
+// sends all of data with the flags, waiting up to the body budget each time the client isn't reading
+static int send_bytes(int sockfd, const char *data, size_t length, int flags, Deadline *deadline)
+{
+    size_t sent = 0;
+    while (sent < length)
+    {
+        ssize_t n = send(sockfd, data + sent, length - sent, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN && wait_fd(deadline, sockfd, POLLOUT, phase_deadline(deadline, PHASE_BODY)) == 1)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
     }
 
-    *out_len = total_read;
-    return buffer;
+    return 0;
 }
 
-int send_error_message(int cfd, int status_code, const char *status_message, const char *body)
+int send_http_response_head(int sockfd, long body_length, const char *content_type, Deadline *deadline)
 {
-    char response[1024] = {0};
+    char response[512] = {0};
+    int len;
+
+    if (body_length >= 0)
+        len = format_response_headers(response, sizeof(response), body_length, content_type);
+    else
+        len = snprintf(
+            response,
+            sizeof(response) - 1,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Connection: close\r\n"
+            "\r\n",
+            content_type);
+
+    // headers wait in the socket buffer to go out together with the first body bytes
+    if (send_bytes(sockfd, response, len, MSG_MORE, deadline) < 0)
+    {
+        printf("failed to send headers to client\n");
+        return -1;
+    }
+
+    return len;
+}
 
+int send_all(int sockfd, const char *data, size_t length, Deadline *deadline)
+{
+    return send_bytes(sockfd, data, length, 0, deadline);
+}
+
+int format_error_message(char *buf, size_t size, int status_code, const char *status_message, const char *body)
+{
     int len = snprintf(
-        response,
-        sizeof(response) - 1,
+        buf,
+        size,
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: text/plain\r\n"
         "Content-Length: %zu\r\n"
@@ -195,66 +401,37 @@ int send_error_message(int cfd, int status_code, const char *status_message, con
         strlen(body),
         body);
 
-    if ((size_t)len >= sizeof(response))
-        return -1;
-
-    // returning the no of bytes sent
-    return send(cfd, response, len, 0);
+    return len < 0 || (size_t)len >= size ? -1 : len;
 }
 
-void handle_sending_error(int cfd, int error_code)
+int format_error_response(char *buf, size_t size, int error_code)
 {
     switch (error_code)
     {
     case SERVCONNFAIL:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Failed to Establish Connection with Server");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Failed to Establish Connection with Server");
     case SERVREQFAIL:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Failed to Request to Remote Server");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Failed to Request to Remote Server");
     case SERVRESFAIL:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Failed to Receive Data from Remote Server!\n");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Failed to Receive Data from Remote Server!\n");
     case BADSERVRES:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Bad Response Received from Server");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Bad Response Received from Server");
     case REDIRERR:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Too Many Redirects!");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Too Many Redirects!");
     case CLNTREQFAIL:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Failed to Receive Request From Client");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Failed to Receive Request From Client");
     case BADCLNTREQ:
-    {
-        send_error_message(cfd, 400, "Bad Request", "Invalid Request Received!");
-        break;
-    }
+        return format_error_message(buf, size, 400, "Bad Request", "Invalid Request Received!");
     case MISQRYPRM:
-    {
-        send_error_message(cfd, 400, "Bad Request", "Query Url Must Be Present in this Case!");
-        break;
-    }
+        return format_error_message(buf, size, 400, "Bad Request", "Query Url Must Be Present in this Case!");
     case INTRSERVERR:
-    {
-        send_error_message(cfd, 500, "Internal Server Error", "Something Went Wrong");
-        break;
-    }
+        return format_error_message(buf, size, 500, "Internal Server Error", "Something Went Wrong");
     case BLCKDSITEERR:
-    {
-        send_error_message(cfd, 400, "Site Blocked", "Site is Blocked By Proxy Blocker");
-        break;
+        return format_error_message(buf, size, 400, "Site Blocked", "Site is Blocked By Proxy Blocker");
+    case CLNTTIMEOUT:
+        return format_error_message(buf, size, 408, "Request Timeout", "Request Not Received in Time");
+    case SERVTIMEOUT:
+        return format_error_message(buf, size, 504, "Gateway Timeout", "Remote Server Did Not Respond in Time");
     }
-    }
-}
\ No newline at end of file
+    return -1;
+}
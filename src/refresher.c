@@ -0,0 +1,87 @@
+#include "../include/refresher.h"
+#include "../include/fetch.h"
+
+static void *refresher_thread_func(void *arg)
+{
+    Refresher *refresher = (Refresher *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&refresher->lock);
+
+        // wait until some stale entry needs a refresh
+        while (refresher->count == 0)
+            pthread_cond_wait(&refresher->not_empty, &refresher->lock);
+
+        char *url = refresher->urls[refresher->head];
+        refresher->head = (refresher->head + 1) % REFRESH_QUEUE_SIZE;
+        refresher->count--;
+
+        pthread_mutex_unlock(&refresher->lock);
+
+        refresh_cache_entry(refresher->cache, url, refresher->max_redirects);
+        free(url);
+    }
+
+    return NULL;
+}
+
+Refresher *start_refresher(CacheLRU *cache, int n_threads, int max_redirects)
+{
+    Refresher *refresher = (Refresher *)calloc(1, sizeof(Refresher));
+    if (!refresher)
+        return NULL;
+
+    refresher->cache = cache;
+    refresher->max_redirects = max_redirects;
+    pthread_mutex_init(&refresher->lock, NULL);
+    pthread_cond_init(&refresher->not_empty, NULL);
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, refresher_thread_func, refresher) != 0)
+        {
+            perror("pthread_create");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    cache->refresher = refresher;
+    return refresher;
+}
+
+int enqueue_refresh(Refresher *refresher, const char *url)
+{
+    int status = -1;
+
+    pthread_mutex_lock(&refresher->lock);
+
+    // many hits on the same stale url only need a single refresh
+    for (int i = 0; i < refresher->count; i++)
+    {
+        if (strcmp(refresher->urls[(refresher->head + i) % REFRESH_QUEUE_SIZE], url) == 0)
+        {
+            status = 0;
+            goto unlock;
+        }
+    }
+
+    if (refresher->count == REFRESH_QUEUE_SIZE)
+        goto unlock;
+
+    char *copy = strdup(url);
+    if (!copy)
+        goto unlock;
+
+    refresher->urls[(refresher->head + refresher->count) % REFRESH_QUEUE_SIZE] = copy;
+    refresher->count++;
+    status = 0;
+
+    pthread_cond_signal(&refresher->not_empty);
+
+unlock:
+    pthread_mutex_unlock(&refresher->lock);
+    return status;
+}
@@ -0,0 +1,590 @@
+#include "../include/segment-store.h"
+
+#define SEGMENT_PREFIX "seg-"
+
+// records start 8 byte aligned like the body inside them
+static size_t record_length(uint64_t body_end)
+{
+    return (body_end + 7) & ~(uint64_t)7;
+}
+
+static void get_segment_path(uint32_t id, char *path, size_t size)
+{
+    snprintf(path, size, "%s/" SEGMENT_PREFIX "%08x", SEGMENT_DIR, id);
+}
+
+static void release_segment(Segment *segment)
+{
+    if (atomic_fetch_sub(&segment->refs, 1) != 1)
+        return;
+
+    close(segment->fd);
+    free(segment);
+}
+
+// looks up the segment and retains it, NULL when it doesn't exist
+static Segment *get_segment(SegmentStore *store, uint32_t id)
+{
+    pthread_rwlock_rdlock(&store->table_lock);
+
+    Segment *segment = id < store->capacity ? store->segments[id] : NULL;
+    if (segment)
+        atomic_fetch_add(&segment->refs, 1);
+
+    pthread_rwlock_unlock(&store->table_lock);
+    return segment;
+}
+
+// adds the segment to the table, which owns its first reference
+static int table_put(SegmentStore *store, Segment *segment)
+{
+    pthread_rwlock_wrlock(&store->table_lock);
+
+    if (segment->id >= store->capacity)
+    {
+        size_t new_capacity = store->capacity ? store->capacity : 64;
+        while (segment->id >= new_capacity)
+            new_capacity *= 2;
+
+        Segment **new_segments = realloc(store->segments, new_capacity * sizeof(Segment *));
+        if (!new_segments)
+        {
+            pthread_rwlock_unlock(&store->table_lock);
+            return 0;
+        }
+        memset(new_segments + store->capacity, 0, (new_capacity - store->capacity) * sizeof(Segment *));
+        store->segments = new_segments;
+        store->capacity = new_capacity;
+    }
+
+    store->segments[segment->id] = segment;
+    pthread_rwlock_unlock(&store->table_lock);
+
+    STATS_INC(segments);
+    return 1;
+}
+
+static Segment *alloc_segment(uint32_t id, int fd, size_t used, int sealed)
+{
+    Segment *segment = calloc(1, sizeof(Segment));
+    if (!segment)
+        return NULL;
+
+    segment->id = id;
+    segment->fd = fd;
+    segment->used = used;
+    atomic_init(&segment->refs, 1);
+    atomic_init(&segment->writers, 0);
+    atomic_init(&segment->sealed, sealed);
+    atomic_init(&segment->live, 0);
+    return segment;
+}
+
+// wakes the compactor if the sealed segment holds mostly garbage
+static void maybe_compact(SegmentStore *store, Segment *segment)
+{
+    if (!atomic_load(&segment->sealed) ||
+        atomic_load(&segment->live) * 100 >= segment->used * SEGMENT_COMPACT_LIVE_PERCENT)
+        return;
+
+    pthread_mutex_lock(&store->compact_lock);
+    store->compact_pending = 1;
+    pthread_cond_signal(&store->compact_wake);
+    pthread_mutex_unlock(&store->compact_lock);
+}
+
+// segments of a previous run are sealed, whatever they hold past the last
+// complete record is never read
+static void open_existing_segments(SegmentStore *store)
+{
+    DIR *dir = opendir(SEGMENT_DIR);
+    if (!dir)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        char *end;
+        if (strncmp(de->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) != 0)
+            continue;
+        unsigned long id = strtoul(de->d_name + strlen(SEGMENT_PREFIX), &end, 16);
+        if (*end != '\0' || id == 0 || id >= UINT32_MAX)
+            continue;
+
+        char path[64];
+        get_segment_path(id, path, sizeof(path));
+        int fd = open(path, O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            printf("failed to open segment: %s\n", path);
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        Segment *segment = alloc_segment(id, fd, st.st_size, 1);
+        if (!segment || !table_put(store, segment))
+        {
+            free(segment);
+            close(fd);
+            continue;
+        }
+
+        if (id >= store->next_id)
+            store->next_id = id + 1;
+    }
+    closedir(dir);
+}
+
+SegmentStore *open_segment_store(size_t max_object)
+{
+    SegmentStore *store = calloc(1, sizeof(SegmentStore));
+    if (!store)
+        return NULL;
+
+    store->max_object = max_object < SEGMENT_MAX_OBJECT ? max_object : SEGMENT_MAX_OBJECT;
+    store->next_id = 1;
+    pthread_rwlock_init(&store->table_lock, NULL);
+    pthread_mutex_init(&store->append_lock, NULL);
+    pthread_mutex_init(&store->compact_lock, NULL);
+    pthread_cond_init(&store->compact_wake, NULL);
+
+    mkdir(SEGMENT_DIR, 0700);
+    open_existing_segments(store);
+
+    return store;
+}
+
+int segment_accepts(SegmentStore *store, size_t data_len)
+{
+    return store && data_len <= store->max_object;
+}
+
+// creates and preallocates the next segment, caller must hold append lock
+static Segment *new_segment(SegmentStore *store)
+{
+    uint32_t id = store->next_id++;
+    char path[64];
+    get_segment_path(id, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        printf("failed to create segment: %s\n", path);
+        return NULL;
+    }
+
+    // reserved up front so appends never extend the file or fragment it
+    if (posix_fallocate(fd, 0, SEGMENT_SIZE) != 0)
+    {
+        printf("failed to preallocate segment: %s\n", path);
+        goto catch;
+    }
+
+    Segment *segment = alloc_segment(id, fd, 0, 0);
+    if (!segment)
+        goto catch;
+    if (!table_put(store, segment))
+    {
+        free(segment);
+        goto catch;
+    }
+
+    return segment;
+
+catch:
+    close(fd);
+    unlink(path);
+    return NULL;
+}
+
+// reserves length bytes in the active segment, sealing it when full, returns
+// the segment retained and pinned
+static Segment *reserve_record(SegmentStore *store, size_t length, SegmentLoc *loc)
+{
+    pthread_mutex_lock(&store->append_lock);
+
+    Segment *segment = store->active;
+    if (!segment || segment->used + length > SEGMENT_SIZE)
+    {
+        if (segment)
+        {
+            atomic_store(&segment->sealed, 1);
+            maybe_compact(store, segment);
+        }
+
+        segment = store->active = new_segment(store);
+        if (!segment)
+        {
+            pthread_mutex_unlock(&store->append_lock);
+            return NULL;
+        }
+    }
+
+    loc->segment = segment->id;
+    loc->offset = segment->used;
+    segment->used += length;
+    atomic_fetch_add(&segment->refs, 1);
+    atomic_fetch_add(&segment->writers, 1);
+
+    pthread_mutex_unlock(&store->append_lock);
+    return segment;
+}
+
+// writes a complete record to a fresh place in the active segment
+static int append_record(SegmentStore *store, const char *record, size_t length, SegmentLoc *loc)
+{
+    if (length > SEGMENT_SIZE)
+        return 0;
+
+    Segment *segment = reserve_record(store, length, loc);
+    if (!segment)
+        return 0;
+
+    // appends to the same segment run in parallel, each into its own range
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = pwrite(segment->fd, record + written, length - written, loc->offset + written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            goto catch;
+        written += n;
+    }
+
+    if (get_cache_fsync_policy() != CACHE_FSYNC_NONE && fdatasync(segment->fd) != 0)
+        goto catch;
+
+    release_segment(segment);
+    return 1;
+
+catch:
+    printf("failed to append to segment %u\n", segment->id);
+    atomic_fetch_sub(&segment->writers, 1);
+    release_segment(segment);
+    return 0;
+}
+
+int segment_append(SegmentStore *store, const char *url, int status_code, const char *content_type,
+                   const CacheMeta *meta, const char *data, size_t data_len, SegmentLoc *loc, size_t *length)
+{
+    CacheObjectHeader header;
+    char metadata[CACHE_OBJECT_MAX_METADATA];
+    const char *body;
+    char *encoded;
+    size_t metadata_len = encode_cache_object_header(&header, metadata, url, status_code, content_type,
+                                                     meta, data, data_len, &body, &encoded);
+    if (!metadata_len)
+        return 0;
+
+    // one buffer so the record goes out in a single write
+    size_t record_len = record_length(header.body_offset + header.body_len);
+    char *record = calloc(1, record_len);
+    if (!record)
+    {
+        free(encoded);
+        return 0;
+    }
+
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), metadata, metadata_len);
+    memcpy(record + header.body_offset, body, header.body_len);
+    free(encoded);
+
+    int ok = append_record(store, record, record_len, loc);
+    free(record);
+
+    if (ok)
+        *length = record_len;
+    return ok;
+}
+
+void segment_unpin(SegmentStore *store, SegmentLoc loc)
+{
+    Segment *segment = get_segment(store, loc.segment);
+    if (!segment)
+        return;
+
+    // a segment sealed while this record was in flight may be waiting for it
+    atomic_fetch_sub(&segment->writers, 1);
+    maybe_compact(store, segment);
+    release_segment(segment);
+}
+
+// reads length bytes at offset, 0 on a short read
+static int read_range(Segment *segment, char *buf, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = pread(segment->fd, buf + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+// checks the header and metadata of a record read whole into buf
+static int check_record(CacheObjectHeader *header, const char *buf, size_t length, const char *name)
+{
+    if (length < sizeof(CacheObjectHeader))
+        return 0;
+
+    memcpy(header, buf, sizeof(CacheObjectHeader));
+    if (!check_cache_object_header(header, name))
+        return 0;
+
+    if (header->body_offset + header->body_len > length)
+    {
+        printf("truncated cache object: %s\n", name);
+        return 0;
+    }
+
+    return check_cache_object_metadata(header, buf + sizeof(CacheObjectHeader), name);
+}
+
+CacheObject *segment_read(SegmentStore *store, SegmentLoc loc, size_t length, const char *url)
+{
+    Segment *segment = get_segment(store, loc.segment);
+    if (!segment)
+        return NULL;
+
+    CacheObject *object = NULL;
+    char name[64];
+    snprintf(name, sizeof(name), SEGMENT_PREFIX "%08x@%u", loc.segment, loc.offset);
+
+    // whole record in one read, no open or stat per hit
+    char *record = malloc(length);
+    if (!record || !read_range(segment, record, length, loc.offset))
+    {
+        printf("failed to read cache object: %s\n", name);
+        goto cleanup;
+    }
+
+    CacheObjectHeader header;
+    if (!check_record(&header, record, length, name))
+        goto cleanup;
+
+    const char *metadata = record + sizeof(CacheObjectHeader);
+    if (url && !cache_object_url_matches(&header, metadata, url))
+    {
+        printf("cache key collision: %s\n", name);
+        goto cleanup;
+    }
+
+    const char *body = record + header.body_offset;
+    if (crc32c(0, body, header.body_len) != header.body_crc)
+    {
+        printf("cache object body checksum mismatch: %s\n", name);
+        goto cleanup;
+    }
+
+    char content_type[CACHE_OBJECT_MAX_FIELD + 1];
+    memcpy(content_type, metadata + header.url_len, header.content_type_len);
+    content_type[header.content_type_len] = '\0';
+
+    object = alloc_cache_object(content_type, cache_object_raw_len(&header));
+    if (object && !decode_cache_body(header.codec, content_type, body, header.body_len, object->body, object->length))
+    {
+        printf("failed to decode cache object: %s\n", name);
+        release_cache_object(object);
+        object = NULL;
+    }
+
+cleanup:
+    free(record);
+    release_segment(segment);
+    return object;
+}
+
+int segment_exists(SegmentStore *store, SegmentLoc loc)
+{
+    Segment *segment = get_segment(store, loc.segment);
+    if (segment)
+        release_segment(segment);
+
+    return segment != NULL;
+}
+
+void segment_mark_live(SegmentStore *store, SegmentLoc loc, size_t length)
+{
+    Segment *segment = get_segment(store, loc.segment);
+    if (!segment)
+        return;
+
+    atomic_fetch_add(&segment->live, length);
+    release_segment(segment);
+}
+
+void segment_release(SegmentStore *store, SegmentLoc loc, size_t length)
+{
+    Segment *segment = get_segment(store, loc.segment);
+    if (!segment)
+        return;
+
+    atomic_fetch_sub(&segment->live, length);
+    maybe_compact(store, segment);
+    release_segment(segment);
+}
+
+// sealed segment with the smallest share of live bytes under the threshold,
+// retained, NULL when none needs compacting
+static Segment *pick_victim(SegmentStore *store)
+{
+    Segment *victim = NULL;
+    pthread_rwlock_rdlock(&store->table_lock);
+
+    for (size_t i = 0; i < store->capacity; i++)
+    {
+        Segment *segment = store->segments[i];
+        if (!segment || !atomic_load(&segment->sealed) || atomic_load(&segment->writers) > 0)
+            continue;
+
+        size_t live = atomic_load(&segment->live);
+        if (live * 100 >= segment->used * SEGMENT_COMPACT_LIVE_PERCENT)
+            continue;
+
+        if (!victim || live * victim->used < atomic_load(&victim->live) * segment->used)
+            victim = segment;
+    }
+
+    if (victim)
+        atomic_fetch_add(&victim->refs, 1);
+
+    pthread_rwlock_unlock(&store->table_lock);
+    return victim;
+}
+
+// drops the segment from the table and the disk, reads running on it finish
+// on the open fd
+static void remove_segment(SegmentStore *store, Segment *segment)
+{
+    pthread_rwlock_wrlock(&store->table_lock);
+    store->segments[segment->id] = NULL;
+    pthread_rwlock_unlock(&store->table_lock);
+
+    char path[64];
+    get_segment_path(segment->id, path, sizeof(path));
+    unlink(path);
+
+    STATS_SUB(segments, 1);
+    release_segment(segment);
+}
+
+// copies the records still indexed to the active segment and removes the
+// segment, 0 when a copy failed and the segment has to stay
+static int compact_segment(SegmentStore *store, Segment *segment)
+{
+    size_t moved = 0;
+    uint64_t offset = 0;
+    char name[64];
+
+    // records are walked in the order they were appended, the first one that
+    // doesn't parse is where the appends stopped
+    while (offset + sizeof(CacheObjectHeader) <= segment->used && atomic_load(&segment->live) > 0)
+    {
+        snprintf(name, sizeof(name), SEGMENT_PREFIX "%08x@%lu", segment->id, (unsigned long)offset);
+
+        CacheObjectHeader header;
+        if (!read_range(segment, (char *)&header, sizeof(header), offset) ||
+            header.magic != CACHE_OBJECT_MAGIC || !check_cache_object_header(&header, name))
+            break;
+
+        size_t length = record_length(header.body_offset + header.body_len);
+        if (offset + length > segment->used)
+            break;
+
+        char *record = malloc(length);
+        if (!record || !read_range(segment, record, length, offset) || !check_record(&header, record, length, name))
+        {
+            free(record);
+            break;
+        }
+
+        char url[CACHE_OBJECT_MAX_URL + 1];
+        memcpy(url, record + sizeof(CacheObjectHeader), header.url_len);
+        url[header.url_len] = '\0';
+
+        SegmentLoc from = {.segment = segment->id, .offset = offset};
+        char *key = get_cache_key(url);
+        if (key && store->is_live(store->arg, key, from))
+        {
+            SegmentLoc to;
+            if (!append_record(store, record, length, &to))
+            {
+                free(key);
+                free(record);
+                return 0;
+            }
+
+            // entry may have changed since it was checked, the copy is garbage then
+            if (store->relocate(store->arg, key, from, to))
+                moved += length;
+            segment_unpin(store, to);
+        }
+
+        free(key);
+        free(record);
+        offset += length;
+    }
+
+    STATS_INC(segment_compactions);
+    STATS_ADD(segment_bytes_moved, moved);
+    remove_segment(store, segment);
+    return 1;
+}
+
+static void *compactor_thread_func(void *arg)
+{
+    SegmentStore *store = (SegmentStore *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&store->compact_lock);
+        while (!store->compact_pending)
+            pthread_cond_wait(&store->compact_wake, &store->compact_lock);
+        store->compact_pending = 0;
+        pthread_mutex_unlock(&store->compact_lock);
+
+        Segment *victim;
+        while ((victim = pick_victim(store)) != NULL)
+        {
+            int ok = compact_segment(store, victim);
+            release_segment(victim);
+
+            // out of space for the copies, retried on the next wake up
+            if (!ok)
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+int start_segment_compactor(SegmentStore *store,
+                            int (*is_live)(void *arg, const char *key, SegmentLoc loc),
+                            int (*relocate)(void *arg, const char *key, SegmentLoc from, SegmentLoc to),
+                            void *arg)
+{
+    store->is_live = is_live;
+    store->relocate = relocate;
+    store->arg = arg;
+
+    // segments of the previous run that are mostly garbage go first
+    store->compact_pending = 1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compactor_thread_func, store) != 0)
+    {
+        perror("pthread_create");
+        return 0;
+    }
+    pthread_detach(thread);
+
+    return 1;
+}
@@ -75,10 +75,80 @@ void start_server(int port, const char *ip)
     ensure_cache_dir();
 
     // create the cache list from cache dir
-    CacheLRU *cache = init_cache_lru(MAX_CACHE_SIZE);
+    size_t mem_bytes = get_env_size("CACHE_MEM_BYTES", DEFAULT_CACHE_MEM_BYTES);
+    size_t disk_bytes = get_env_size("CACHE_DISK_BYTES", DEFAULT_CACHE_DISK_BYTES);
+
+    const char *policy_name = getenv("CACHE_POLICY");
+    const CachePolicy *policy = get_cache_policy(policy_name ? policy_name : DEFAULT_CACHE_POLICY);
+    if (!policy)
+    {
+        fprintf(stderr, "unknown cache policy: %s\n", policy_name);
+        exit(EXIT_FAILURE);
+    }
+    printf("cache policy: %s\n", policy->name);
+
+    CacheFsyncPolicy fsync_policy = DEFAULT_CACHE_FSYNC;
+    const char *fsync_name = getenv("CACHE_FSYNC");
+    if (fsync_name && !parse_cache_fsync_policy(fsync_name, &fsync_policy))
+    {
+        fprintf(stderr, "unknown cache fsync policy: %s\n", fsync_name);
+        exit(EXIT_FAILURE);
+    }
+
+    CacheConfig cache_config = {
+        .mem_max_bytes = mem_bytes,
+        .disk_max_bytes = disk_bytes,
+        .policy = policy,
+        .stale_while_revalidate = get_env_size("CACHE_STALE_GRACE", DEFAULT_CACHE_STALE_GRACE),
+        .stale_if_error = get_env_size("CACHE_STALE_IF_ERROR", DEFAULT_CACHE_STALE_IF_ERROR),
+        .fsync_policy = fsync_policy,
+        .segment_max_object = get_env_size("CACHE_SEGMENT_OBJECT_MAX", DEFAULT_CACHE_SEGMENT_OBJECT_MAX),
+        .compress_level = (int)get_env_size("CACHE_COMPRESS_LEVEL", DEFAULT_CACHE_COMPRESS_LEVEL),
+        .max_object_bytes = get_env_size("CACHE_OBJECT_MAX", DEFAULT_CACHE_OBJECT_MAX)};
+
+    CacheLRU *cache = init_cache_lru(&cache_config);
     if (!cache)
         exit(EXIT_FAILURE);
 
+    // misses hand their body to writer threads instead of writing it before the send
+    WriteFullPolicy write_full_policy = DEFAULT_CACHE_WRITE_FULL;
+    const char *write_full_name = getenv("CACHE_WRITE_FULL");
+    if (write_full_name && !parse_write_full_policy(write_full_name, &write_full_policy))
+    {
+        fprintf(stderr, "unknown cache write full policy: %s\n", write_full_name);
+        exit(EXIT_FAILURE);
+    }
+    start_write_behind(cache, get_env_size("CACHE_WRITE_QUEUE", DEFAULT_CACHE_WRITE_QUEUE),
+                       get_env_size("CACHE_WRITE_THREADS", DEFAULT_CACHE_WRITE_THREADS), write_full_policy);
+
+    // one tls context for all origins, sessions are resumed on new connections
+    if (init_ssl_client() < 0)
+        fprintf(stderr, "failed to create tls client context\n");
+
+    // no client or origin can hold a worker past these
+    TimeoutConfig timeouts = {
+        .connect_ms = get_env_size("CONNECT_TIMEOUT_MS", DEFAULT_CONNECT_TIMEOUT_MS),
+        .tls_ms = get_env_size("TLS_TIMEOUT_MS", DEFAULT_TLS_TIMEOUT_MS),
+        .header_ms = get_env_size("HEADER_TIMEOUT_MS", DEFAULT_HEADER_TIMEOUT_MS),
+        .body_ms = get_env_size("BODY_TIMEOUT_MS", DEFAULT_BODY_TIMEOUT_MS),
+        .write_ms = get_env_size("CACHE_WRITE_TIMEOUT_MS", DEFAULT_CACHE_WRITE_TIMEOUT_MS),
+        .total_ms = get_env_size("REQUEST_TIMEOUT_MS", DEFAULT_REQUEST_TIMEOUT_MS)};
+    set_timeouts(&timeouts);
+
+    // origin names are resolved once per ttl, the server is DNS_SERVER or the first of /etc/resolv.conf
+    init_dns_resolver(getenv("DNS_SERVER"), get_env_size("DNS_TTL_MIN", DEFAULT_DNS_TTL_MIN),
+                      get_env_size("DNS_TTL_MAX", DEFAULT_DNS_TTL_MAX),
+                      get_env_size("DNS_NEGATIVE_TTL", DEFAULT_DNS_NEGATIVE_TTL));
+
+    // misses to the same origin reuse its connections instead of a new handshake each
+    start_upstream_pool(get_env_size("UPSTREAM_MAX_IDLE", DEFAULT_UPSTREAM_MAX_IDLE),
+                        get_env_size("UPSTREAM_MAX_PER_HOST", DEFAULT_UPSTREAM_MAX_PER_HOST),
+                        get_env_size("UPSTREAM_IDLE_TIMEOUT", DEFAULT_UPSTREAM_IDLE_TIMEOUT));
+
+    // refreshes entries served stale so clients never wait on the origin for them
+    if (!start_refresher(cache, REFRESHER_THREADS, MAX_REDIRECTS_ALLOWED))
+        fprintf(stderr, "failed to start cache refresher\n");
+
     // getting blocked sites
     char *blocked_sites[MAX_BLOCKED_SITES];
     int n_of_b_sites = get_blocked_sites(blocked_sites, MAX_BLOCKED_SITES);
@@ -87,18 +157,14 @@ void start_server(int port, const char *ip)
     ClientQueue client_queue;
     init_client_queue(&client_queue);
 
-    // create the cache lock var
-    pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
-
     // a context which will be shared across threads
     SharedContext shared_ctx = {.blocked_sites = blocked_sites,
                                 .cache = cache,
-                                .cache_lock = &cache_lock,
                                 .client_queue = &client_queue,
                                 .n_of_b_sites = n_of_b_sites};
 
-    // initialize the thread pool
-    init_thread_pool(&shared_ctx);
+    // misses are fetched by the pool, the loops hand them over and write the responses
+    init_thread_pool(&shared_ctx, (int)get_env_size("WORKER_THREADS", DEFAULT_WORKER_THREADS));
 
     // ignore server crash if client disconnects in between
     signal(SIGPIPE, SIG_IGN);
@@ -106,24 +172,25 @@ void start_server(int port, const char *ip)
     // gracefully shutdown the server on ctrl+c
     signal(SIGINT, server_shutdown_handler);
 
-    while (1)
+    IoBackend io_backend = DEFAULT_IO_BACKEND;
+    const char *io_backend_name = getenv("IO_BACKEND");
+    if (io_backend_name && !parse_io_backend(io_backend_name, &io_backend))
     {
-        struct sockaddr_in client_addr = {0};
-        socklen_t addrlen = sizeof(client_addr);
-
-        // print current cache
-        print_cache_list(cache);
+        fprintf(stderr, "unknown io backend: %s\n", io_backend_name);
+        exit(EXIT_FAILURE);
+    }
 
-        // accept the upcoming client
-        int client_fd = accept(sfd, (struct sockaddr *)&client_addr, &addrlen);
+    // every open client holds an fd, allow as many as the hard limit
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &fd_limit) < 0)
+            perror("setrlimit");
+    }
 
-        if (client_fd < 0)
-        {
-            perror("accept");
-            continue;
-        }
+    print_cache_list(cache);
 
-        // add the client to queue
-        enqueue_client(&client_queue, client_fd);
-    }
+    // clients are taken and served by the loops, never returns
+    run_event_loops(sfd, (int)get_env_size("EVENT_LOOPS", DEFAULT_EVENT_LOOPS), io_backend, &shared_ctx);
 }
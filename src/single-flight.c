@@ -0,0 +1,148 @@
+#include "../include/single-flight.h"
+#include "../include/http-parser.h"
+
+// drops one reference, frees the call on last one, caller must hold table lock
+static void release_call(InflightCall *call)
+{
+    if (--call->refs > 0)
+        return;
+
+    if (call->res)
+    {
+        free_http_response(call->res);
+        free(call->res);
+    }
+    pthread_cond_destroy(&call->finished);
+    free(call->key);
+    free(call);
+}
+
+void init_inflight_table(InflightTable *table)
+{
+    memset(table->buckets, 0, sizeof(table->buckets));
+    pthread_mutex_init(&table->lock, NULL);
+}
+
+void free_inflight_table(InflightTable *table)
+{
+    pthread_mutex_destroy(&table->lock);
+}
+
+InflightCall *inflight_join(InflightTable *table, const char *key, int *is_leader)
+{
+    *is_leader = 0;
+
+    size_t bucket = hash_string(key) % INFLIGHT_BUCKETS;
+
+    pthread_mutex_lock(&table->lock);
+
+    // someone is already fetching this key, wait on it
+    for (InflightCall *call = table->buckets[bucket]; call; call = call->next)
+    {
+        if (strcmp(call->key, key) == 0)
+        {
+            call->refs++;
+            pthread_mutex_unlock(&table->lock);
+            return call;
+        }
+    }
+
+    InflightCall *call = calloc(1, sizeof(InflightCall));
+    if (!call || !(call->key = strdup(key)))
+    {
+        free(call);
+        pthread_mutex_unlock(&table->lock);
+        return NULL;
+    }
+
+    call->refs = 1;
+    pthread_cond_init(&call->finished, NULL);
+
+    call->next = table->buckets[bucket];
+    table->buckets[bucket] = call;
+
+    pthread_mutex_unlock(&table->lock);
+
+    *is_leader = 1;
+    return call;
+}
+
+// unlinks the finished call and wakes up its followers
+static void finish_call(InflightTable *table, InflightCall *call, const struct HttpResponse *res, int abandoned)
+{
+    if (!call)
+        return;
+
+    size_t bucket = hash_string(call->key) % INFLIGHT_BUCKETS;
+
+    pthread_mutex_lock(&table->lock);
+
+    // unlinking, new misses from now on start a fresh fetch
+    InflightCall **pp = &table->buckets[bucket];
+    while (*pp && *pp != call)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = call->next;
+
+    // followers need their own copy as leader frees its response after sending
+    if (res && call->refs > 1)
+        call->res = copy_http_response(res);
+
+    call->abandoned = abandoned;
+    call->done = 1;
+    pthread_cond_broadcast(&call->finished);
+
+    release_call(call);
+    pthread_mutex_unlock(&table->lock);
+}
+
+void inflight_complete(InflightTable *table, InflightCall *call, const struct HttpResponse *res)
+{
+    finish_call(table, call, res, 0);
+}
+
+void inflight_abandon(InflightTable *table, InflightCall *call)
+{
+    finish_call(table, call, NULL, 1);
+}
+
+void inflight_leave(InflightTable *table, InflightCall *call)
+{
+    if (!call)
+        return;
+
+    pthread_mutex_lock(&table->lock);
+    release_call(call);
+    pthread_mutex_unlock(&table->lock);
+}
+
+struct HttpResponse *inflight_wait(InflightTable *table, InflightCall *call, int *abandoned, Deadline *deadline)
+{
+    if (!call)
+        return NULL;
+
+    pthread_mutex_lock(&table->lock);
+
+    // the leader's fetch has its own deadline, ours may end earlier
+    while (!call->done)
+    {
+        if (!wait_cond(deadline, &call->finished, &table->lock, deadline ? deadline->end_ms : 0))
+        {
+            release_call(call);
+            pthread_mutex_unlock(&table->lock);
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    // result is immutable once done and kept alive by our reference
+    HttpResponse *res = call->res ? copy_http_response(call->res) : NULL;
+    if (abandoned)
+        *abandoned = call->abandoned;
+
+    pthread_mutex_lock(&table->lock);
+    release_call(call);
+    pthread_mutex_unlock(&table->lock);
+
+    return res;
+}
@@ -1,89 +1,394 @@
 #include "../include/socket-utils.h"
 #include "../include/fetch.h"
 
-int open_connection(const char *host, const char *port)
+// address of each origin that last won the connect race, direct mapped by the
+// hash of "host:port", a collision only costs the order of the next race
+typedef struct
 {
-    struct addrinfo hints, *res, *p;
-    int sockfd = -1;
+    uint64_t key_hash;
+    DnsAddress addr;
+} ConnectMemorySlot;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP
+static ConnectMemorySlot connect_slots[CONNECT_MEMORY_SLOTS];
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (getaddrinfo(host, port, &hints, &res) != 0)
+static int same_address(const DnsAddress *a, const DnsAddress *b)
+{
+    if (a->addr.ss_family != b->addr.ss_family)
+        return 0;
+    if (a->addr.ss_family == AF_INET)
+        return memcmp(&((struct sockaddr_in *)&a->addr)->sin_addr, &((struct sockaddr_in *)&b->addr)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+    return memcmp(&((struct sockaddr_in6 *)&a->addr)->sin6_addr, &((struct sockaddr_in6 *)&b->addr)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+}
+
+// puts the address that won last time first, then alternates the families
+// starting with its family, or ipv6 when there's no winner yet (RFC 8305)
+static void order_addresses(DnsAddress *addrs, int n, uint64_t key_hash)
+{
+    DnsAddress sorted[DNS_MAX_ADDRS];
+    DnsAddress remembered;
+    int n_sorted = 0, has_remembered = 0;
+
+    pthread_mutex_lock(&connect_lock);
+    ConnectMemorySlot *slot = &connect_slots[key_hash % CONNECT_MEMORY_SLOTS];
+    if (slot->key_hash == key_hash && slot->addr.len)
+    {
+        remembered = slot->addr;
+        has_remembered = 1;
+    }
+    pthread_mutex_unlock(&connect_lock);
+
+    int family = AF_INET6;
+    for (int i = 0; has_remembered && i < n; i++)
+    {
+        if (same_address(&addrs[i], &remembered))
+        {
+            sorted[n_sorted++] = addrs[i];
+            family = addrs[i].addr.ss_family;
+            addrs[i].len = 0; // taken
+            break;
+        }
+    }
+
+    int next[2] = {0, 0}; // next index of the preferred and the other family
+    while (n_sorted < n)
+    {
+        for (int turn = 0; turn < 2 && n_sorted < n; turn++)
+        {
+            int want_preferred = turn == 0;
+            while (next[turn] < n && (!addrs[next[turn]].len ||
+                                      (addrs[next[turn]].addr.ss_family == family) != want_preferred))
+                next[turn]++;
+            if (next[turn] < n)
+                sorted[n_sorted++] = addrs[next[turn]++];
+        }
+    }
+
+    memcpy(addrs, sorted, n * sizeof(DnsAddress));
+}
+
+static void remember_address(uint64_t key_hash, const DnsAddress *addr)
+{
+    pthread_mutex_lock(&connect_lock);
+    ConnectMemorySlot *slot = &connect_slots[key_hash % CONNECT_MEMORY_SLOTS];
+    slot->key_hash = key_hash;
+    slot->addr = *addr;
+    pthread_mutex_unlock(&connect_lock);
+}
+
+// starts a non-blocking connect, -1 when it failed right away
+static int start_connect(const DnsAddress *addr, int *connected)
+{
+    int sockfd = socket(addr->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+        return -1;
+
+    STATS_INC(upstream_connect_attempts);
+    *connected = connect(sockfd, (struct sockaddr *)&addr->addr, addr->len) == 0;
+    if (!*connected && errno != EINPROGRESS)
     {
-        perror("getaddrinfo");
+        close(sockfd);
         return -1;
     }
+    return sockfd;
+}
+
+int open_connection(const char *host, const char *port, Deadline *deadline)
+{
+    DnsAddress addrs[DNS_MAX_ADDRS];
 
-    // Loop through all results and connect to the first we can
-    for (p = res; p != NULL; p = p->ai_next)
+    // resolving counts against connecting
+    long until = phase_deadline(deadline, PHASE_CONNECT);
+    int n_addrs = resolve_host(host, port, addrs, DNS_MAX_ADDRS, deadline, until);
+    if (n_addrs == 0)
     {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1)
-            continue;
+        if (deadline && deadline->expired)
+            fprintf(stderr, "Timed out resolving %s\n", host);
+        else
+            fprintf(stderr, "Failed to resolve %s\n", host);
+        return -1;
+    }
+
+    char key[512];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    uint64_t key_hash = hash_string(key);
+    order_addresses(addrs, n_addrs, key_hash);
+
+    // attempts in flight, a new one starts when the last one had its head start
+    // or as soon as one fails, the first to connect wins and the rest are closed
+    struct pollfd pfds[DNS_MAX_ADDRS];
+    int attempt_addr[DNS_MAX_ADDRS];
+    long attempt_deadline[DNS_MAX_ADDRS];
+    int n_active = 0, next = 0, winner = -1, sockfd = -1;
+    long next_start = monotonic_ms();
+    struct timespec started, connected_at;
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+    while (winner < 0 && (next < n_addrs || n_active > 0))
+    {
+        long now = monotonic_ms();
+        if (until && now >= until)
+            break;
+        if (next < n_addrs && (n_active == 0 || now >= next_start))
         {
-            close(sockfd);
-            sockfd = -1;
+            int connected = 0;
+            int fd = start_connect(&addrs[next], &connected);
+            if (fd != -1)
+            {
+                pfds[n_active] = (struct pollfd){.fd = fd, .events = POLLOUT};
+                attempt_addr[n_active] = next;
+                attempt_deadline[n_active] = now + CONNECT_ATTEMPT_TIMEOUT_MS;
+                if (until && until < attempt_deadline[n_active])
+                    attempt_deadline[n_active] = until;
+                if (connected)
+                    winner = n_active;
+                n_active++;
+                next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            }
+            next++;
             continue;
         }
 
-        break; // success
+        long timeout = next < n_addrs ? next_start - now : CONNECT_ATTEMPT_TIMEOUT_MS;
+        for (int i = 0; i < n_active; i++)
+        {
+            if (attempt_deadline[i] - now < timeout)
+                timeout = attempt_deadline[i] - now;
+        }
+
+        int ready = poll(pfds, n_active, timeout > 0 ? timeout : 0);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        now = monotonic_ms();
+        for (int i = n_active - 1; i >= 0 && winner < 0; i--)
+        {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (pfds[i].revents)
+            {
+                if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)
+                {
+                    winner = i;
+                    break;
+                }
+            }
+            else if (now < attempt_deadline[i])
+                continue;
+
+            // refused, unreachable or timed out, the next address needn't wait any longer
+            close(pfds[i].fd);
+            n_active--;
+            pfds[i] = pfds[n_active];
+            attempt_addr[i] = attempt_addr[n_active];
+            attempt_deadline[i] = attempt_deadline[n_active];
+            next_start = now;
+        }
     }
 
-    freeaddrinfo(res);
+    for (int i = 0; i < n_active; i++)
+    {
+        if (i != winner)
+            close(pfds[i].fd);
+    }
 
-    if (sockfd == -1)
+    if (winner < 0)
     {
-        fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+        // out of budget rather than out of addresses
+        if (until && monotonic_ms() >= until)
+        {
+            if (deadline)
+                deadline->expired = 1;
+            fprintf(stderr, "Timed out connecting to %s:%s\n", host, port);
+        }
+        else
+            fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+        return -1;
     }
 
+    // stays non-blocking, every later wait on it is bounded by the deadline
+    sockfd = pfds[winner].fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &connected_at);
+    STATS_ADD(upstream_connect_us, (connected_at.tv_sec - started.tv_sec) * 1000000L +
+                                       (connected_at.tv_nsec - started.tv_nsec) / 1000);
+    if (attempt_addr[winner] > 0)
+        STATS_INC(upstream_connect_fallbacks);
+    remember_address(key_hash, &addrs[attempt_addr[winner]]);
+
     return sockfd;
 }
 
-// Global one-time init flag
-static int ssl_initialized = 0;
+// one client context for every upstream connection, created once
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+static SSL_CTX *client_ctx;
+
+// ex_data slot of an SSL holding its origin key, so new sessions can be filed
+static int session_key_index = -1;
+
+// last session per origin, direct mapped, a colliding origin takes the slot over
+typedef struct
+{
+    char *key;
+    SSL_SESSION *session;
+} TlsSessionSlot;
+
+static TlsSessionSlot session_slots[TLS_SESSION_CACHE_SLOTS];
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_session_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    (void)parent;
+    (void)ad;
+    (void)idx;
+    (void)argl;
+    (void)argp;
+    free(ptr);
+}
+
+// called when the server issues a session, in tls 1.3 that is after the
+// handshake while reading, a copy is kept as freeing a connection that wasn't
+// shut down cleanly marks its own session unresumable
+static int store_session(SSL *ssl, SSL_SESSION *issued)
+{
+    const char *key = SSL_get_ex_data(ssl, session_key_index);
+    if (!key)
+        return 0;
+
+    char *key_copy = strdup(key);
+    SSL_SESSION *session = SSL_SESSION_dup(issued);
+    if (!key_copy || !session)
+    {
+        free(key_copy);
+        if (session)
+            SSL_SESSION_free(session);
+        return 0;
+    }
+
+    TlsSessionSlot *slot = &session_slots[hash_string(key) % TLS_SESSION_CACHE_SLOTS];
+
+    pthread_mutex_lock(&session_lock);
+    SSL_SESSION *old_session = slot->session;
+    char *old_key = slot->key;
+    slot->session = session;
+    slot->key = key_copy;
+    pthread_mutex_unlock(&session_lock);
 
-SSL *ssl_wrap(int sockfd, const char *hostname, SSL_CTX **out_ctx)
+    if (old_session)
+        SSL_SESSION_free(old_session);
+    free(old_key);
+
+    return 0;
+}
+
+// returns a referenced session for the origin, NULL if none can be resumed
+static SSL_SESSION *find_session(const char *key)
 {
-    if (!ssl_initialized)
+    TlsSessionSlot *slot = &session_slots[hash_string(key) % TLS_SESSION_CACHE_SLOTS];
+    SSL_SESSION *session = NULL;
+
+    pthread_mutex_lock(&session_lock);
+    if (slot->key && strcmp(slot->key, key) == 0 && SSL_SESSION_is_resumable(slot->session))
     {
-        SSL_library_init();
-        SSL_load_error_strings();
-        OpenSSL_add_all_algorithms();
-        ssl_initialized = 1;
+        session = slot->session;
+        SSL_SESSION_up_ref(session);
     }
+    pthread_mutex_unlock(&session_lock);
+
+    return session;
+}
+
+static void init_ssl_client_once(void)
+{
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
 
     SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
     if (!ctx)
     {
         ERR_print_errors_fp(stderr);
-        return NULL;
+        return;
     }
     SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
-    SSL *ssl = SSL_new(ctx);
+    // sessions are kept by origin in our own cache, openssl's is keyed for servers
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, store_session);
+
+    session_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_session_key);
+    client_ctx = ctx;
+}
+
+int init_ssl_client(void)
+{
+    pthread_once(&ssl_once, init_ssl_client_once);
+    return client_ctx ? 0 : -1;
+}
+
+int wait_ssl(Deadline *deadline, SSL *ssl, int ret, long until)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return wait_fd(deadline, SSL_get_fd(ssl), POLLIN, until);
+    case SSL_ERROR_WANT_WRITE:
+        return wait_fd(deadline, SSL_get_fd(ssl), POLLOUT, until);
+    default:
+        return -1;
+    }
+}
+
+SSL *ssl_wrap(int sockfd, const char *hostname, const char *port, Deadline *deadline)
+{
+    if (init_ssl_client() < 0)
+        return NULL;
+
+    SSL *ssl = SSL_new(client_ctx);
     if (!ssl)
     {
         ERR_print_errors_fp(stderr);
-        SSL_CTX_free(ctx);
         return NULL;
     }
 
     SSL_set_fd(ssl, sockfd);
     SSL_set_tlsext_host_name(ssl, hostname); // SNI for modern HTTPS
 
-    int ssl_connect_res = 0;
-    if ((ssl_connect_res = SSL_connect(ssl)) != 1)
+    // sessions are only offered back to the origin that issued them
+    char key[512];
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    SSL_set_ex_data(ssl, session_key_index, strdup(key));
+
+    SSL_SESSION *session = find_session(key);
+    if (session)
+    {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long until = phase_deadline(deadline, PHASE_TLS);
+    int ssl_connect_res;
+    int waited = 1;
+    while ((ssl_connect_res = SSL_connect(ssl)) != 1 &&
+           (waited = wait_ssl(deadline, ssl, ssl_connect_res, until)) == 1)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ssl_connect_res != 1)
     {
+        if (waited == 0)
+            fprintf(stderr, "Timed out in tls handshake with %s:%s\n", hostname, port);
         ERR_print_errors_fp(stderr);
         SSL_free(ssl);
-        SSL_CTX_free(ctx);
         return NULL;
     }
 
-    *out_ctx = ctx;
+    STATS_INC(tls_handshakes);
+    STATS_ADD(tls_handshake_us, (end.tv_sec - start.tv_sec) * 1000000UL + (end.tv_nsec - start.tv_nsec) / 1000);
+    if (SSL_session_reused(ssl))
+        STATS_INC(tls_resumed);
+
     return ssl;
 }
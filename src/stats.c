@@ -0,0 +1,137 @@
+#include "../include/stats.h"
+#include "../include/cache-codec.h"
+
+ProxyStats proxy_stats;
+
+#define STAT(field) atomic_load_explicit(&proxy_stats.field, memory_order_relaxed)
+
+// share of the lookups as a percentage
+static double ratio(unsigned long part, unsigned long total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+char *render_stats(size_t *out_len)
+{
+    size_t size = 4096;
+    char *text = malloc(size);
+    if (!text)
+        return NULL;
+
+    unsigned long requests = STAT(requests);
+    unsigned long mem_hits = STAT(mem_hits);
+    unsigned long disk_hits = STAT(disk_hits);
+    unsigned long tls_handshakes = STAT(tls_handshakes);
+    unsigned long upstream_connects = STAT(upstream_connects);
+
+    int len = snprintf(
+        text, size,
+        "clients_accepted %lu\n"
+        "clients_open %lu\n"
+        "requests %lu\n"
+        "mem_hits %lu\n"
+        "disk_hits %lu\n"
+        "misses %lu\n"
+        "coalesced %lu\n"
+        "revalidated %lu\n"
+        "stale_served %lu\n"
+        "stale_if_error %lu\n"
+        "background_refreshes %lu\n"
+        "writes_queued %lu\n"
+        "writes_dropped %lu\n"
+        "writes_sync %lu\n"
+        "hit_ratio %.2f\n"
+        "mem_hit_ratio %.2f\n"
+        "disk_hit_ratio %.2f\n"
+        "mem_bytes %lu\n"
+        "mem_objects %lu\n"
+        "disk_bytes %lu\n"
+        "disk_objects %lu\n"
+        "evictions %lu\n"
+        "segments %lu\n"
+        "segment_compactions %lu\n"
+        "segment_bytes_moved %lu\n"
+        "upstream_connects %lu\n"
+        "upstream_reused %lu\n"
+        "upstream_retries %lu\n"
+        "upstream_connect_attempts %lu\n"
+        "upstream_connect_fallbacks %lu\n"
+        "upstream_connect_avg_us %lu\n"
+        "tls_handshakes %lu\n"
+        "tls_resumed %lu\n"
+        "tls_resumption_ratio %.2f\n"
+        "tls_handshake_avg_us %lu\n"
+        "dns_lookups %lu\n"
+        "dns_cache_hits %lu\n"
+        "dns_coalesced %lu\n"
+        "dns_queries %lu\n"
+        "dns_fallbacks %lu\n"
+        "dns_failures %lu\n",
+        STAT(clients_accepted),
+        STAT(clients_open),
+        requests,
+        mem_hits,
+        disk_hits,
+        STAT(misses),
+        STAT(coalesced),
+        STAT(revalidated),
+        STAT(stale_served),
+        STAT(stale_if_error),
+        STAT(background_refreshes),
+        STAT(writes_queued),
+        STAT(writes_dropped),
+        STAT(writes_sync),
+        ratio(mem_hits + disk_hits, requests),
+        ratio(mem_hits, requests),
+        ratio(disk_hits, requests),
+        STAT(mem_bytes),
+        STAT(mem_objects),
+        STAT(disk_bytes),
+        STAT(disk_objects),
+        STAT(evictions),
+        STAT(segments),
+        STAT(segment_compactions),
+        STAT(segment_bytes_moved),
+        upstream_connects,
+        STAT(upstream_reused),
+        STAT(upstream_retries),
+        STAT(upstream_connect_attempts),
+        STAT(upstream_connect_fallbacks),
+        upstream_connects ? STAT(upstream_connect_us) / upstream_connects : 0,
+        tls_handshakes,
+        STAT(tls_resumed),
+        ratio(STAT(tls_resumed), tls_handshakes),
+        tls_handshakes ? STAT(tls_handshake_us) / tls_handshakes : 0,
+        STAT(dns_lookups),
+        STAT(dns_cache_hits),
+        STAT(dns_coalesced),
+        STAT(dns_queries),
+        STAT(dns_fallbacks),
+        STAT(dns_failures));
+
+    // how well each content class compresses and what reading it back costs
+    for (int i = 0; i < STATS_CONTENT_CLASSES && len >= 0 && (size_t)len < size; i++)
+    {
+        unsigned long raw_bytes = STAT(compression[i].raw_bytes);
+        unsigned long stored_bytes = STAT(compression[i].stored_bytes);
+        unsigned long decodes = STAT(compression[i].decodes);
+
+        const char *name = content_class_name(i);
+        len += snprintf(text + len, size - len,
+                        "compress_%s_objects %lu\n"
+                        "compress_%s_ratio %.2f\n"
+                        "compress_%s_decode_us %.2f\n",
+                        name, STAT(compression[i].objects),
+                        name, stored_bytes ? (double)raw_bytes / stored_bytes : 0.0,
+                        name, decodes ? STAT(compression[i].decode_ns) / 1000.0 / decodes : 0.0);
+    }
+
+    if (len < 0 || (size_t)len >= size)
+    {
+        free(text);
+        return NULL;
+    }
+
+    *out_len = len;
+    return text;
+}
@@ -18,53 +18,35 @@ void *worker_thread_func(void *arg)
         }
 
         // remove the client from queue
-        int client_sock = dequeue_client(shared_ctx->client_queue);
+        ClientConn *conn = dequeue_client(shared_ctx->client_queue);
+        pthread_mutex_unlock(&(shared_ctx->client_queue->lock));
 
         // when no client then skip
-        if (client_sock < 0)
-        {
-            pthread_mutex_unlock(&(shared_ctx->client_queue->lock));
+        if (!conn)
             continue;
-        }
-
-        ClientHandlerArgs *args = (ClientHandlerArgs *)calloc(1, sizeof(ClientHandlerArgs));
 
-        // re_add to queue if memory allocation failed
-        if (!args)
-        {
-            enqueue_client(shared_ctx->client_queue, client_sock);
-            pthread_mutex_unlock(&(shared_ctx->client_queue->lock));
-            continue;
-        }
-
-        pthread_mutex_unlock(&(shared_ctx->client_queue->lock));
-
-        // initialize client args
-        args->client_fd = client_sock;
-        args->blocked_sites = shared_ctx->blocked_sites;
-        args->cache = shared_ctx->cache;
-        args->cache_lock = shared_ctx->cache_lock;
-        args->n_of_b_sites = shared_ctx->n_of_b_sites;
-
-        handle_client((void *)args);
-
-        free(args);
+        // only misses come here, the loop writes the response once it's ready
+        handle_client_miss(conn, shared_ctx);
+        client_fetched(conn);
     }
 
     return NULL;
 }
 
-void init_thread_pool(SharedContext *shared_ctx)
+void init_thread_pool(SharedContext *shared_ctx, int n)
 {
-    pthread_t threads[THREAD_POOL_SIZE];
+    if (n <= 0)
+        n = THREAD_POOL_SIZE;
 
     // create the exact no of threads with passing shared context to each
-    for (int i = 0; i < THREAD_POOL_SIZE; i++)
+    for (int i = 0; i < n; i++)
     {
-        if (pthread_create(&threads[i], NULL, worker_thread_func, shared_ctx) != 0)
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread_func, shared_ctx) != 0)
         {
             perror("pthread_create");
+            continue;
         }
-        pthread_detach(threads[i]);
+        pthread_detach(thread);
     }
 }
@@ -0,0 +1,276 @@
+#include "../include/upstream-pool.h"
+
+static UpstreamPool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .released = PTHREAD_COND_INITIALIZER,
+};
+
+static void close_upstream(UpstreamConn *conn)
+{
+    if (conn->ssl)
+        SSL_free(conn->ssl);
+    if (conn->sockfd != -1)
+        close(conn->sockfd);
+    free(conn);
+}
+
+// an idle connection has nothing to read, anything readable is the origin
+// closing it or bytes that don't belong to any request
+static int is_upstream_alive(UpstreamConn *conn)
+{
+    if (conn->ssl && SSL_pending(conn->ssl))
+        return 0;
+
+    struct pollfd pfd = {.fd = conn->sockfd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// finds or adds the host entry of the key, caller must hold pool lock
+static UpstreamHost *get_upstream_host(const char *key)
+{
+    size_t bucket = hash_string(key) % UPSTREAM_POOL_BUCKETS;
+
+    for (UpstreamHost *host = pool.buckets[bucket]; host; host = host->next)
+    {
+        if (strcmp(host->key, key) == 0)
+            return host;
+    }
+
+    UpstreamHost *host = calloc(1, sizeof(UpstreamHost));
+    if (!host || !(host->key = strdup(key)))
+    {
+        free(host);
+        return NULL;
+    }
+
+    host->next = pool.buckets[bucket];
+    pool.buckets[bucket] = host;
+    return host;
+}
+
+// whether no connection or checkout refers to the host anymore
+static int is_upstream_host_unused(UpstreamHost *host)
+{
+    return host->n_idle == 0 && host->active == 0 && host->waiting == 0;
+}
+
+// frees the host once unused, so origins seen once don't pile up when no
+// connection is kept idle for the reaper to find, caller must hold pool lock
+static void put_upstream_host(UpstreamHost *host)
+{
+    if (!is_upstream_host_unused(host))
+        return;
+
+    UpstreamHost **hp = &pool.buckets[hash_string(host->key) % UPSTREAM_POOL_BUCKETS];
+    while (*hp && *hp != host)
+        hp = &(*hp)->next;
+    if (*hp)
+        *hp = host->next;
+
+    free(host->key);
+    free(host);
+}
+
+// closes connections idle past the timeout and forgets hosts left without any
+static void *upstream_reaper_func(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        sleep(pool.idle_timeout > 2 ? pool.idle_timeout / 2 : 1);
+
+        UpstreamConn *expired = NULL;
+        time_t now = time(NULL);
+
+        pthread_mutex_lock(&pool.lock);
+        for (int i = 0; i < UPSTREAM_POOL_BUCKETS; i++)
+        {
+            UpstreamHost **hp = &pool.buckets[i];
+            while (*hp)
+            {
+                UpstreamHost *host = *hp;
+
+                // idle list is newest first, everything after the first expired one is too
+                UpstreamConn **cp = &host->idle;
+                while (*cp && now - (*cp)->idle_since < pool.idle_timeout)
+                    cp = &(*cp)->next;
+                while (*cp)
+                {
+                    UpstreamConn *conn = *cp;
+                    *cp = conn->next;
+                    conn->next = expired;
+                    expired = conn;
+                    host->n_idle--;
+                }
+
+                if (is_upstream_host_unused(host))
+                {
+                    *hp = host->next;
+                    free(host->key);
+                    free(host);
+                    continue;
+                }
+                hp = &host->next;
+            }
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        while (expired)
+        {
+            UpstreamConn *next = expired->next;
+            close_upstream(expired);
+            expired = next;
+        }
+    }
+
+    return NULL;
+}
+
+void start_upstream_pool(int max_idle, int max_per_host, time_t idle_timeout)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.max_idle = max_idle;
+    pool.max_per_host = max_per_host;
+    pool.idle_timeout = idle_timeout > 0 ? idle_timeout : 1;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (max_idle <= 0)
+        return;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, upstream_reaper_func, NULL) != 0)
+    {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+int upstream_keep_alive(void)
+{
+    return pool.max_idle > 0;
+}
+
+UpstreamConn *checkout_upstream(const char *scheme, const char *host_name, const char *port, Deadline *deadline)
+{
+    // waiting for a free slot counts against connecting
+    long until = phase_deadline(deadline, PHASE_CONNECT);
+
+    char key[512];
+    snprintf(key, sizeof(key), "%s://%s:%s", scheme, host_name, port);
+
+    pthread_mutex_lock(&pool.lock);
+
+    UpstreamHost *host = get_upstream_host(key);
+    if (!host)
+    {
+        pthread_mutex_unlock(&pool.lock);
+        return NULL;
+    }
+
+    while (1)
+    {
+        // most recently used first, the least likely to have been closed by the origin
+        if (host->idle)
+        {
+            UpstreamConn *conn = host->idle;
+            host->idle = conn->next;
+            host->n_idle--;
+            host->active++;
+            pthread_mutex_unlock(&pool.lock);
+
+            if (time(NULL) - conn->idle_since < pool.idle_timeout && is_upstream_alive(conn))
+            {
+                STATS_INC(upstream_reused);
+                conn->reused = 1;
+                conn->next = NULL;
+                return conn;
+            }
+
+            close_upstream(conn);
+
+            pthread_mutex_lock(&pool.lock);
+            host->active--;
+            pthread_cond_broadcast(&pool.released);
+            continue;
+        }
+
+        if (!pool.max_per_host || host->active < pool.max_per_host)
+            break;
+
+        host->waiting++;
+        int woken = wait_cond(deadline, &pool.released, &pool.lock, until);
+        host->waiting--;
+        if (!woken)
+        {
+            put_upstream_host(host);
+            pthread_mutex_unlock(&pool.lock);
+            printf("timed out waiting for a connection to %s\n", key);
+            return NULL;
+        }
+    }
+
+    // slot is taken before connecting so concurrent misses respect the limit
+    host->active++;
+    pthread_mutex_unlock(&pool.lock);
+
+    UpstreamConn *conn = calloc(1, sizeof(UpstreamConn));
+    if (!conn)
+        goto fail;
+
+    conn->host = host;
+    conn->sockfd = open_connection(host_name, port, deadline);
+    if (conn->sockfd < 0)
+        goto fail;
+
+    // Perform SSL/TLS handshake if needed
+    if (strcmp(scheme, "https") == 0)
+    {
+        conn->ssl = ssl_wrap(conn->sockfd, host_name, port, deadline);
+        if (!conn->ssl)
+            goto fail;
+    }
+
+    STATS_INC(upstream_connects);
+    return conn;
+
+fail:
+    if (conn)
+        close_upstream(conn);
+
+    pthread_mutex_lock(&pool.lock);
+    host->active--;
+    pthread_cond_broadcast(&pool.released);
+    put_upstream_host(host);
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void checkin_upstream(UpstreamConn *conn, int reusable)
+{
+    if (!conn)
+        return;
+
+    UpstreamHost *host = conn->host;
+
+    pthread_mutex_lock(&pool.lock);
+
+    host->active--;
+    int keep = reusable && host->n_idle < pool.max_idle;
+    if (keep)
+    {
+        conn->idle_since = time(NULL);
+        conn->reused = 0;
+        conn->next = host->idle;
+        host->idle = conn;
+        host->n_idle++;
+    }
+
+    pthread_cond_broadcast(&pool.released);
+    put_upstream_host(host);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!keep)
+        close_upstream(conn);
+}
@@ -0,0 +1,621 @@
+#include "../include/uring-loop.h"
+
+#ifdef HAVE_IO_URING
+
+// what a completion of a connection is for, kept in the low bits of its user_data
+enum
+{
+    URING_OP_RECV = 1,
+    URING_OP_SEND_HEAD,
+    URING_OP_SEND_BODY,
+    URING_OP_READ,
+    URING_OP_FILES_UPDATE,
+};
+#define URING_OP_MASK 7UL
+
+// user_data of completions not tied to a connection, below any pointer
+#define URING_UD_IGNORE 0
+#define URING_UD_ACCEPT 8
+#define URING_UD_WAKE 16
+
+typedef struct UringLoop
+{
+    int fd;
+    void *rings;
+    size_t rings_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_filled; // tail of the sqes filled, published on the next enter
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned short buf_tail;
+
+    int free_slots[URING_FILE_SLOTS];
+    int n_free_slots;
+
+    int accept_armed;
+    uint64_t wake_count;
+} UringLoop;
+
+// a cleared slot of the file table
+static const int no_file = -1;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// submits what was filled, and with wait waits up to timeout_ms for a completion
+static void submit_and_wait(UringLoop *u, int wait, long timeout_ms)
+{
+    unsigned to_submit = u->sq_filled - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sq_filled, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {.sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = (uint64_t)(uintptr_t)&ts};
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    if (uring_enter(u->fd, to_submit, wait ? 1 : 0, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY)
+        perror("io_uring_enter");
+}
+
+// makes room for n sqes so a linked chain is never split across two submits
+static void reserve_sqes(UringLoop *u, unsigned n)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_entries - (u->sq_filled - head) < n)
+        submit_and_wait(u, 0, 0);
+}
+
+static struct io_uring_sqe *queue_sqe(UringLoop *u, uint8_t opcode, int fd, uint64_t user_data)
+{
+    reserve_sqes(u, 1);
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_filled & u->sq_mask];
+    u->sq_filled++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+// an op whose completion comes back to conn, which is kept till it does
+static struct io_uring_sqe *queue_conn_op(UringLoop *u, ClientConn *conn, int op, uint8_t opcode, int fd)
+{
+    conn->pending++;
+    return queue_sqe(u, opcode, fd, (uint64_t)(uintptr_t)conn | op);
+}
+
+static void recycle_buffer(UringLoop *u, unsigned short bid)
+{
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void free_ring(UringLoop *u)
+{
+    if (u->buf_ring)
+        munmap(u->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    if (u->sqes)
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if (u->rings)
+        munmap(u->rings, u->rings_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u->bufs);
+    free(u);
+}
+
+// ring bound to the calling thread with its receive buffers and file table registered
+static UringLoop *create_ring(void)
+{
+    UringLoop *u = calloc(1, sizeof(UringLoop));
+    if (!u)
+        return NULL;
+
+    // only this thread submits, completions run when it waits instead of interrupting it
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = URING_ENTRIES * 2;
+    params.flags |= IORING_SETUP_CQSIZE;
+
+    u->fd = uring_setup(URING_ENTRIES, &params);
+    if (u->fd < 0)
+        goto fail;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->rings == MAP_FAILED)
+    {
+        u->rings = NULL;
+        goto fail;
+    }
+
+    u->sq_entries = params.sq_entries;
+    u->sqes = mmap(NULL, u->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    char *rings = (char *)u->rings;
+    u->sq_head = (unsigned *)(rings + params.sq_off.head);
+    u->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    u->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(rings + params.cq_off.head);
+    u->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    u->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    u->sq_filled = *u->sq_tail;
+
+    // sqes are always used in ring order
+    unsigned *sq_array = (unsigned *)(rings + params.sq_off.array);
+    for (unsigned i = 0; i < u->sq_entries; i++)
+        sq_array[i] = i;
+
+    // receive buffers, the kernel picks one for each chunk a client sends
+    u->buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    if (u->buf_ring == MAP_FAILED || !u->bufs)
+    {
+        if (u->buf_ring == MAP_FAILED)
+            u->buf_ring = NULL;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)u->buf_ring,
+        .ring_entries = URING_RECV_BUFFERS,
+        .bgid = URING_BUFFER_GROUP};
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+
+    for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++)
+        recycle_buffer(u, bid);
+
+    // empty file table, cached bodies are put in a slot while they are sent
+    int fds[URING_FILE_SLOTS];
+    for (int i = 0; i < URING_FILE_SLOTS; i++)
+    {
+        fds[i] = -1;
+        u->free_slots[i] = URING_FILE_SLOTS - 1 - i;
+    }
+    u->n_free_slots = URING_FILE_SLOTS;
+    if (uring_register(u->fd, IORING_REGISTER_FILES, fds, URING_FILE_SLOTS) < 0)
+        goto fail;
+
+    return u;
+
+fail:
+    free_ring(u);
+    return NULL;
+}
+
+int uring_supported(void)
+{
+    UringLoop *u = create_ring();
+    if (!u)
+        return 0;
+
+    free_ring(u);
+    return 1;
+}
+
+// one sqe keeps accepting clients till it fails
+static void arm_accept(EventLoop *loop)
+{
+    UringLoop *u = loop->uring;
+    struct io_uring_sqe *sqe = queue_sqe(u, IORING_OP_ACCEPT, loop->listen_fd, URING_UD_ACCEPT);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    u->accept_armed = 1;
+}
+
+// one sqe keeps receiving into the provided buffers till the client closes
+static void arm_recv(UringLoop *u, ClientConn *conn)
+{
+    struct io_uring_sqe *sqe = queue_conn_op(u, conn, URING_OP_RECV, IORING_OP_RECV, conn->fd);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    conn->recv_armed = 1;
+}
+
+static void arm_wake(EventLoop *loop)
+{
+    UringLoop *u = loop->uring;
+    struct io_uring_sqe *sqe = queue_sqe(u, IORING_OP_READ, loop->wake_fd, URING_UD_WAKE);
+    sqe->addr = (uint64_t)(uintptr_t)&u->wake_count;
+    sqe->len = sizeof(u->wake_count);
+}
+
+// stops the ops of conn that wait on its socket, their completions come back
+// cancelled, matched by user_data as matching by fd walks every request of the ring
+static void cancel_conn(UringLoop *u, ClientConn *conn)
+{
+    if (conn->cancelling)
+        return;
+
+    int ops[] = {URING_OP_RECV, URING_OP_SEND_HEAD, URING_OP_SEND_BODY};
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (ops[i] == URING_OP_RECV && !conn->recv_armed)
+            continue;
+        if (ops[i] != URING_OP_RECV && conn->pending == conn->recv_armed)
+            continue;
+
+        struct io_uring_sqe *sqe = queue_sqe(u, IORING_OP_ASYNC_CANCEL, -1, URING_UD_IGNORE);
+        sqe->addr = (uint64_t)(uintptr_t)conn | ops[i];
+    }
+    conn->cancelling = 1;
+}
+
+// nothing is in flight on conn anymore, the socket is closed through the ring too
+static void close_conn(EventLoop *loop, ClientConn *conn)
+{
+    UringLoop *u = loop->uring;
+    if (conn->file_slot >= 0)
+    {
+        struct io_uring_sqe *sqe = queue_sqe(u, IORING_OP_FILES_UPDATE, -1, URING_UD_IGNORE);
+        sqe->addr = (uint64_t)(uintptr_t)&no_file;
+        sqe->len = 1;
+        sqe->off = conn->file_slot;
+        u->free_slots[u->n_free_slots++] = conn->file_slot;
+    }
+
+    queue_sqe(u, IORING_OP_CLOSE, conn->fd, URING_UD_IGNORE);
+    conn->fd = -1;
+
+    unlink_client(loop, conn);
+    free_client_conn(conn);
+    STATS_SUB(clients_open, 1);
+}
+
+// queues the next part of the response as one linked chain: the file slot
+// update the first time, the head while unsent, then a chunk of the body read
+// from its file or memory and sent, -1 when there's no memory for the chunk
+static int queue_write(UringLoop *u, ClientConn *conn)
+{
+    size_t chunk = conn->body_len - conn->body_sent;
+    if (chunk > URING_SEND_CHUNK)
+        chunk = URING_SEND_CHUNK;
+
+    int from_file = chunk && conn->file_fd >= 0;
+    if (from_file && !conn->chunk && !(conn->chunk = malloc(URING_SEND_CHUNK)))
+        return -1;
+
+    reserve_sqes(u, 4);
+    conn->chunk_len = chunk;
+
+    struct io_uring_sqe *sqe = NULL;
+    if (from_file && conn->file_slot < 0 && u->n_free_slots)
+    {
+        conn->file_slot = u->free_slots[--u->n_free_slots];
+        sqe = queue_conn_op(u, conn, URING_OP_FILES_UPDATE, IORING_OP_FILES_UPDATE, -1);
+        sqe->addr = (uint64_t)(uintptr_t)&conn->file_fd;
+        sqe->len = 1;
+        sqe->off = conn->file_slot;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    if (conn->head_sent < conn->head_len)
+    {
+        sqe = queue_conn_op(u, conn, URING_OP_SEND_HEAD, IORING_OP_SEND, conn->fd);
+        sqe->addr = (uint64_t)(uintptr_t)conn->head;
+        sqe->len = conn->head_len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (chunk ? MSG_MORE : 0);
+        if (chunk)
+            sqe->flags = IOSQE_IO_LINK;
+    }
+
+    if (from_file)
+    {
+        int fixed = conn->file_slot >= 0;
+        sqe = queue_conn_op(u, conn, URING_OP_READ, IORING_OP_READ, fixed ? conn->file_slot : conn->file_fd);
+        sqe->addr = (uint64_t)(uintptr_t)conn->chunk;
+        sqe->len = chunk;
+        sqe->off = conn->file_offset + conn->body_sent;
+        sqe->flags = IOSQE_IO_LINK | (fixed ? IOSQE_FIXED_FILE : 0);
+    }
+
+    if (chunk)
+    {
+        sqe = queue_conn_op(u, conn, URING_OP_SEND_BODY, IORING_OP_SEND, conn->fd);
+        sqe->addr = (uint64_t)(uintptr_t)(from_file ? conn->chunk : conn->body + conn->body_sent);
+        sqe->len = chunk;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    }
+
+    return 0;
+}
+
+// moves a connection on after a completion or a state change, it only changes
+// hands or is freed once nothing is in flight on it
+static void advance_conn(EventLoop *loop, ClientConn *conn)
+{
+    UringLoop *u = loop->uring;
+    int writing = conn->pending - conn->recv_armed;
+
+    switch (conn->state)
+    {
+    case CLIENT_READING_REQUEST:
+        if (!conn->recv_armed && !conn->cancelling)
+            arm_recv(u, conn);
+        return;
+
+    case CLIENT_FETCHING:
+        // a worker owns it till client_fetched, the recv is stopped first
+        if (conn->pending)
+        {
+            cancel_conn(u, conn);
+            return;
+        }
+        unlink_client(loop, conn);
+        enqueue_client(loop->ctx->client_queue, conn);
+        return;
+
+    case CLIENT_WRITING_RESPONSE:
+        if (writing)
+            return;
+
+        if (conn->head_sent < conn->head_len || conn->body_sent < conn->body_len)
+        {
+            if (!conn->head_sent)
+                conn->io_deadline = phase_deadline(&conn->deadline, PHASE_BODY);
+            if (queue_write(u, conn) == 0)
+                return;
+        }
+        conn->state = CLIENT_CLOSING;
+        break;
+
+    default:
+        break;
+    }
+
+    if (conn->pending)
+        cancel_conn(u, conn);
+    else
+        close_conn(loop, conn);
+}
+
+static void complete_recv(EventLoop *loop, ClientConn *conn, struct io_uring_cqe *cqe)
+{
+    UringLoop *u = loop->uring;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        conn->recv_armed = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && conn->state == CLIENT_READING_REQUEST)
+            client_received(conn, u->bufs + (size_t)bid * URING_RECV_BUFFER_SIZE, cqe->res, loop->ctx);
+        recycle_buffer(u, bid);
+    }
+
+    // closed by the client, or out of buffers which just rearms it
+    if (cqe->res == 0 && conn->state == CLIENT_READING_REQUEST)
+        client_received(conn, NULL, 0, loop->ctx);
+    else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED && conn->state == CLIENT_READING_REQUEST)
+    {
+        printf("recv_request: %s\n", strerror(-cqe->res));
+        conn->state = CLIENT_CLOSING;
+    }
+}
+
+static void complete_write(ClientConn *conn, int op, int res)
+{
+    size_t expected = op == URING_OP_SEND_HEAD ? conn->head_len : op == URING_OP_FILES_UPDATE ? 1 : conn->chunk_len;
+    if (res < 0 || (size_t)res != expected)
+    {
+        // the rest of its chain comes back cancelled
+        if (conn->state == CLIENT_WRITING_RESPONSE && res != -ECANCELED)
+            printf("failed to send response to client\n");
+        conn->state = CLIENT_CLOSING;
+        return;
+    }
+
+    if (op == URING_OP_SEND_HEAD)
+        conn->head_sent = conn->head_len;
+    else if (op == URING_OP_SEND_BODY)
+        conn->body_sent += res;
+
+    if (op == URING_OP_SEND_HEAD || op == URING_OP_SEND_BODY)
+        conn->io_deadline = phase_deadline(&conn->deadline, PHASE_BODY);
+}
+
+static void complete_accept(EventLoop *loop, struct io_uring_cqe *cqe)
+{
+    UringLoop *u = loop->uring;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        u->accept_armed = 0;
+
+    if (cqe->res < 0)
+    {
+        // out of fds, the sweep accepts again
+        if (cqe->res != -ECANCELED)
+            printf("accept: %s\n", strerror(-cqe->res));
+        if (!u->accept_armed && cqe->res != -EMFILE && cqe->res != -ENFILE)
+            arm_accept(loop);
+        return;
+    }
+
+    ClientConn *conn = create_client_conn(cqe->res, loop);
+    if (!conn)
+    {
+        close(cqe->res);
+        return;
+    }
+
+    STATS_INC(clients_accepted);
+    STATS_INC(clients_open);
+    link_client(loop, conn);
+    arm_recv(u, conn);
+
+    if (!u->accept_armed)
+        arm_accept(loop);
+}
+
+// writes the responses of the connections the workers are done with
+static void take_fetched(EventLoop *loop)
+{
+    pthread_mutex_lock(&loop->done_lock);
+    ClientConn *conn = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (conn)
+    {
+        ClientConn *next = conn->next;
+        link_client(loop, conn);
+        conn->cancelling = 0;
+        advance_conn(loop, conn);
+        conn = next;
+    }
+
+    arm_wake(loop);
+}
+
+static void complete(EventLoop *loop, struct io_uring_cqe *cqe)
+{
+    if (cqe->user_data == URING_UD_IGNORE)
+        return;
+    if (cqe->user_data == URING_UD_ACCEPT)
+    {
+        complete_accept(loop, cqe);
+        return;
+    }
+    if (cqe->user_data == URING_UD_WAKE)
+    {
+        take_fetched(loop);
+        return;
+    }
+
+    ClientConn *conn = (ClientConn *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+    int op = (int)(cqe->user_data & URING_OP_MASK);
+
+    // multishot recvs complete many times, only their last completion ends them
+    if (op != URING_OP_RECV || !(cqe->flags & IORING_CQE_F_MORE))
+        conn->pending--;
+
+    if (op == URING_OP_RECV)
+        complete_recv(loop, conn, cqe);
+    else
+        complete_write(conn, op, cqe->res);
+
+    if (!conn->pending)
+        conn->cancelling = 0;
+    advance_conn(loop, conn);
+}
+
+// answers 408 to clients too slow sending their request, drops those too slow reading the response
+static void sweep_conns(EventLoop *loop)
+{
+    long now = monotonic_ms();
+    ClientConn *conn = loop->conns;
+    while (conn)
+    {
+        ClientConn *next = conn->next;
+        if (is_client_late(conn, now))
+        {
+            client_timed_out(conn);
+            advance_conn(loop, conn);
+        }
+        conn = next;
+    }
+
+    // stopped when out of fds
+    if (!loop->uring->accept_armed)
+        arm_accept(loop);
+}
+
+void run_uring_loop(EventLoop *loop)
+{
+    // created here as only the thread that made a ring may submit to it
+    UringLoop *u = create_ring();
+    if (!u)
+    {
+        perror("io_uring_setup");
+        exit(EXIT_FAILURE);
+    }
+    loop->uring = u;
+
+    arm_accept(loop);
+    arm_wake(loop);
+
+    long next_sweep = monotonic_ms() + EVENT_LOOP_SWEEP_MS;
+    while (1)
+    {
+        long left = next_sweep - monotonic_ms();
+        submit_and_wait(u, 1, left > 0 ? left : 0);
+
+        // each completion is copied out first, handling it may queue sqes and flush them
+        unsigned head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            complete(loop, &cqe);
+        }
+
+        if (monotonic_ms() >= next_sweep)
+        {
+            sweep_conns(loop);
+            next_sweep = monotonic_ms() + EVENT_LOOP_SWEEP_MS;
+        }
+    }
+}
+
+#else
+
+int uring_supported(void)
+{
+    return 0;
+}
+
+void run_uring_loop(EventLoop *loop)
+{
+    (void)loop;
+    fprintf(stderr, "built without io_uring\n");
+    exit(EXIT_FAILURE);
+}
+
+#endif
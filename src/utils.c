@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "../include/utils.h"
 
 // will read the full file and update the file_size provided var, file must be present
@@ -99,4 +100,86 @@ int urls_are_equivalent(const char *a, const char *b)
         len_b--;
 
     return len_a == len_b && strncmp(a, b, len_a) == 0;
+}
+
+uint64_t hash_string(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+size_t get_env_size(const char *name, size_t default_value)
+{
+    return parse_size(getenv(name), default_value);
+}
+
+size_t parse_size(const char *value, size_t default_value)
+{
+    if (!value || !*value)
+        return default_value;
+
+    char *end = NULL;
+    unsigned long long size = strtoull(value, &end, 10);
+    if (end == value)
+        return default_value;
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+    case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+    case 'k':
+        size *= 1024;
+        break;
+    case '\0':
+        break;
+    default:
+        return default_value;
+    }
+
+    return (size_t)size;
+}
+
+time_t parse_http_date(const char *value)
+{
+    if (!value)
+        return 0;
+
+    while (*value == ' ')
+        value++;
+
+    // IMF-fixdate, the only format servers are allowed to send
+    struct tm tm = {0};
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end)
+        return 0;
+
+    return timegm(&tm);
 }
\ No newline at end of file
@@ -0,0 +1,315 @@
+#include "../include/write-behind.h"
+
+static size_t job_bucket(const char *key)
+{
+    return hash_string(key) % WRITE_BEHIND_BUCKETS;
+}
+
+// unlinks the job from its bucket, caller must hold the lock
+static void bucket_unlink(WriteBehind *wb, WriteJob *job)
+{
+    WriteJob **pp = &wb->buckets[job_bucket(job->key)];
+    while (*pp && *pp != job)
+        pp = &(*pp)->bucket_next;
+    if (*pp)
+        *pp = job->bucket_next;
+}
+
+// whether another job of the key is being written, caller must hold the lock
+static int is_key_writing(WriteBehind *wb, const WriteJob *job)
+{
+    for (WriteJob *other = wb->buckets[job_bucket(job->key)]; other; other = other->bucket_next)
+    {
+        if (other->writing && strcmp(other->key, job->key) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void free_job(WriteJob *job)
+{
+    release_cache_object(job->object);
+    free(job->url);
+    free(job);
+}
+
+static void *writer_thread_func(void *arg)
+{
+    WriteBehind *wb = (WriteBehind *)arg;
+    WriteJob *batch[WRITE_BEHIND_BATCH];
+
+    while (1)
+    {
+        pthread_mutex_lock(&wb->lock);
+
+        // taking several jobs per wakeup keeps lock traffic low under bursts,
+        // a job whose key is being written waits for that write so the older
+        // response can never land last, wait until some response can be written
+        int n = 0;
+        while (1)
+        {
+            WriteJob **pp = &wb->head;
+            WriteJob *prev = NULL;
+            while (*pp && n < WRITE_BEHIND_BATCH)
+            {
+                WriteJob *job = *pp;
+                if (is_key_writing(wb, job))
+                {
+                    prev = job;
+                    pp = &job->next;
+                    continue;
+                }
+
+                *pp = job->next;
+                if (wb->tail == job)
+                    wb->tail = prev;
+                job->next = NULL;
+                wb->count--;
+
+                job->writing = 1;
+                batch[n++] = job;
+            }
+
+            if (n)
+                break;
+            pthread_cond_wait(&wb->not_empty, &wb->lock);
+        }
+
+        pthread_cond_broadcast(&wb->not_full);
+        pthread_mutex_unlock(&wb->lock);
+
+        for (int i = 0; i < n; i++)
+        {
+            WriteJob *job = batch[i];
+            uint64_t version = lru_insert(wb->cache, job->url, job->object->body, job->object->length,
+                                          job->object->content_type, &job->meta);
+
+            pthread_mutex_lock(&wb->lock);
+            bucket_unlink(wb, job);
+            int cancelled = job->cancelled;
+
+            // a newer job of the key may have been held back by this write
+            if (wb->count)
+                pthread_cond_signal(&wb->not_empty);
+            pthread_mutex_unlock(&wb->lock);
+
+            // deleted while it was being written, the file must not outlive that,
+            // only this write is undone, a newer one of the key may be queued or done
+            if (cancelled)
+                lru_undo_insert(wb->cache, job->url, version);
+
+            free_job(job);
+        }
+    }
+
+    return NULL;
+}
+
+WriteBehind *start_write_behind(CacheLRU *cache, size_t capacity, int n_threads, WriteFullPolicy full_policy)
+{
+    if (n_threads <= 0 || capacity == 0)
+        return NULL;
+
+    WriteBehind *wb = (WriteBehind *)calloc(1, sizeof(WriteBehind));
+    if (!wb)
+        return NULL;
+
+    wb->cache = cache;
+    wb->capacity = capacity;
+    wb->full_policy = full_policy;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->not_empty, NULL);
+    pthread_cond_init(&wb->not_full, NULL);
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writer_thread_func, wb) != 0)
+        {
+            perror("pthread_create");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    cache->write_behind = wb;
+    return wb;
+}
+
+int parse_write_full_policy(const char *name, WriteFullPolicy *policy)
+{
+    if (strcasecmp(name, "block") == 0)
+        *policy = WRITE_FULL_BLOCK;
+    else if (strcasecmp(name, "drop") == 0)
+        *policy = WRITE_FULL_DROP;
+    else if (strcasecmp(name, "sync") == 0)
+        *policy = WRITE_FULL_SYNC;
+    else
+        return 0;
+
+    return 1;
+}
+
+void submit_cache_write(CacheLRU *cache, const char *url, CacheObject *object, const CacheMeta *meta,
+                        Deadline *deadline)
+{
+    WriteBehind *wb = cache->write_behind;
+    if (!wb)
+    {
+        lru_insert(cache, url, object->body, object->length, object->content_type, meta);
+        return;
+    }
+
+    char *key = get_cache_key(url);
+    if (!key)
+        return;
+
+    pthread_mutex_lock(&wb->lock);
+
+    // a queued write of the same key just takes the newer response
+    for (WriteJob *job = wb->buckets[job_bucket(key)]; job; job = job->bucket_next)
+    {
+        if (strcmp(job->key, key) != 0)
+            continue;
+
+        // one being written needn't be undone anymore, this write replaces it
+        if (job->writing)
+        {
+            job->cancelled = 0;
+            continue;
+        }
+
+        release_cache_object(job->object);
+        job->object = retain_cache_object(object);
+        job->meta = *meta;
+        pthread_mutex_unlock(&wb->lock);
+        free(key);
+        return;
+    }
+
+    // a blocked write waits a short while, never longer than the request it came with
+    long until = phase_deadline(deadline, PHASE_WRITE);
+    int timed_out = 0;
+    while (wb->count >= wb->capacity)
+    {
+        if (wb->full_policy == WRITE_FULL_DROP || timed_out)
+        {
+            pthread_mutex_unlock(&wb->lock);
+            STATS_INC(writes_dropped);
+            printf("write queue full, not caching: %s\n", url);
+            free(key);
+            return;
+        }
+
+        if (wb->full_policy == WRITE_FULL_SYNC)
+        {
+            pthread_mutex_unlock(&wb->lock);
+            STATS_INC(writes_sync);
+            lru_insert(cache, url, object->body, object->length, object->content_type, meta);
+            free(key);
+            return;
+        }
+
+        timed_out = !wait_cond(deadline, &wb->not_full, &wb->lock, until);
+    }
+
+    WriteJob *job = calloc(1, sizeof(WriteJob));
+    if (!job || !(job->url = strdup(url)))
+    {
+        pthread_mutex_unlock(&wb->lock);
+        free(job);
+        free(key);
+        return;
+    }
+    strcpy(job->key, key);
+    job->object = retain_cache_object(object);
+    job->meta = *meta;
+
+    if (wb->tail)
+        wb->tail->next = job;
+    else
+        wb->head = job;
+    wb->tail = job;
+    wb->count++;
+
+    // newest first, so lookups see the latest response of the key
+    size_t bucket = job_bucket(key);
+    job->bucket_next = wb->buckets[bucket];
+    wb->buckets[bucket] = job;
+
+    STATS_INC(writes_queued);
+    pthread_cond_signal(&wb->not_empty);
+    pthread_mutex_unlock(&wb->lock);
+    free(key);
+}
+
+CacheObject *find_pending_write(WriteBehind *wb, const char *key, CacheMeta *meta)
+{
+    if (!wb)
+        return NULL;
+
+    CacheObject *object = NULL;
+
+    pthread_mutex_lock(&wb->lock);
+    for (WriteJob *job = wb->buckets[job_bucket(key)]; job; job = job->bucket_next)
+    {
+        if (!job->cancelled && strcmp(job->key, key) == 0)
+        {
+            object = retain_cache_object(job->object);
+            *meta = job->meta;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return object;
+}
+
+void cancel_pending_write(WriteBehind *wb, const char *key)
+{
+    if (!wb)
+        return;
+
+    pthread_mutex_lock(&wb->lock);
+
+    WriteJob **pp = &wb->buckets[job_bucket(key)];
+    while (*pp)
+    {
+        WriteJob *job = *pp;
+        if (strcmp(job->key, key) != 0)
+        {
+            pp = &job->bucket_next;
+            continue;
+        }
+
+        // writer owns it now, it deletes the entry once written
+        if (job->writing)
+        {
+            job->cancelled = 1;
+            pp = &job->bucket_next;
+            continue;
+        }
+
+        // still queued, take it out of the fifo as well
+        *pp = job->bucket_next;
+
+        WriteJob **fp = &wb->head;
+        WriteJob *prev = NULL;
+        while (*fp && *fp != job)
+        {
+            prev = *fp;
+            fp = &(*fp)->next;
+        }
+        if (*fp)
+            *fp = job->next;
+        if (wb->tail == job)
+            wb->tail = prev;
+        wb->count--;
+
+        free_job(job);
+    }
+
+    pthread_cond_broadcast(&wb->not_full);
+    pthread_mutex_unlock(&wb->lock);
+}